@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <dirent.h>
@@ -10,477 +11,9628 @@
 #include <linux/limits.h>
 #include <libgen.h>
 #include <sys/wait.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <stddef.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define MAX_LINE 128
+#define SNAPSHOT_READ_BUFFER_SIZE (1024 * 1024) //Read size used when streaming snapshot files
+#define OUTPUT_BLOCK_SIZE (256 * 1024) //Size of each block collecting small writes before they reach a file
+#define OUTPUT_BLOCK_COUNT 4 //Blocks written by a single writev call
+#define SCAN_BUFFER_SIZE (1024 * 1024) //Chunk size the content scanner reads files with
+#define MAX_SCAN_FIRST_BYTES 16 //Distinct first bytes of patterns the SIMD prefilter can check
+#define ANALYSIS_SCRIPT "./verify_for_malicious.sh" //Optional external analyzer (-x)
+#define ANALYSIS_QUEUE_SIZE 256 //Suspicious files waiting for an analysis worker before the traversal has to wait
+#define ANALYSIS_TIMED_OUT -2 //Verdict of an analysis given up after the per file timeout (-t)
+#define SCAN_WATCHDOG_SIGNAL (SIGRTMIN + 1) //Signal that interrupts a read of the content scanner past its deadline
+#define SCAN_WATCHDOG_INTERVAL_NS (10 * 1000 * 1000) //Period the watchdog keeps firing at, in case a signal lands just before the read blocks
+#define WRITER_RING_SIZE 1024 //Slots between the traversal and the snapshot writer thread, a power of two
+#define ENTRY_RECORD_PATH_SIZE 480 //Paths up to this length are copied into the ring slot itself
+#define SNAPSHOT_FORMAT_TEXT 0 //Four readable lines per entry
+#define SNAPSHOT_FORMAT_BINARY 1 //Fixed size records with prefix compressed paths, a path index and a footer
+#define BINARY_SNAPSHOT_MAGIC "OS_SNAP" //First and last 8 bytes of a binary snapshot, terminator included
+#define BINARY_SNAPSHOT_VERSION 4 //Version 2 added a digest per record, version 3 the directory summaries, version 4 widened the hard link count; older files are still read
+#define BINARY_RESTART_INTERVAL 16 //Every 16th record stores its full path and is listed in the path index
+#define TEXT_INDEX_MAGIC "OS_TIDX" //First 8 bytes of the path index kept next to a text snapshot, terminator included
+#define TEXT_INDEX_VERSION 1
+#define TEXT_INDEX_SUFFIX ".idx" //Added to the name of a text snapshot to name its path index
+#define QUERY_ENTRY 0 //Selections of the query subcommand: one path,
+#define QUERY_SUBTREE 1 //a path and everything below it (-s),
+#define QUERY_PREFIX 2 //every path starting with a string (-p)
+#define GETDENTS_BUFFER_SIZE (256 * 1024) //Size of the getdents64 batch buffer owned by every traversal worker
+#define MAX_OPEN_DIR_FDS 512 //Directory fds the parallel traversal may keep open at once, deeper queues are opened by path
+#define ARENA_CHUNK_SIZE (1024 * 1024) //Size of the blocks arenas allocate from, larger requests get a block of their own
+#define ARENA_ALIGNMENT _Alignof(max_align_t) //Every arena allocation starts on this boundary
+#define MAX_BUFFERED_ENTRIES (64 * 1024) //Entries the parallel traversal reads ahead of the snapshot writer, its workers pause above it
+#define INODE_TABLE_SHARDS 64 //Separately locked parts of the inode table (-U), selected by the top 6 bits of the inode hash
+#define INODE_TABLE_INITIAL_BUCKETS 256 //Buckets of a part of the inode table when its first inode is added
+#define INODE_NOT_ANALYZED 0 //Analysis of a hard-linked file (-U): none of its paths analyzed yet,
+#define INODE_ANALYZING 1 //one path being analyzed, the others wait for its verdict,
+#define INODE_SAFE 2 //found safe,
+#define INODE_MALICIOUS 3 //found malicious, every path of it is quarantined
+#define GENTREE_LINE_LENGTH 64 //Length of the lines of digits generated files are filled with
+#define GENTREE_MAX_FILE_SIZE (64 * 1024 * 1024) //Largest file size gentree accepts (-z)
+#define TEXT_ENTRY_SIZE_ESTIMATE 80 //Average bytes per entry of a text snapshot, used to rank the monitored directories by size
+#define STATS_HISTOGRAM_BUCKETS 24 //Latency histogram buckets, bucket i counts the calls shorter than 2^i microseconds
+#define PHASE_SETUP 0 //Phases of a snapshot, timed on the main thread of its child process
+#define PHASE_TRAVERSAL 1
+#define PHASE_ANALYSIS_WAIT 2
+#define PHASE_OUTPUT 3
+#define PHASE_COMPARE 4
+#define NUM_PHASES 5
+#define HISTORY_MANIFEST_SUFFIX "_History.txt" //Manifest listing the generations of a monitored directory, newest first
+#define DELTA_REMOVED_SIZE -1 //Size of the delta records of entries the older generation does not have
+#define QUARANTINE_MANIFEST "Quarantine_Manifest.txt" //Log of every quarantined file, kept in the isolated directory
+#define QUARANTINE_SYNC_BATCH 64 //Quarantined files made durable together by one round of fsync calls
+#define QUARANTINE_MAX_NAME_ATTEMPTS 1000 //Numbered names tried for a file whose name is already in quarantine
+#define QUARANTINE_COPY_CHUNK (8 * 1024 * 1024) //Bytes per copy_file_range call when the isolated directory is on another file system
+#define GOVERNOR_BURST_SECONDS 0.1 //Budget the governor (-G) lets through at once after an idle moment
+#define GOVERNOR_BYTES_PER_OP (128 * 1024) //Bytes read that pay the backoff pause of one operation
+#define GOVERNOR_ADJUST_INTERVAL 0.1 //Seconds between two backoff decisions
+#define GOVERNOR_PSI_INTERVAL 1.0 //Seconds between two reads of /proc/pressure/io
+#define GOVERNOR_LATENCY_WEIGHT 0.05 //Weight of a new stat or read latency in the moving average of its kind
+#define GOVERNOR_OP_STAT 0 //Kinds of operation the governor keeps a latency average for, a stat or directory read
+#define GOVERNOR_OP_READ 1 //A read of file content, its latency counted per GOVERNOR_BYTES_PER_OP bytes
+#define GOVERNOR_NUM_OPS 2
+#define GOVERNOR_MIN_PAUSE 0.00005 //Smallest backoff pause per operation, in seconds, smaller ones end the backoff
+#define GOVERNOR_MAX_PAUSE 0.002 //Largest backoff pause per operation, in seconds, the scan keeps going at 500 operations per second
+#define GOVERNOR_IOPRIO_WHO_PROCESS 1 //Arguments of the ioprio_set system call, glibc has no wrapper or constants for it
+#define GOVERNOR_IOPRIO_SHIFT 13
+#define GOVERNOR_IOPRIO_BE 2
+#define GOVERNOR_IOPRIO_IDLE 3
+#define WATCH_EVENT_BUFFER_SIZE (64 * 1024) //Read size of the inotify event queue in watch mode (-w)
+#define WATCH_EVENT_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#define WATCH_CHANGE_ENTRY 0 //The entry named by an event is stat'ed again
+#define WATCH_CHANGE_TREE 1 //A directory came or went, its old subtree is dropped and the new one read
+#define HASH_NONE 0 //No content digest is recorded
+#define HASH_XXH64 1 //64 bit xxHash, fast and non cryptographic
+#define HASH_SHA256 2 //SHA-256
+#define HASH_MAX_DIGEST_SIZE 32 //Largest digest of the supported hash functions
+#define HASH_READ_SIZE (128 * 1024) //Chunk size files are hashed with
+#define BINARY_HASH_FLAGS_MASK 0x3 //Low bits of the binary header flags: hash function of the digest stored in every record
+#define HASH_CACHE_MAGIC "OS_HASH" //First 8 bytes of a hash cache file, terminator included
+#define HASH_CACHE_VERSION 2
+#define VERDICT_CACHE_MAGIC "OS_VERD" //First 8 bytes of a verdict cache file, terminator included
+#define VERDICT_CACHE_VERSION 2 //Also covers the behaviour of the built-in scanner, raising it drops every cached verdict
+#define XXH64_PRIME1 0x9E3779B185EBCA87ULL //Constants of the 64 bit xxHash
+#define XXH64_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH64_PRIME3 0x165667B19E3779F9ULL
+#define XXH64_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH64_PRIME5 0x27D4EB2F165667C5ULL
 
 int numProcesses = 0;  //Counts the number of child processes 
 int numSubProcesses = 0;  //Counts the number of grandchildren processes for each child process
 int numCorruptedFiles = 0; // Counts the number of potential malecious files
 
+int numTraversalThreads = 1; // Number of directory workers used for the traversal (-j), 1 keeps the serial walk
+int snapshotFormat = SNAPSHOT_FORMAT_TEXT; // Format of the snapshots written (-f)
+int syncSnapshots = 0; // Flushes the snapshot to disk with fdatasync once it is complete (-F)
+int hashAlgorithm = HASH_NONE; // Content digest recorded for every regular file (-H)
+int maxParallelRoots = 0; // Monitored directories snapshotted at the same time (-P), 0 runs all of them at once
+int fastRescan = 0; // Reuses the listings of directories whose mtime and ctime did not change since the previous snapshot (-R)
+int historyGenerations = 0; // Past generations kept as reverse deltas (-k), 0 keeps only the latest snapshot
+int contentAddressedQuarantine = 0; // Quarantined files are named after the SHA-256 of their content, a repeated sample is kept once (-C)
+int sharedInodes = 0; // Snapshots every monitored directory in this process, an inode reached by several paths or roots is stat'ed and analyzed once (-U)
+double watchInterval = 0; // Seconds between the refreshes of the snapshot in watch mode (-w), 0 takes one snapshot and exits
+volatile sig_atomic_t stopWatching = 0; // Set by SIGINT or SIGTERM, watch mode writes a last snapshot and exits
+long long numSnapshotEntries = 0; // Entries written to the snapshot of the monitored directory
+int analyzeEntries = 1; // Cleared by the benchmark, which times the traversal and the analysis separately
+int numAnalysisWorkers = 4; // Threads analyzing suspicious files next to the traversal (-a), 0 analyzes them inline
+double analysisTimeout = 0; // Seconds the analysis of one file may take before it is given up (-t), 0 never gives up
+
 const char *monitoredDirName; //Only stores the name of the monitored directory, not the full path
+const char *phaseNames[NUM_PHASES] = {"setup", "traversal", "analysis_wait", "output", "compare"}; //Names of the phases in the statistics file
+
+//Phase times and counters of one monitored directory, counted by every thread of its child process and sent to the parent with its report
+typedef struct RunStats
+{
+    double phaseWall[NUM_PHASES]; //Seconds each phase took
+    double phaseCpu[NUM_PHASES]; //CPU seconds of the whole process during each phase, every thread included
+    atomic_llong statCalls;
+    atomic_llong dirReads; //scandir or getdents64 calls
+    atomic_llong writeCalls; //write and writev calls
+    atomic_llong bytesWritten;
+    atomic_llong filesHashed;
+    atomic_llong bytesHashed;
+    atomic_llong filesAnalyzed;
+    atomic_llong bytesAnalyzed; //Read by the built-in scanner, the script reads the files itself
+    atomic_llong analysisMicros; //Wall time of every analysis, they overlap the traversal and each other
+    atomic_llong analysisCpuMicros; //CPU time of the threads analyzing, without the script processes
+    atomic_llong filesQuarantined;
+    atomic_llong quarantineMicros;
+    atomic_llong quarantineCopies; //Files copied to an isolated directory on another file system
+    atomic_llong quarantineDuplicates; //Samples already in a content addressed quarantine (-C)
+    atomic_llong subtreesSkipped; //Identical subtrees the compare went past
+    atomic_llong directoriesReused; //Unchanged directories the fast rescan did not read
+    atomic_llong watchEvents; //inotify events read in watch mode
+    atomic_llong governorWaitMicros; //Time the governor held operations back, summed over the threads
+    atomic_llong governorBackoffs; //Backoff decisions that raised the pause
+    atomic_llong watchRefreshes; //Snapshots written from memory in watch mode
+    atomic_llong watchRescans; //Full rescans after an event queue overflow
+    atomic_llong arenaBytes; //Largest size of the arenas holding the names and directories of the traversal
+    atomic_llong statsShared; //Hard links whose stat came from the inode table (-U)
+    atomic_llong analysesShared; //Hard links that took the verdict of another path of the same file (-U)
+    atomic_llong entriesDerived; //Entries copied from the snapshot of an overlapping root (-U)
+    atomic_llong statLatency[STATS_HISTOGRAM_BUCKETS];
+    atomic_llong analysisLatency[STATS_HISTOGRAM_BUCKETS];
+} RunStats;
+
+RunStats runStats; //Statistics of the monitored directory of this child process
+
+//Token buckets of the budgets (-G), mapped before the child processes are forked so the rates hold for the whole run
+typedef struct GovernorBudget
+{
+    pthread_mutex_t lock; //Process shared and robust, a child killed while holding it does not stop the others
+    double opsTokens;
+    double bytesTokens;
+    double lastRefill;
+} GovernorBudget;
+
+//Budgets and backoff of the traversal, hashing and analysis I/O (-G), the backoff is kept by every child process for itself
+typedef struct Governor
+{
+    int enabled;
+    pthread_mutex_t lock;
+    double opsRate; //Metadata operations per second (ops=), 0 for no budget
+    double bytesRate; //Bytes read per second (bytes=), 0 for no budget
+    GovernorBudget *budget; //Shared by every process of the run, NULL without budgets
+    double latencyTarget; //Seconds (latency= takes milliseconds), 0 keeps the latency out of the backoff
+    double psiThreshold; //Percent of time some task waited for I/O (psi=), 0 keeps the pressure out of the backoff
+    double latencyAverage[GOVERNOR_NUM_OPS]; //Moving average of the latencies seen, by kind of operation
+    double psiSome; //Last avg10 read from /proc/pressure/io
+    double nextAdjust;
+    double nextPsiRead;
+    double pause; //Seconds every operation waits on top of the budgets while the disk is under pressure
+    int ioprioClass; //0 keeps the inherited I/O priority
+    int ioprioLevel;
+    int setNice;
+    int niceValue;
+} Governor;
+
+Governor governor = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+//Layout of the records returned by the getdents64 system call
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+//Block of an arena, allocations are carved from it in order and only released with the whole block
+typedef struct ArenaChunk
+{
+    struct ArenaChunk *previous; //Block filled before this one
+    size_t size; //Bytes available in data
+    size_t used;
+    _Alignas(max_align_t) unsigned char data[];
+} ArenaChunk;
+
+//Bump allocator for data that lives as long as one traversal, freed at once instead of per entry
+typedef struct Arena
+{
+    ArenaChunk *chunk; //Block allocations are taken from, NULL before the first one
+    size_t bytes; //Bytes held in blocks
+    size_t peakBytes;
+} Arena;
+
+//Position of an arena to roll back to, for data used in a stack like order (names of the directories being walked)
+typedef struct ArenaMark
+{
+    ArenaChunk *chunk;
+    size_t used;
+} ArenaMark;
+
+typedef struct DirNode DirNode;
+
+//One directory entry collected by the parallel traversal
+typedef struct TreeEntry
+{
+    const char *name; //Name of the entry inside its parent directory, in the block of its directory
+    struct stat st; //Information returned by fstatat for the entry
+    DirNode *child; //Subtree of the entry if it is a directory, NULL otherwise
+    unsigned char *digest; //Content digest computed by the worker (-H), NULL if there is none
+} TreeEntry;
+
+//A directory collected by the parallel traversal, its entries are sorted by name like in the serial walk.
+//It is freed by the emitter once its subtree is in the snapshot, its parent always outlives it.
+struct DirNode
+{
+    DirNode *parent;
+    const char *name; //Name inside the parent directory (the monitored path itself for the root)
+    int fd; //Directory fd opened by the worker that found it, -1 if it has to be opened by path
+    int owner; //Deque the directory was queued on, where the emitter looks for it if it needs it before a worker took it
+    int openFailed; //Set if the directory could not be opened
+    atomic_int ready; //Set once the directory is read, hashed and holds no more work for any worker
+    const char *statFailedName; //Entry whose fstatat failed, the listing stops there like in the serial walk
+    TreeEntry *entries; //One block with the entries, their digests and their names, allocated once the directory is read
+    size_t numEntries;
+};
+
+//Per worker deque of directories: the owner pushes and pops at the tail, idle workers steal the oldest task from the head
+typedef struct WorkDeque
+{
+    pthread_mutex_t lock;
+    DirNode **tasks;
+    size_t head;
+    size_t tail;
+    size_t capacity; //Always a power of two
+} WorkDeque;
+
+typedef struct TraversalPool
+{
+    WorkDeque *deques; //One per worker, plus one for the directories the emitter reads itself
+    int numWorkers;
+    atomic_long pendingTasks; //Directories pushed but not yet fully read, the traversal ends when it drops to 0
+    atomic_int openDirFds; //Directory fds currently held by queued tasks
+    atomic_long bufferedEntries; //Entries read but not yet emitted, the workers pause above MAX_BUFFERED_ENTRIES
+    atomic_int cancelled; //Set when the snapshot cannot be written any more, directories still queued are not read
+} TraversalPool;
+
+typedef struct TraversalWorker
+{
+    TraversalPool *pool;
+    int id;
+    pthread_t thread;
+    char *direntBuffer; //getdents64 batch buffer
+    Arena arena; //Names of the directory being read, released once they are copied to the block of the directory
+    TreeEntry *scratch; //Entries of the directory being read, copied to the block of the directory once they are all known
+    size_t scratchCapacity;
+} TraversalWorker;
+
+//Monitored directory snapshotted in single-process mode (-U), the directories it recorded are copied from its snapshot once that is complete
+typedef struct SharedRoot
+{
+    const char *snapshotFile;
+    int complete; //Set once the snapshot is written out
+} SharedRoot;
+
+//Path of a hard-linked file waiting for the verdict of another path of it
+typedef struct PendingLink
+{
+    const char *path;
+    struct PendingLink *next;
+} PendingLink;
+
+//Inode met in single-process mode (-U): a file with several hard links, or a directory and the snapshot it was recorded in
+typedef struct InodeRecord
+{
+    dev_t dev;
+    ino_t ino;
+    struct stat st; //Taken once, every other path of a hard-linked file gets a copy
+    const char *path; //Path of a directory in the snapshot of its root
+    SharedRoot *root; //Root whose snapshot lists the directory, NULL for files
+    int analysis; //INODE_NOT_ANALYZED, INODE_ANALYZING, INODE_SAFE or INODE_MALICIOUS
+    PendingLink *pendingLinks; //Paths met while the analysis was running
+    struct InodeRecord *next; //Next record of the same bucket
+} InodeRecord;
+
+//Part of the inode table, with its own lock and arena so the traversal threads rarely contend
+typedef struct InodeShard
+{
+    pthread_mutex_t lock;
+    InodeRecord **buckets; //Chained hash table, NULL before the first record
+    size_t mask; //Buckets minus one, the number of buckets is a power of two
+    size_t numRecords;
+    Arena arena; //Records of this part
+} InodeShard;
+
+//Inodes shared by the monitored directories of a single-process run (-U), kept until the last directory is done
+typedef struct InodeTable
+{
+    InodeShard shards[INODE_TABLE_SHARDS];
+    Arena arena; //Paths, roots and pending links, only used by the main thread
+    SharedRoot *currentRoot; //Root being snapshotted, NULL while its directories cannot be shared
+} InodeTable;
+
+InodeTable *inodeTable; //Inode table of a single-process run (-U), NULL otherwise
+
+//Name read by the serial walk, with the inode and type of its directory entry
+typedef struct WalkName
+{
+    const char *name;
+    ino_t ino;
+    unsigned char type;
+} WalkName;
+
+//One monitored directory of the run, in the order of the arguments
+typedef struct RootRun
+{
+    char *path;
+    char name[NAME_MAX + 1]; //Name of the directory, like monitoredDirName in its child process
+    long long weight; //Entries of its previous snapshot, estimated for text snapshots, -1 without one
+    pid_t pid;
+    double startTime;
+    double duration; //Wall time of its child process
+    long long entries; //Entries reported by the child, -1 without a report
+    int corruptedFiles;
+    int exitStatus; //Exit status of the child, 128 plus the signal number if it was killed, -1 if it never ran
+    RunStats stats; //Sent with the report
+} RootRun;
+
+//Result a child process sends back through the report pipe, small enough to be written atomically
+typedef struct RootReport
+{
+    int index; //Position of the directory in the arguments
+    int corruptedFiles;
+    long long entries;
+    RunStats stats;
+} RootReport;
+
+_Static_assert(sizeof(RootReport) <= PIPE_BUF, "Reports must be written to the pipe atomically");
+
+//One generation in the history manifest of a monitored directory
+typedef struct HistoryGeneration
+{
+    char timestamp[64]; //Timestamp in the name of the snapshot it was taken as
+    long long entries; //-1 for snapshots from before the manifest
+    char file[NAME_MAX + 1]; //Full snapshot for the newest generation, reverse delta against the next newer one for the others
+} HistoryGeneration;
+
+//One measurement of the benchmark
+typedef struct BenchResult
+{
+    const char *phase; //traversal, snapshot, diff, analysis or quarantine
+    const char *cache; //warm, or cold when the page cache was dropped before the phase
+    int run;
+    long long items; //Entries or files processed
+    long long bytes; //Bytes of the snapshots written or compared, of the files analyzed
+    double wallSeconds;
+    double cpuSeconds; //User and system time of all threads
+} BenchResult;
+
+//Growable buffer used to rebuild entry paths while emitting a collected tree
+typedef struct PathBuffer
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+} PathBuffer;
+
+//One entry of a snapshot file, parsed back from its text lines
+typedef struct SnapshotEntry
+{
+    char *path;
+    long long size;
+    mode_t mode; //File type and permission bits, text snapshots only record the nine rwx bits
+    long hardLinks;
+    int hashAlgorithm; //Hash function of the digest, HASH_NONE for entries without one
+    unsigned char digest[HASH_MAX_DIGEST_SIZE];
+    long long mtime; //Nanoseconds, only recorded for the directories of binary snapshots
+    long long ctime;
+} SnapshotEntry;
+
+//Summary of a directory of a binary snapshot, kept in a table between the records and the path index
+typedef struct DirectorySummary
+{
+    uint64_t recordOffset; //Offset of the record of the directory, the table is sorted by it
+    uint64_t subtreeEnd; //Offset of the first record after the subtree of the directory
+    int64_t mtime; //Nanoseconds
+    int64_t ctime;
+    uint64_t treeHash; //Merkle hash of the records of the subtree, equal hashes mean equal subtrees
+} DirectorySummary;
+
+//Locates the directory summaries, placed right before the path index
+typedef struct DirectoryTableTrailer
+{
+    uint64_t offset;
+    uint64_t numDirectories;
+} DirectoryTableTrailer;
+
+//Directory of the binary snapshot being written whose subtree is not complete yet
+typedef struct OpenDirectory
+{
+    size_t pathLength; //Its path is this prefix of the path of the innermost open directory
+    size_t summaryIndex;
+    uint64_t childrenHash; //Rolling hash of its children so far
+    uint64_t recordHash; //Hash of its own record, combined with its subtree hash once complete
+} OpenDirectory;
+
+//Streams the entries of a snapshot file in order, text snapshots through a bounded buffer and binary ones through a mapping
+typedef struct SnapshotReader
+{
+    int format;
+    int fd;
+    char *buffer;
+    size_t start; //First unread byte of the buffer
+    size_t end; //End of the bytes read from the file
+    size_t capacity;
+    int eof;
+    SnapshotEntry entry; //Entry returned by the last NextSnapshotEntry call
+    size_t pathCapacity;
+    char *previousPath; //Path of the entry before, used to check the snapshot is sorted
+    size_t previousCapacity;
+    const unsigned char *mapping; //Binary snapshot mapped in memory
+    size_t mappingSize;
+    uint64_t position; //Offset of the next record in the mapping
+    uint64_t recordsEnd; //Offset where the records stop and the path index starts
+    const uint64_t *restartOffsets; //Path index: offsets of the records storing a full path, in path order
+    uint64_t numRestarts;
+    uint64_t numEntries;
+    size_t pathLength; //Length of entry.path, the prefix the next record builds on
+    int hashAlgorithm; //Hash function of the digests stored in the binary records
+    size_t digestLength; //Size of the digest following every binary record, 0 without digests
+    size_t recordSize; //Fixed part of every binary record, smaller before version 4
+    const DirectorySummary *directories; //Directory summaries of a version 3 binary snapshot, NULL before
+    uint64_t numDirectories;
+    const DirectorySummary *summary; //Summary of the current entry, NULL unless it is a directory with one
+    uint64_t bufferOffset; //Offset in a text snapshot of the first byte of the buffer
+    uint64_t entryOffset; //Offset in a text snapshot of the "Path: " line of the current entry
+    const unsigned char *indexMapping; //Path index of a text snapshot mapped from its sidecar file, NULL unless a query opened it
+    size_t indexMappingSize;
+    const struct TextIndexRecord *textRestarts; //Indexed entries of the text snapshot, numRestarts of them in path order
+} SnapshotReader;
+
+//Start of a binary snapshot
+typedef struct BinaryHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+} BinaryHeader;
+
+//Fixed part of every record of a binary snapshot, followed by the digest if the header flags name a hash function, the path suffix, its terminator and padding to 8 bytes
+typedef struct BinaryRecord
+{
+    uint64_t size;
+    uint64_t hardLinks; //As wide as st_nlink
+    uint32_t mode;
+    uint32_t sharedLength; //Bytes of the path shared with the record before, 0 for records in the path index
+    uint32_t suffixLength;
+    uint32_t reserved; //Zero, keeps the record a multiple of 8 bytes
+} BinaryRecord;
+
+//Fixed part of the records of version 1 to 3 snapshots, with a 32 bit hard link count
+typedef struct LegacyBinaryRecord
+{
+    uint64_t size;
+    uint32_t mode;
+    uint32_t hardLinks;
+    uint32_t sharedLength;
+    uint32_t suffixLength;
+} LegacyBinaryRecord;
+
+//End of a binary snapshot, locates the path index placed right before it
+typedef struct BinaryFooter
+{
+    uint64_t indexOffset;
+    uint64_t numRestarts;
+    uint64_t numEntries;
+    uint32_t restartInterval;
+    uint32_t version;
+    char magic[8];
+} BinaryFooter;
+
+//Start of the path index of a text snapshot (<snapshot>.idx), followed by its records and then their paths
+typedef struct TextIndexHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t restartInterval;
+    uint64_t snapshotSize; //Size and mtime of the snapshot it was built from, any other snapshot makes it stale
+    int64_t snapshotMtime;
+    uint64_t numEntries;
+    uint64_t numRestarts;
+} TextIndexHeader;
+
+//One indexed entry of a text snapshot
+typedef struct TextIndexRecord
+{
+    uint64_t entryOffset; //Offset of the "Path: " line of the entry in the snapshot
+    uint64_t pathOffset; //Offset of its path in the index file, terminator included
+} TextIndexRecord;
+
+//Collects small formatted writes in a few large blocks that reach the file together through writev
+typedef struct BufferedOutput
+{
+    int fd; //-1 discards the output
+    int failed; //Set once a write to the file fails
+    char *data; //OUTPUT_BLOCK_COUNT blocks of OUTPUT_BLOCK_SIZE bytes, filled one after another
+    int block; //Block being filled
+    size_t used; //Bytes used in that block
+    size_t blockUsed[OUTPUT_BLOCK_COUNT];
+} BufferedOutput;
+
+//Fixed size slot of the ring between the traversal and the writer thread
+typedef struct EntryRecord
+{
+    long long size;
+    mode_t mode;
+    long hardLinks;
+    long long mtime; //Nanoseconds, for the directory summaries
+    long long ctime;
+    int hasDigest;
+    unsigned char digest[HASH_MAX_DIGEST_SIZE]; //Content digest of the entry (-H)
+    char *longPath; //Heap copy of a path too long for the slot, released by the writer thread
+    char path[ENTRY_RECORD_PATH_SIZE];
+} EntryRecord;
+
+//Writes snapshot entries in the text or the binary format, optionally on a dedicated thread fed through a ring
+typedef struct SnapshotWriter
+{
+    int format;
+    int hashAlgorithm; //Hash function of the digests stored in binary records, HASH_NONE stores none
+    uint64_t offset; //Bytes written so far, the binary path index stores record offsets
+    uint64_t numEntries;
+    char *previousPath; //Path of the last record, binary records only store what differs from it
+    size_t previousLength;
+    size_t previousCapacity;
+    uint64_t *restartOffsets;
+    size_t numRestarts;
+    size_t restartCapacity;
+    int summarizeDirectories; //Binary snapshots summarize every directory, deltas do not
+    DirectorySummary *summaries; //One per directory, in record order
+    size_t numSummaries;
+    size_t summaryCapacity;
+    OpenDirectory *openDirs; //Directories whose subtree is still being written, outermost first
+    size_t numOpenDirs;
+    size_t openDirCapacity;
+    char *openDirPath; //Path of the innermost open directory
+    size_t openDirPathCapacity;
+    BufferedOutput output;
+    EntryRecord *ring; //Entries waiting for the writer thread, NULL while the caller formats them itself
+    atomic_size_t ringHead; //Next slot the writer thread formats
+    atomic_size_t ringTail; //Next slot the traversal fills
+    atomic_int closing; //Set once the traversal pushed its last entry
+    atomic_int failed; //Set by the writer thread once an entry could not be written, the traversal then stops pushing
+    pthread_t thread;
+} SnapshotWriter;
+
+//Rule set of the built-in content scanner
+typedef struct ScanRules
+{
+    unsigned char **patterns; //Keywords and byte patterns, any occurrence marks the file
+    size_t *patternLengths;
+    int numPatterns;
+    int32_t *transitions; //Aho-Corasick automaton over all patterns, 256 next states per state
+    unsigned char *matchStates; //Set for the states where a pattern ends
+    int numStates;
+    unsigned char firstBytes[MAX_SCAN_FIRST_BYTES]; //Bytes a pattern can start with
+    int numFirstBytes; //-1 when there are too many of them to prefilter
+    double maxNonAsciiRatio; //Files with a larger share of non ASCII bytes are marked, negative disables the rule
+    long shapeMaxLines; //Files with fewer lines than this...
+    long shapeMinWords; //...more words than this...
+    long shapeMinChars; //...and more characters than this are marked, a negative line limit disables the rule
+    int useScript; //Runs verify_for_malicious.sh in a child process instead of the built-in scanner (-x)
+    uint64_t version; //Fingerprint of the rules, or of the script with -x, cached verdicts of another version are not reused
+} ScanRules;
+
+//Progress of a scan through one file
+typedef struct ScanState
+{
+    int32_t automatonState;
+    int matched;
+    int previousWasSpace; //Carries the word boundary from one chunk to the next
+    long long chars;
+    long long lines;
+    long long words;
+    long long nonAscii;
+} ScanState;
+
+ScanRules scanRules; //Rules used to analyze the files without access rights (-r)
+char analysisScript[PATH_MAX] = ANALYSIS_SCRIPT; //Script run with -x, made absolute at startup so it does not depend on the working directory
+
+//Streaming state of the 64 bit xxHash
+typedef struct Xxh64State
+{
+    uint64_t accumulators[4];
+    uint64_t totalLength;
+    unsigned char buffer[32]; //Bytes not yet forming a full stripe
+    size_t buffered;
+} Xxh64State;
+
+//Streaming state of SHA-256
+typedef struct Sha256State
+{
+    uint32_t h[8];
+    uint64_t totalLength;
+    unsigned char buffer[64]; //Bytes not yet forming a full block
+    size_t buffered;
+} Sha256State;
+
+//One file of a stat cache, identified by device and inode and fingerprinted by its size and timestamps, the payload of the cache follows
+typedef struct StatCacheRecord
+{
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtimeSec;
+    int64_t ctimeSec;
+    uint32_t mtimeNsec;
+    uint32_t ctimeNsec;
+} StatCacheRecord;
+
+//Start of a stat cache file, the records follow
+typedef struct StatCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize; //Fingerprint plus payload, rounded up to 8 bytes
+    uint64_t tag; //What the payloads depend on, a cache written with another one is dropped as a whole
+    uint64_t numRecords;
+} StatCacheHeader;
+
+//Records of the previous run looked up by (dev, inode), and the cache file of this run being written
+typedef struct StatCache
+{
+    unsigned char *records; //Records of the previous run, recordSize bytes each
+    size_t numRecords;
+    size_t recordSize;
+    size_t payloadSize;
+    uint32_t *slots; //Open addressing table of record indexes plus one, 0 marks a free slot
+    size_t slotMask;
+    const char *magic;
+    uint32_t version;
+    uint64_t tag;
+    char path[PATH_MAX];
+    char tempPath[PATH_MAX]; //New cache, renamed over the old one once it is complete
+    BufferedOutput output;
+    uint64_t numWritten;
+} StatCache;
+
+//Digests of the files hashed before, the payload is the digest
+typedef struct HashCache
+{
+    StatCache table;
+    time_t runStart; //Files changed within a second of the start are not cached, a later change could keep the same timestamps
+    atomic_long numHashed; //Files read this run
+    atomic_long numReused; //Files whose digest came from the cache
+} HashCache;
+
+HashCache *hashCache; //Hash cache of the monitored directory, NULL when no digests are recorded
+
+//Files found safe with the same rules, the records carry no payload
+typedef struct VerdictCache
+{
+    StatCache table;
+    time_t runStart;
+    long numReused; //Analyses skipped this run
+} VerdictCache;
+
+VerdictCache *verdictCache; //Verdict cache of the monitored directory, NULL if it could not be opened
+Arena walkArena; //Names of the directories the serial walk is in, released as each directory is done and freed after the snapshot
+
+SnapshotReader *previousSnapshot; //Previous snapshot of the monitored directory read by the fast rescan (-R), NULL without one
+
+//Path named by an inotify event, looked at again once the events read so far are in
+typedef struct WatchChange
+{
+    char *path;
+    int kind; //WATCH_CHANGE_ENTRY or WATCH_CHANGE_TREE
+} WatchChange;
+
+//New state of a changed path, merged into the in-memory snapshot with the others in one pass
+typedef struct WatchUpdate
+{
+    SnapshotEntry entry; //Only the path is set for a removed entry
+    int removed; //The path is gone, with everything below it
+    int dropSubtree; //The entries below the path are replaced by the ones this batch lists
+    size_t sequence; //Order the updates were made in, the last one of a path wins
+} WatchUpdate;
+
+//Monitored directory kept up to date from inotify events (-w), with its snapshot in memory
+typedef struct WatchState
+{
+    int fd; //inotify instance
+    const char *root; //Path of the monitored directory, its own events are not entries
+    char **watchPaths; //Directory of every watch descriptor, NULL once the watch is gone
+    int watchCapacity;
+    SnapshotEntry *entries; //In-memory snapshot, sorted in snapshot order
+    size_t numEntries;
+    size_t capacity;
+    WatchChange *changes; //Paths named by the events read since the last batch
+    size_t numChanges;
+    size_t changeCapacity;
+    WatchUpdate *updates;
+    size_t numUpdates;
+    size_t updateCapacity;
+    int modified; //The in-memory snapshot differs from the last one written
+    int overflowed; //Events were lost, only a full rescan can be trusted
+} WatchState;
+
+WatchState *watchState; //Watch state of the monitored directory in watch mode, NULL otherwise
+
+//Original of a file copied into quarantine, removed once the copy is durable
+typedef struct QuarantinePending
+{
+    char *path;
+    dev_t dev; //Identity of the file copied, a file put at the same path in the meantime is not removed
+    ino_t ino;
+    int copyFd; //Copy waiting for its fdatasync, -1 if there is nothing to sync
+} QuarantinePending;
+
+//Isolated directory of this process and the quarantine batch not synced yet
+typedef struct QuarantineState
+{
+    int dirFd; //Opened on the first quarantine, -1 before
+    BufferedOutput manifest; //Lines of the batch, appended to the manifest when it is synced
+    QuarantinePending *pending;
+    size_t numPending;
+    size_t pendingCapacity;
+    int numUnsynced; //Files quarantined since the last sync
+} QuarantineState;
+
+QuarantineState quarantine = {.dirFd = -1};
+
+//A suspicious file queued by the traversal, handed back with its verdict by the worker that analyzed it
+typedef struct AnalysisJob
+{
+    struct AnalysisJob *next;
+    mode_t mode; //Mode recorded by the traversal, restored once the file is opened
+    int verdict; //1 malicious, 0 safe, -1 error, ANALYSIS_TIMED_OUT
+    InodeRecord *record; //Hard link shared in single-process mode (-U) the verdict settles, NULL otherwise
+    struct stat analyzedSt; //Taken by the worker right after the analysis, st_mode is 0 if the file changed during it
+    char path[];
+} AnalysisJob;
+
+//Long lived threads analyzing the files the traversal queues, the verdicts are applied on the traversal thread
+typedef struct AnalysisPool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t jobReady; //Signaled when a job is queued or the pool closes
+    pthread_cond_t slotFree; //Signaled when a worker takes a job off the queue
+    AnalysisJob *jobsHead; //Jobs in traversal order
+    AnalysisJob *jobsTail;
+    size_t numJobs;
+    AnalysisJob *resultsHead; //Analyzed jobs waiting for their verdict to be applied
+    AnalysisJob *resultsTail;
+    atomic_int numResults; //Lets the traversal look for verdicts without taking the lock
+    int closing; //Set once the traversal queued its last job
+    pthread_t *threads;
+    int numThreads;
+} AnalysisPool;
+
+AnalysisPool *analysisPool; //Analysis workers of the monitored directory, NULL when files are analyzed inline
+
+int IsOptionWithValue(const char *arg);
+
+int IsFlagOption(const char *arg);
+
+SnapshotWriter *OpenSnapshotWriter(int fd, int format, int hashAlgorithm);
+
+int WriteSnapshotEntry(SnapshotWriter *writer, const SnapshotEntry *entry);
+
+int CloseSnapshotWriter(SnapshotWriter *writer);
+
+int StartSnapshotWriterThread(SnapshotWriter *writer);
+
+int PushEntryRecord(SnapshotWriter *writer, const char *entryPath, const struct stat *st, const unsigned char *digest);
+
+void *SnapshotWriterMain(void *arg);
+
+void WaitForRing(int *spins);
+
+int SummarizeDirectoryEntry(SnapshotWriter *writer, const SnapshotEntry *entry);
+
+void CloseOpenDirectory(SnapshotWriter *writer);
+
+uint64_t HashEntryRecord(const SnapshotEntry *entry, const char *name);
+
+uint64_t MixTreeHash(uint64_t hash, uint64_t value);
+
+const DirectorySummary *FindDirectorySummary(const SnapshotReader *reader, uint64_t recordOffset);
+
+int SkipSnapshotSubtree(SnapshotReader *reader);
+
+long long StatNanoseconds(const struct timespec *time);
+
+int ReuseDirectory(const char *path, const struct stat *st, SnapshotWriter *writer, char *isolatedPath);
+
+int WriteReusedEntry(SnapshotWriter *writer, const SnapshotEntry *entry);
+
+SnapshotReader *OpenPreviousSnapshot(const char *outputDir, const char *dirName, const char *currentName);
+
+int OpenBinarySnapshot(SnapshotReader *reader);
+
+int CheckBinaryFooter(const BinaryFooter *footer, uint64_t fileSize);
+
+void DecodeBinaryRecord(const SnapshotReader *reader, uint64_t offset, BinaryRecord *record);
+
+int NextBinarySnapshotEntry(SnapshotReader *reader);
+
+int SeekSnapshotReader(SnapshotReader *reader, const char *path);
+
+int DumpSnapshot(const char *snapshotFile, const char *lookupPath);
+
+int OpenTextSnapshotIndex(SnapshotReader *reader, const char *snapshotFile);
+
+int MapTextSnapshotIndex(SnapshotReader *reader, const char *indexFile, const struct stat *snapshotSt);
+
+int BuildTextSnapshotIndex(const char *snapshotFile, const char *indexFile, const struct stat *snapshotSt);
+
+int SeekTextSnapshotReader(SnapshotReader *reader, const char *path);
+
+int SeekQueryStart(SnapshotReader *reader, const char *snapshotFile, const char *path);
+
+int InQuerySelection(const char *entryPath, const char *path, size_t pathLength, int mode);
+
+int QuerySnapshot(int argc, char *argv[]);
+
+long long QueryChanges(SnapshotReader *olderReader, const char *olderFile, SnapshotReader *reader, const char *snapshotFile, const char *path, int mode);
+
+void ExploreDirectories(const char *path, SnapshotWriter *writer, char *isolatedPath);
+
+void ExploreDirectoryPath(PathBuffer *pathBuffer, SnapshotWriter *writer, char *isolatedPath);
+
+void ExploreDirectoriesParallel(const char *path, SnapshotWriter *writer, char *isolatedPath);
+
+int WriteEntryInfo(SnapshotWriter *writer, const char *entryPath, const struct stat *st, const unsigned char *digest);
+
+int CreateSnapshot(char *path, char *outputDir, char *isolatedDir);
+
+int OpenSnapshotFile(const char *outputDir, const char *dirName, char *snapshotFilePath, size_t pathSize);
+
+int WatchDirectory(char *path, char *outputDir, char *isolatedDir);
+
+int StartWatch(char *path, char *outputDir, char *isolatedDir);
+
+void StopWatch(void);
+
+int AddWatch(const char *path);
+
+int AddWatchTree(const char *path);
+
+void RemoveWatchTree(const char *path);
+
+void ReadWatchEvents(void);
+
+void AddWatchChange(const char *path, int kind);
+
+void ApplyWatchChanges(char *isolatedDir);
+
+void ScanWatchedDirectory(const char *path, char *isolatedDir);
+
+void AddWatchUpdate(const char *path, const struct stat *st, int dropSubtree, char *isolatedDir);
+
+const SnapshotEntry *FindWatchEntry(const char *path);
+
+void MergeWatchUpdates(void);
+
+int CompareWatchChanges(const void *first, const void *second);
+
+int CompareWatchUpdates(const void *first, const void *second);
+
+int RecordWatchEntry(const char *entryPath, const struct stat *st, const unsigned char *digest);
+
+int AppendWatchEntry(const SnapshotEntry *entry);
+
+int WriteWatchSnapshot(const char *outputDir);
+
+void StopWatching(int signalNumber);
+
+int ParseGovernorSpec(const char *spec);
+
+void ApplyGovernorPriorities(void);
+
+void GovernorCharge(long long ops, long long bytes);
+
+GovernorBudget *OpenGovernorBudget(void);
+
+void GovernorObserve(int operation, double latency, long long bytes);
+
+void AdjustGovernorBackoff(double now);
+
+double ReadIoPressure(void);
+
+void FillSnapshotEntry(SnapshotEntry *entry, char *entryPath, const struct stat *st, const unsigned char *digest);
+
+int GenerateTree(int argc, char *argv[]);
+
+uint64_t NextRandom(uint64_t *state);
+
+int RunBenchmark(int argc, char *argv[]);
+
+int RunBenchmarkPhases(const char *tree, const char *workDir, int run, int cold, char **suspiciousFiles, size_t numSuspicious, BenchResult *results, int *numResults);
+
+long long WriteBenchmarkSnapshot(const char *tree, const char *snapshotFile);
+
+void CollectSuspiciousFiles(const char *path, char ***files, size_t *numFiles, size_t *capacity);
+
+int DropPageCache(void);
+
+double CpuSeconds(void);
+
+void PrintBenchResults(FILE *output, const BenchResult *results, int numResults, int json);
+
+int ScheduleRoots(char **paths, int numRoots, char *outputDir, char *isolatedDir, const char *statsFile);
+
+int CompareRootRuns(const void *first, const void *second, void *context);
+
+long long EstimateRootEntries(const char *outputDir, const char *dirName);
+
+void ReadRootReports(int reportFd, RootRun *runs, int numRoots);
+
+void PrintRunSummary(const RootRun *runs, int numRoots);
+
+void RecordPhase(int phase, double *wallMark, double *cpuMark);
+
+int LatencyBucket(double seconds);
+
+void AddLatencies(atomic_llong *histogram, const long long *counts);
+
+void AddStat(atomic_llong *counter, long long value);
+
+double ThreadCpuSeconds(void);
+
+void MergeRunStats(RunStats *total, RunStats *stats);
+
+void PrintRunStatsJson(FILE *output, RunStats *stats);
+
+int WriteStatsFile(const char *statsFile, RootRun *runs, int numRoots);
+
+void PrintJsonString(FILE *output, const char *text);
+
+void PreviousSnapshotCompare(const char *outpuPpath, const char *snapshotFileName);
+
+long long CompareSnapshots(const char *prevSnapshotFile, const char *currentSnapshotFile, int changesFd, SnapshotWriter *delta);
+
+void UpdateHistory(const char *outputDir, const HistoryGeneration *oldGenerations, int numOldGenerations, const HistoryGeneration *generations, int numGenerations);
+
+int ReadHistoryManifest(const char *outputDir, const char *dirName, HistoryGeneration **generations, int *numGenerations);
+
+int WriteHistoryManifest(const char *outputDir, const char *dirName, const HistoryGeneration *generations, int numGenerations);
+
+int FindLatestSnapshot(const char *outputDir, const char *dirName, const char *excludeName, char *name, size_t nameSize);
+
+void SnapshotTimestamp(const char *name, char *timestamp, size_t timestampSize);
+
+int ShowHistory(const char *outputDir, const char *dirName, const char *generationArg);
+
+int RebuildGeneration(const char *outputDir, const HistoryGeneration *generations, int generation, SnapshotWriter *writer);
+
+void WriteDeltaEntry(SnapshotWriter *delta, const SnapshotEntry *entry, int removed);
+
+int DescribeEntryChanges(const SnapshotEntry *prevEntry, const SnapshotEntry *currentEntry, char *fields, size_t fieldsSize);
+
+void FormatPermissions(mode_t permissions, char *text);
+
+int OpenSnapshotReader(SnapshotReader *reader, const char *snapshotFile);
+
+void CloseSnapshotReader(SnapshotReader *reader);
+
+char *ReadSnapshotLine(SnapshotReader *reader);
+
+int NextSnapshotEntry(SnapshotReader *reader);
+
+int InitBufferedOutput(BufferedOutput *output, int fd);
+
+void FreeBufferedOutput(BufferedOutput *output);
+
+void NextOutputBlock(BufferedOutput *output);
+
+void BufferedPrintf(BufferedOutput *output, const char *format, ...);
+
+void BufferedWrite(BufferedOutput *output, const void *data, size_t length);
+
+void FlushBufferedOutput(BufferedOutput *output);
+
+int WriteAll(int fd, const char *data, size_t length);
+
+int WriteAllVector(int fd, struct iovec *blocks, int numBlocks);
+
+void CheckPermissionsAndAnalyze(const char *entryPath, struct stat fileStats, char *isolatedDir, int snapshotFd);
+
+int AnalyzeFile(const char *entryPath, int pipeFd);
+
+void HandleAnalysisResult(int pipeFd[2], const char *entryPath, char *isolatedDir, pid_t pid, InodeRecord *record);
+
+void ApplyAnalysisVerdict(const char *entryPath, char *isolatedDir, int verdict, InodeRecord *record, const struct stat *analyzedSt);
+
+int QuarantineFile(const char *entryPath, const char *isolatedDir, char *quarantinedName, size_t nameSize);
+
+int QuarantinePinnedFile(const char *entryPath, int pinFd, const struct stat *pinnedSt, char *quarantinedName, size_t nameSize);
+
+int OpenQuarantine(const char *isolatedDir);
+
+int ContentAddress(int pinFd, mode_t mode, unsigned char *digest);
+
+int MoveQuarantinedFile(int fromDirFd, const char *fromPath, const char *name, char *quarantinedName, size_t nameSize);
+
+int CopyQuarantinedContent(int sourceFd, int copyFd, off_t size, const char **method);
+
+int FinishQuarantine(const char *entryPath, int removeOriginal, int copyFd, const char *method, const struct stat *st, const char *digestText, const char *quarantinedName);
+
+void FlushQuarantine(void);
+
+int RemoveQuarantinedOriginal(const char *path, dev_t dev, ino_t ino);
+
+void ResolveAnalysisScript(void);
+
+int RunAnalysisScript(const char *entryPath, double deadline);
+
+int AnalyzeEntry(const char *entryPath, mode_t mode, double deadline, struct stat *analyzedSt);
+
+void StatAfterAnalysis(const char *entryPath, const struct stat *before, struct stat *after);
+
+double AnalysisDeadline(void);
+
+double MonotonicSeconds(void);
+
+AnalysisPool *OpenAnalysisPool(int numThreads);
+
+int SubmitAnalysisJob(AnalysisPool *pool, const char *entryPath, mode_t mode, InodeRecord *record);
+
+void *AnalysisWorkerMain(void *arg);
+
+void DrainAnalysisResults(AnalysisPool *pool, char *isolatedDir);
+
+void CloseAnalysisPool(AnalysisPool *pool, char *isolatedDir);
+
+int LoadScanRules(ScanRules *rules, const char *rulesFile);
+
+int AddScanPattern(ScanRules *rules, const unsigned char *pattern, size_t length);
+
+int BuildScanAutomaton(ScanRules *rules);
+
+int ScanFile(const char *entryPath, const struct stat *expected, const ScanRules *rules, double deadline);
+
+int PinAnalyzedFile(const char *entryPath, const struct stat *expected, struct stat *pinnedSt);
+
+int ChmodPinnedFile(int pinFd, mode_t mode);
+
+int OpenPinnedFile(int pinFd, int flags);
+
+void InstallScanWatchdog(void);
+
+void InterruptScan(int signalNumber);
+
+int StartScanWatchdog(double deadline, timer_t *timer);
+
+void ScanChunk(ScanState *state, const ScanRules *rules, const unsigned char *data, size_t length);
+
+int ScanVerdict(const ScanState *state, const ScanRules *rules);
+
+int ComputeEntryDigest(int dirFd, const char *name, const struct stat *st, unsigned char *digest);
+
+int HashFile(int dirFd, const char *name, unsigned char *digest);
+
+int HashDigestLength(int algorithm);
+
+const char *HashAlgorithmName(int algorithm);
+
+void FormatDigest(const unsigned char *digest, int length, char *text);
+
+int ParseDigest(const char *text, SnapshotEntry *entry);
+
+void Xxh64Init(Xxh64State *state);
+
+uint64_t Xxh64Round(uint64_t accumulator, uint64_t input);
+
+uint64_t Xxh64MergeRound(uint64_t hash, uint64_t accumulator);
+
+uint64_t RotateLeft64(uint64_t value, int bits);
+
+uint32_t RotateRight32(uint32_t value, int bits);
+
+uint64_t ReadLittleEndian64(const unsigned char *data);
+
+void Xxh64Update(Xxh64State *state, const unsigned char *data, size_t length);
+
+void Xxh64Final(Xxh64State *state, unsigned char *digest);
+
+void Sha256Init(Sha256State *state);
+
+void Sha256Update(Sha256State *state, const unsigned char *data, size_t length);
+
+void Sha256Final(Sha256State *state, unsigned char *digest);
+
+void Sha256Transform(Sha256State *state, const unsigned char *block);
+
+int OpenStatCache(StatCache *cache, const char *path, const char *magic, uint32_t version, uint64_t tag, size_t payloadSize);
+
+const unsigned char *LookupStatCache(const StatCache *cache, const struct stat *st);
+
+void AddStatCacheRecord(StatCache *cache, const struct stat *st, const void *payload);
+
+void CloseStatCache(StatCache *cache);
+
+HashCache *OpenHashCache(const char *outputDir, const char *dirName);
+
+int LookupHashCache(const HashCache *cache, const struct stat *st, unsigned char *digest);
+
+void AddHashCacheRecord(HashCache *cache, const struct stat *st, const unsigned char *digest);
+
+void CloseHashCache(HashCache *cache);
+
+uint64_t ComputeRulesVersion(const ScanRules *rules);
+
+VerdictCache *OpenVerdictCache(const char *outputDir, const char *dirName);
+
+int LookupVerdictCache(const VerdictCache *cache, const struct stat *st);
+
+void AddVerdictCacheRecord(VerdictCache *cache, const struct stat *st);
+
+void CloseVerdictCache(VerdictCache *cache);
+
+int PushTask(WorkDeque *deque, DirNode *node);
+
+DirNode *PopTask(WorkDeque *deque);
+
+DirNode *StealTask(WorkDeque *deque);
+
+int ClaimTask(WorkDeque *deque, DirNode *node);
+
+void *TraversalWorkerMain(void *arg);
+
+void ReadDirectoryNode(TraversalWorker *worker, DirNode *node);
+
+void ListDirectoryNode(TraversalWorker *worker, DirNode *node);
+
+char *BuildNodePath(const DirNode *node);
+
+int PathBufferSet(PathBuffer *buffer, const char *path);
+
+int PathBufferAppend(PathBuffer *buffer, const char *component, int addSeparator);
+
+int EmitDirNode(TraversalWorker *emitter, DirNode *node, PathBuffer *pathBuffer, SnapshotWriter *writer, char *isolatedPath);
+
+void WaitForDirNode(TraversalWorker *emitter, DirNode *node);
+
+void DiscardDirNode(TraversalWorker *emitter, DirNode *node);
+
+void ReleaseDirNode(TraversalPool *pool, DirNode *node);
+
+int CompareTreeEntries(const void *first, const void *second);
+
+int CompareWalkNames(const void *first, const void *second);
+
+int CompareEntryNames(const struct dirent **first, const struct dirent **second);
+
+int ComparePaths(const char *first, const char *second);
+
+void *ArenaAlloc(Arena *arena, size_t size);
+
+char *ArenaCopyName(Arena *arena, const char *name, size_t length);
+
+ArenaMark ArenaGetMark(const Arena *arena);
+
+void ArenaRelease(Arena *arena, ArenaMark mark);
+
+void FreeArena(Arena *arena);
+
+InodeTable *OpenInodeTable(void);
+
+void CloseInodeTable(InodeTable *table);
+
+uint64_t HashInode(dev_t dev, ino_t ino);
+
+InodeRecord *LookupInode(InodeShard *shard, uint64_t hash, dev_t dev, ino_t ino);
+
+InodeRecord *FindInode(dev_t dev, ino_t ino);
+
+InodeRecord *AddInode(const struct stat *st);
+
+int FindLinkedStat(dev_t dev, ino_t ino, unsigned char type, struct stat *st);
+
+void RecordLinkedInode(const struct stat *st);
+
+void RecordSharedDirectory(const char *entryPath, const struct stat *st);
+
+const InodeRecord *BeginSharedRoot(const char *path, const char *snapshotFile);
+
+int CopySharedSubtree(const InodeRecord *record, const char *path, SnapshotWriter *writer);
+
+int CheckSharedAnalysis(const char *entryPath, const struct stat *st, char *isolatedDir, InodeRecord **analyzing);
+
+void SettleSharedAnalysis(InodeRecord *record, char *isolatedDir, int verdict);
+
+void RunRootsInProcess(RootRun *runs, int *order, int numRoots, char *outputDir, char *isolatedDir);
+
+int CompareRootDepths(const void *first, const void *second, void *context);
+
+int main(int argc, char *argv[]) 
+{
+    // Subcommand converting a snapshot to the text format, or looking up one path in a binary snapshot
+    if (argc >= 3 && strcmp(argv[1], "dump") == 0)
+        return DumpSnapshot(argv[2], argc >= 4 ? argv[3] : NULL);
+
+    // Subcommand looking up a path, a subtree or a prefix in a snapshot, or the changes under it between two snapshots
+    if (argc >= 3 && strcmp(argv[1], "query") == 0)
+        return QuerySnapshot(argc - 2, argv + 2);
+
+    // Subcommand listing the generations kept for a monitored directory, or rebuilding one of them
+    if (argc >= 4 && strcmp(argv[1], "history") == 0)
+        return ShowHistory(argv[2], argv[3], argc >= 5 ? argv[4] : NULL);
+
+    // Subcommands generating a synthetic tree, and timing every stage of a monitoring run on a tree
+    if (argc >= 3 && strcmp(argv[1], "gentree") == 0)
+        return GenerateTree(argc - 2, argv + 2);
+
+    if (argc >= 3 && strcmp(argv[1], "bench") == 0)
+        return RunBenchmark(argc - 2, argv + 2);
+
+    write(STDOUT_FILENO, "\n", 1); // Write a newline character to stdout for formatting
+
+    // Check if there are sufficient arguments provided
+    if (argc < 6) 
+    {
+        // Print an error message to stderr and exit with failure status
+        write(STDERR_FILENO, "error: Insufficient arguments! Exiting.\n", strlen("error: Insufficient arguments! Exiting.\n"));
+        exit(EXIT_FAILURE);
+    }
+
+     // Initialize variables to store output path and isolated path
+    char *outputPath = NULL;
+    char *isolatedPath = NULL;
+    char *rulesFile = NULL;
+    char *statsFile = NULL;
+
+    // Parse command-line arguments to extract output and isolated paths
+    for (int i = 1; i < argc; i++) 
+    {
+        if (strcmp(argv[i], "-o") == 0) 
+        {
+            // Set the output path from the next argument
+            outputPath = argv[i + 1];
+            i++; // Skip the next argument since it's the value for the option
+        } 
+        else if (strcmp(argv[i], "-s") == 0) 
+        {
+            // Set the isolated path from the next argument
+            isolatedPath = argv[i + 1];
+            i++; // Skip the next argument since it's the value for the option
+        }
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) 
+        {
+            // Set the snapshot format from the next argument
+            if (strcmp(argv[i + 1], "binary") == 0)
+                snapshotFormat = SNAPSHOT_FORMAT_BINARY;
+            else if (strcmp(argv[i + 1], "text") == 0)
+                snapshotFormat = SNAPSHOT_FORMAT_TEXT;
+            else
+            {
+                write(STDERR_FILENO, "error: Invalid snapshot format! Exiting.\n", strlen("error: Invalid snapshot format! Exiting.\n"));
+                exit(EXIT_FAILURE);
+            }
+
+            i++; // Skip the next argument since it's the value for the option
+        }
+        else if (strcmp(argv[i], "-H") == 0 && i + 1 < argc) 
+        {
+            // Set the hash function of the content digests from the next argument
+            if (strcmp(argv[i + 1], "fast") == 0)
+                hashAlgorithm = HASH_XXH64;
+            else if (strcmp(argv[i + 1], "sha256") == 0)
+                hashAlgorithm = HASH_SHA256;
+            else
+            {
+                write(STDERR_FILENO, "error: Invalid hash function! Exiting.\n", strlen("error: Invalid hash function! Exiting.\n"));
+                exit(EXIT_FAILURE);
+            }
+
+            i++; // Skip the next argument since it's the value for the option
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) 
+        {
+            // Set the rule set file of the content scanner from the next argument
+            rulesFile = argv[i + 1];
+            i++; // Skip the next argument since it's the value for the option
+        }
+        else if (strcmp(argv[i], "-R") == 0) 
+        {
+            // Reuse the listings of unchanged directories from the previous snapshot, their entries are still stat'ed
+            fastRescan = 1;
+        }
+        else if (strcmp(argv[i], "-x") == 0) 
+        {
+            // Analyze with the external script instead of the built-in scanner
+            scanRules.useScript = 1;
+        }
+        else if (strcmp(argv[i], "-U") == 0) 
+        {
+            // Snapshot every directory in this process, sharing the inodes they have in common
+            sharedInodes = 1;
+        }
+        else if (strcmp(argv[i], "-C") == 0) 
+        {
+            // Name quarantined files after their content, repeated samples are kept once
+            contentAddressedQuarantine = 1;
+        }
+        else if (strcmp(argv[i], "-F") == 0) 
+        {
+            // Make every snapshot durable once it is complete
+            syncSnapshots = 1;
+        }
+        else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) 
+        {
+            // Set the number of analysis workers from the next argument
+            numAnalysisWorkers = atoi(argv[i + 1]);
+            i++; // Skip the next argument since it's the value for the option
+
+            if (numAnalysisWorkers < 0) 
+            {
+                write(STDERR_FILENO, "error: Invalid analysis worker count! Exiting.\n", strlen("error: Invalid analysis worker count! Exiting.\n"));
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) 
+        {
+            // Set the analysis timeout per file from the next argument
+            analysisTimeout = strtod(argv[i + 1], NULL);
+            i++; // Skip the next argument since it's the value for the option
+
+            if (analysisTimeout < 0) 
+            {
+                write(STDERR_FILENO, "error: Invalid analysis timeout! Exiting.\n", strlen("error: Invalid analysis timeout! Exiting.\n"));
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) 
+        {
+            // Set the number of past generations kept from the next argument
+            historyGenerations = atoi(argv[i + 1]);
+            i++; // Skip the next argument since it's the value for the option
+
+            if (historyGenerations < 0) 
+            {
+                write(STDERR_FILENO, "error: Invalid generation count! Exiting.\n", strlen("error: Invalid generation count! Exiting.\n"));
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "-G") == 0 && i + 1 < argc) 
+        {
+            // Set the budgets, priorities and backoff of the I/O governor from the next argument
+            if (ParseGovernorSpec(argv[i + 1]) == -1) 
+            {
+                write(STDERR_FILENO, "error: Invalid governor setting! Exiting.\n", strlen("error: Invalid governor setting! Exiting.\n"));
+                exit(EXIT_FAILURE);
+            }
+
+            i++; // Skip the next argument since it's the value for the option
+        }
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) 
+        {
+            // Set the seconds between the snapshot refreshes of watch mode from the next argument
+            watchInterval = strtod(argv[i + 1], NULL);
+            i++; // Skip the next argument since it's the value for the option
+
+            if (watchInterval <= 0) 
+            {
+                write(STDERR_FILENO, "error: Invalid watch interval! Exiting.\n", strlen("error: Invalid watch interval! Exiting.\n"));
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) 
+        {
+            // Set the file the statistics of the run are written to from the next argument
+            statsFile = argv[i + 1];
+            i++; // Skip the next argument since it's the value for the option
+        }
+        else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) 
+        {
+            // Set the number of directories snapshotted at the same time from the next argument
+            maxParallelRoots = atoi(argv[i + 1]);
+            i++; // Skip the next argument since it's the value for the option
+
+            if (maxParallelRoots < 1) 
+            {
+                write(STDERR_FILENO, "error: Invalid process count! Exiting.\n", strlen("error: Invalid process count! Exiting.\n"));
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) 
+        {
+            // Set the number of traversal threads from the next argument
+            numTraversalThreads = atoi(argv[i + 1]);
+            i++; // Skip the next argument since it's the value for the option
+
+            if (numTraversalThreads < 1) 
+            {
+                write(STDERR_FILENO, "error: Invalid thread count! Exiting.\n", strlen("error: Invalid thread count! Exiting.\n"));
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    // Check if both output path and isolated path are provided
+    if (outputPath == NULL || isolatedPath == NULL) 
+    {
+        // Print an error message to stderr and exit with failure status
+        write(STDERR_FILENO, "error: Invalid arguments! Exiting.\n", strlen("error: Invalid arguments! Exiting.\n"));
+        exit(EXIT_FAILURE);
+    }
+
+    // Watch mode keeps a process per directory for the whole run, the single-process mode ends with its last directory
+    if (sharedInodes && watchInterval > 0) 
+    {
+        write(STDERR_FILENO, "error: -U cannot be combined with -w! Exiting.\n", strlen("error: -U cannot be combined with -w! Exiting.\n"));
+        exit(EXIT_FAILURE);
+    }
+
+    // Compile the rule set once, every child process inherits it (the external script needs none)
+    if (!scanRules.useScript) 
+    {
+        if (LoadScanRules(&scanRules, rulesFile) == -1) 
+        {
+            write(STDERR_FILENO, "error: Invalid rule set! Exiting.\n", strlen("error: Invalid rule set! Exiting.\n"));
+            exit(EXIT_FAILURE);
+        }
+
+        InstallScanWatchdog();
+    }
+    else
+        ResolveAnalysisScript();
+
+    // Lower I/O and CPU priorities apply to every process and thread started from here on
+    ApplyGovernorPriorities();
+
+    // Verdicts cached by earlier runs only count for the same rules or script
+    scanRules.version = ComputeRulesVersion(&scanRules);
+
+    // Collecting the directories to monitor, the arguments that are not options or their values
+    char **roots = malloc(argc * sizeof(char *));
+    int numRoots = 0;
+
+    if (!roots) 
+    {
+        write(STDERR_FILENO, "error: Memory allocation failed! Exiting.\n", strlen("error: Memory allocation failed! Exiting.\n"));
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 1; i < argc; i++) 
+    {
+        if (IsOptionWithValue(argv[i])) 
+        {
+            i++; // Skip the next argument 
+        } 
+        else if (!IsFlagOption(argv[i])) 
+        {
+            roots[numRoots++] = argv[i];
+        }
+    }
+
+    // Watch mode runs until it is interrupted, every process then writes a last snapshot before it exits
+    if (watchInterval > 0) 
+    {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = StopWatching;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+    }
+
+    // One child process per directory, at most -P of them at a time, the largest directories first
+    int status = ScheduleRoots(roots, numRoots, outputPath, isolatedPath, statsFile);
+    free(roots);
+
+    write(STDOUT_FILENO, "\n", 1); // Write a newline character to stdout for formatting
+    return status;  // Exit the main function with failure status if a directory failed
+}
+
+
+int IsFlagOption(const char *arg)
+{
+    // Options that stand alone, without a value after them
+    return strcmp(arg, "-F") == 0 || strcmp(arg, "-x") == 0 || strcmp(arg, "-R") == 0 || strcmp(arg, "-C") == 0 || strcmp(arg, "-U") == 0;
+}
+
+
+int IsOptionWithValue(const char *arg)
+{
+    // Options followed by a value, their value must not be mistaken for a monitored directory
+    return strcmp(arg, "-o") == 0 || strcmp(arg, "-s") == 0 || strcmp(arg, "-j") == 0 || strcmp(arg, "-f") == 0 || strcmp(arg, "-r") == 0 ||
+           strcmp(arg, "-a") == 0 || strcmp(arg, "-t") == 0 || strcmp(arg, "-H") == 0 || strcmp(arg, "-P") == 0 ||
+           strcmp(arg, "-m") == 0 || strcmp(arg, "-k") == 0 || strcmp(arg, "-w") == 0 || strcmp(arg, "-G") == 0;
+}
+
+
+void ExploreDirectories(const char *path, SnapshotWriter *writer, char *isolatedPath) 
+{
+    //The whole walk extends one path buffer in place, the names it reads are kept on the walk arena until their directory is done
+    PathBuffer pathBuffer = {NULL, 0, 0};
+    ArenaMark mark = ArenaGetMark(&walkArena);
+
+    if (PathBufferSet(&pathBuffer, path) == 0)
+        ExploreDirectoryPath(&pathBuffer, writer, isolatedPath);
+
+    ArenaRelease(&walkArena, mark);
+    free(pathBuffer.data);
+}
+
+
+void ExploreDirectoryPath(PathBuffer *pathBuffer, SnapshotWriter *writer, char *isolatedPath)
+{
+    DIR *dir = opendir(pathBuffer->data);
+    long long statLatency[STATS_HISTOGRAM_BUCKETS] = {0}; //Folded into the statistics once the directory is done
+    long long numStatCalls = 0;
+
+    AddStat(&runStats.dirReads, 1);
+    GovernorCharge(1, 0);
+
+    //Checks if the directory opening was sufccesful, if not, it printsan error messagew and exists the function
+    if (!dir) 
+    {
+        fprintf(stderr, "Error: Failed to open directory \"%s\"\n", monitoredDirName);
+        return;
+    }
+
+    //Hard links are looked up in the inode table (-U) by the device of their directory and the inode of their entry
+    struct stat dirSt;
+    int shareStats = inodeTable && fstat(dirfd(dir), &dirSt) == 0;
+    long long numStatsShared = 0;
+
+    //Copying the names to the walk arena and closing the directory before the recursion, like scandir did.
+    //They are released once the directory is done, the arena only holds the names of the directories being walked.
+    ArenaMark mark = ArenaGetMark(&walkArena);
+    WalkName *names = NULL;
+    size_t numNames = 0, capacity = 0;
+    struct dirent *dirEntry;
+    int failed = 0;
+
+    while (!failed && (dirEntry = readdir(dir))) 
+    {
+        //does not print the entries "." & ".."  in the snapshot file
+        if (strcmp(dirEntry->d_name, ".") == 0 || strcmp(dirEntry->d_name, "..") == 0)
+            continue;
+
+        //An outgrown array stays on the arena until the directory is done, together they are less than twice the last one
+        if (numNames == capacity) 
+        {
+            size_t newCapacity = capacity ? capacity * 2 : 64;
+            WalkName *newNames = ArenaAlloc(&walkArena, newCapacity * sizeof(WalkName));
+
+            if (newNames && numNames > 0)
+                memcpy(newNames, names, numNames * sizeof(WalkName));
+
+            names = newNames;
+            capacity = newCapacity;
+        }
+
+        if (!names || !(names[numNames].name = ArenaCopyName(&walkArena, dirEntry->d_name, strlen(dirEntry->d_name))))
+            failed = 1;
+        else
+        {
+            names[numNames].ino = dirEntry->d_ino;
+            names[numNames].type = dirEntry->d_type;
+            numNames++;
+        }
+    }
+
+    closedir(dir);
+
+    //If the memory alication fails, the directory is not monitorised further
+    if (failed) 
+    {
+        fprintf(stderr, "Error: Memory allocation failed for path \"%s\"\n", pathBuffer->data);
+        ArenaRelease(&walkArena, mark);
+        return;
+    }
+
+    //Sorted by name, so the snapshot is written in path order
+    qsort(names, numNames, sizeof(WalkName), CompareWalkNames);
+
+    size_t dirLength = pathBuffer->length;
+
+    //Enters a loop that goes through each entry (file or subdirectory) within the opened directory.
+    for (size_t i = 0; i < numNames; i++) 
+    {
+        //Constructs the path for every entry on top of the directory path, the buffer only grows for a longer path
+        pathBuffer->length = dirLength;
+
+        if (PathBufferAppend(pathBuffer, names[i].name, 1) == -1)
+            break;
+
+        struct stat st;
+
+        //Another path of a hard-linked file stat'ed earlier in the run (-U) gets the same information without a stat
+        if (shareStats && FindLinkedStat(dirSt.st_dev, names[i].ino, names[i].type, &st)) 
+            numStatsShared++;
+        else 
+        {
+            GovernorCharge(1, 0);
+
+            double statStart = MonotonicSeconds();
+            int statStatus = lstat(pathBuffer->data, &st);
+            double statDuration = MonotonicSeconds() - statStart;
+
+            statLatency[LatencyBucket(statDuration)]++;
+            numStatCalls++;
+            GovernorObserve(GOVERNOR_OP_STAT, statDuration, 0);
+
+            //We get information with lstat and print the error message in case of failing
+            if (statStatus == -1) 
+            {
+                fprintf(stderr, "Error: Failed to get information for \"%s\"\n", names[i].name);
+                break;
+            }
+
+            RecordLinkedInode(&st);
+        }
+
+        //Hashing the content before the analysis may move the file away
+        unsigned char digest[HASH_MAX_DIGEST_SIZE];
+        int hasDigest = ComputeEntryDigest(AT_FDCWD, pathBuffer->data, &st, digest);
+
+        CheckPermissionsAndAnalyze(pathBuffer->data, st, isolatedPath, writer->output.fd);
+
+        //Writing to the snapshot file the information of the entry, stops monitoring if the memory allocation fails
+        if (WriteEntryInfo(writer, pathBuffer->data, &st, hasDigest ? digest : NULL) == -1)
+            break;
+
+        //If an entry is a directory, it is walked recursively on the same buffer, unless the fast rescan can reuse its listing
+        if (S_ISDIR(st.st_mode)) 
+        {
+            if (!previousSnapshot || ReuseDirectory(pathBuffer->data, &st, writer, isolatedPath) == -1)
+                ExploreDirectoryPath(pathBuffer, writer, isolatedPath);
+        }
+    }
+
+    pathBuffer->length = dirLength;
+    pathBuffer->data[dirLength] = '\0';
+    ArenaRelease(&walkArena, mark);
+
+    AddStat(&runStats.statCalls, numStatCalls);
+    AddStat(&runStats.statsShared, numStatsShared);
+    AddLatencies(runStats.statLatency, statLatency);
+}
+
+
+int ReuseDirectory(const char *path, const struct stat *st, SnapshotWriter *writer, char *isolatedPath)
+{
+    //Adding, removing or renaming an entry changes the mtime and ctime of its directory, unchanged ones list the same entries
+    if (SeekSnapshotReader(previousSnapshot, path) <= 0 || strcmp(previousSnapshot->entry.path, path) != 0 || !previousSnapshot->summary ||
+        previousSnapshot->entry.mtime != StatNanoseconds(&st->st_mtim) || previousSnapshot->entry.ctime != StatNanoseconds(&st->st_ctim))
+        return -1;
+
+    //Collecting the names of the children first, the subdirectories are then walked with the same reader
+    const char **children = NULL;
+    size_t numChildren = 0, capacity = 0;
+    size_t pathLength = strlen(path);
+    ArenaMark mark = ArenaGetMark(&walkArena); //The paths of the children are kept on the walk arena until they are written
+    int status;
+
+    while ((status = NextSnapshotEntry(previousSnapshot)) > 0)
+    {
+        const char *childPath = previousSnapshot->entry.path;
+
+        if (strncmp(childPath, path, pathLength) != 0 || childPath[pathLength] != '/')
+            break;
+
+        //Deeper entries are jumped over with the summary of their directory, or passed one by one without it
+        if (strchr(childPath + pathLength + 1, '/'))
+            continue;
+
+        if (numChildren == capacity)
+        {
+            size_t newCapacity = capacity ? capacity * 2 : 16;
+            const char **newChildren = realloc(children, newCapacity * sizeof(char *));
+
+            if (!newChildren)
+            {
+                status = -1;
+                break;
+            }
+
+            children = newChildren;
+            capacity = newCapacity;
+        }
+
+        if (!(children[numChildren] = ArenaCopyName(&walkArena, childPath, strlen(childPath))))
+        {
+            status = -1;
+            break;
+        }
+
+        numChildren++;
+        SkipSnapshotSubtree(previousSnapshot);
+    }
+
+    //Nothing was written yet, the directory is still read the usual way
+    if (status == -1)
+    {
+        ArenaRelease(&walkArena, mark);
+        free(children);
+        return -1;
+    }
+
+    AddStat(&runStats.directoriesReused, 1);
+    size_t i;
+
+    for (i = 0; i < numChildren; i++)
+    {
+        const char *childPath = children[i];
+
+        //Only the listing is reused. A chmod or an in-place rewrite of a file does not touch its directory, so every entry is
+        //stat'ed; the digest and verdict caches then skip the files whose size, mode, mtime and ctime are unchanged.
+        struct stat childSt;
+
+        AddStat(&runStats.statCalls, 1);
+        GovernorCharge(1, 0);
+
+        if (lstat(childPath, &childSt) == -1)
+        {
+            fprintf(stderr, "Error: Failed to get information for \"%s\"\n", childPath + pathLength + 1);
+            break;
+        }
+
+        //Hashing the content before the analysis may move the file away
+        unsigned char digest[HASH_MAX_DIGEST_SIZE];
+        int hasDigest = ComputeEntryDigest(AT_FDCWD, childPath, &childSt, digest);
+
+        CheckPermissionsAndAnalyze(childPath, childSt, isolatedPath, writer->output.fd);
+
+        if (WriteEntryInfo(writer, childPath, &childSt, hasDigest ? digest : NULL) == -1)
+            break;
+
+        //Subdirectories are checked the same way, their own timestamps decide whether their listing is reused too
+        if (!S_ISDIR(childSt.st_mode))
+            continue;
+
+        if (ReuseDirectory(childPath, &childSt, writer, isolatedPath) == -1)
+            ExploreDirectories(childPath, writer, isolatedPath);
+    }
+
+    ArenaRelease(&walkArena, mark);
+    free(children);
+    return 0;
+}
+
+
+int WriteReusedEntry(SnapshotWriter *writer, const SnapshotEntry *entry)
+{
+    numSnapshotEntries++;
+
+    if (watchState && AppendWatchEntry(entry) == -1)
+        return -1;
+
+    //Like WriteEntryInfo, without the hash cache: the record has no inode to file the digest under
+    if (!writer->ring)
+        return WriteSnapshotEntry(writer, entry);
+
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_size = entry->size;
+    st.st_mode = entry->mode;
+    st.st_nlink = entry->hardLinks;
+
+    return PushEntryRecord(writer, entry->path, &st, entry->hashAlgorithm != HASH_NONE ? entry->digest : NULL);
+}
+
+
+SnapshotReader *OpenPreviousSnapshot(const char *outputDir, const char *dirName, const char *currentName)
+{
+    char previousName[NAME_MAX + 1], previousFile[PATH_MAX];
+
+    if (!FindLatestSnapshot(outputDir, dirName, currentName, previousName, sizeof(previousName)))
+        return NULL;
+
+    snprintf(previousFile, sizeof(previousFile), "%s/%s", outputDir, previousName);
+    SnapshotReader *reader = malloc(sizeof(SnapshotReader));
+
+    if (!reader || OpenSnapshotReader(reader, previousFile) == -1)
+    {
+        free(reader);
+        return NULL;
+    }
+
+    //Only binary snapshots with directory summaries can be searched for a directory
+    if (reader->format != SNAPSHOT_FORMAT_BINARY || !reader->directories)
+    {
+        CloseSnapshotReader(reader);
+        free(reader);
+        return NULL;
+    }
+
+    return reader;
+}
+
+
+int CompareEntryNames(const struct dirent **first, const struct dirent **second)
+{
+    //Byte order of the names, independent of the locale so every run sorts the same way
+    return strcmp((*first)->d_name, (*second)->d_name);
+}
+
+
+int ComparePaths(const char *first, const char *second)
+{
+    //Skipping the common prefix of both paths
+    while (*first && *first == *second) 
+    {
+        first++;
+        second++;
+    }
+
+    //The separator sorts before every other character, so a directory is followed by its whole subtree.
+    //This is the order produced by a depth first walk over name sorted directories.
+    int firstKey = *first == '/' ? 1 : (*first ? (unsigned char)*first + 1 : 0);
+    int secondKey = *second == '/' ? 1 : (*second ? (unsigned char)*second + 1 : 0);
+
+    return firstKey - secondKey;
+}
+
+
+int WriteEntryInfo(SnapshotWriter *writer, const char *entryPath, const struct stat *st, const unsigned char *digest)
+{
+    //The digest is remembered for the next run under the identity and timestamps of the file
+    if (digest && hashCache)
+        AddHashCacheRecord(hashCache, st, digest);
+
+    numSnapshotEntries++;
+
+    //Directories are remembered with their path (-U), a monitored directory below this one is then copied from this snapshot
+    if (inodeTable && S_ISDIR(st->st_mode))
+        RecordSharedDirectory(entryPath, st);
+
+    //Watch mode keeps a copy of every entry, the snapshots it writes later start from this walk
+    if (watchState && RecordWatchEntry(entryPath, st, digest) == -1)
+        return -1;
+
+    //With a writer thread the entry is only copied into the ring, formatting and output happen there
+    if (writer->ring)
+        return PushEntryRecord(writer, entryPath, st, digest);
+
+    SnapshotEntry entry;
+    FillSnapshotEntry(&entry, (char *)entryPath, st, digest);
+    return WriteSnapshotEntry(writer, &entry);
+}
+
+
+void FillSnapshotEntry(SnapshotEntry *entry, char *entryPath, const struct stat *st, const unsigned char *digest)
+{
+    //Only the fields recorded in the snapshot are copied from the stat information
+    entry->path = entryPath;
+    entry->size = st->st_size;
+    entry->mode = st->st_mode;
+    entry->hardLinks = st->st_nlink;
+    entry->hashAlgorithm = digest ? hashAlgorithm : HASH_NONE;
+    entry->mtime = StatNanoseconds(&st->st_mtim);
+    entry->ctime = StatNanoseconds(&st->st_ctim);
+
+    if (digest)
+        memcpy(entry->digest, digest, HashDigestLength(hashAlgorithm));
+}
+
+
+void ExploreDirectoriesParallel(const char *path, SnapshotWriter *writer, char *isolatedPath)
+{
+    //The root node is opened here, every other directory is opened by the worker that finds it
+    DirNode rootNode = {.name = path, .fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+    DirNode *root = &rootNode;
+
+    if (root->fd == -1) 
+    {
+        fprintf(stderr, "Error: Failed to open directory \"%s\"\n", monitoredDirName);
+        return;
+    }
+
+    TraversalPool pool;
+    pool.numWorkers = numTraversalThreads;
+    atomic_init(&pool.pendingTasks, 1);
+    atomic_init(&pool.openDirFds, 1);
+    atomic_init(&pool.bufferedEntries, 0);
+    atomic_init(&pool.cancelled, 0);
+    atomic_init(&root->ready, 0);
+    pool.deques = calloc(pool.numWorkers + 1, sizeof(WorkDeque));
+    TraversalWorker *workers = calloc(pool.numWorkers + 1, sizeof(TraversalWorker));
+
+    if (!pool.deques || !workers) 
+    {
+        fprintf(stderr, "Error: Memory allocation failed for path \"%s\"\n", path);
+        close(root->fd);
+        free(pool.deques);
+        free(workers);
+        return;
+    }
+
+    //The last worker is the emitter on the calling thread, it reads the directories it needs before a worker took them
+    TraversalWorker *emitter = &workers[pool.numWorkers];
+
+    for (int i = 0; i <= pool.numWorkers; i++) 
+    {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+        workers[i].pool = &pool;
+        workers[i].id = i;
+        workers[i].direntBuffer = malloc(GETDENTS_BUFFER_SIZE);
+    }
+
+    root->owner = emitter->id;
+    PushTask(&pool.deques[emitter->id], root); //The workers steal the root, or the emitter claims it first
+
+    //A worker that could not be started simply takes nothing, the emitter reads what it needs itself
+    int started[pool.numWorkers];
+
+    for (int i = 0; i < pool.numWorkers; i++) 
+        started[i] = workers[i].direntBuffer && pthread_create(&workers[i].thread, NULL, TraversalWorkerMain, &workers[i]) == 0;
+
+    //Emitting on this thread in the order of the serial walk while the workers read ahead, the analysis forks happen here as well
+    PathBuffer pathBuffer = {NULL, 0, 0};
+
+    if (!emitter->direntBuffer || PathBufferSet(&pathBuffer, path) == -1)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for path \"%s\"\n", path);
+        atomic_store(&pool.cancelled, 1);
+        DiscardDirNode(emitter, root);
+    }
+    else if (EmitDirNode(emitter, root, &pathBuffer, writer, isolatedPath) == -1)
+        fprintf(stderr, "Error: Traversal of \"%s\" did not complete\n", monitoredDirName);
+
+    free(pathBuffer.data);
+    atomic_fetch_sub(&pool.bufferedEntries, root->numEntries);
+    free(root->entries);
+
+    for (int i = 0; i < pool.numWorkers; i++) 
+    {
+        if (started[i])
+            pthread_join(workers[i].thread, NULL);
+    }
+
+    //Every directory was emitted or discarded, only one left queued after a failed push could still hold an fd
+    for (int i = 0; i <= pool.numWorkers; i++) 
+    {
+        DirNode *node;
+
+        while ((node = PopTask(&pool.deques[i])))
+        {
+            if (node->fd != -1)
+                close(node->fd);
+        }
+
+        AddStat(&runStats.arenaBytes, workers[i].arena.peakBytes);
+        FreeArena(&workers[i].arena);
+
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].tasks);
+        free(workers[i].direntBuffer);
+        free(workers[i].scratch);
+    }
+
+    free(pool.deques);
+    free(workers);
+}
+
+
+int PushTask(WorkDeque *deque, DirNode *node)
+{
+    pthread_mutex_lock(&deque->lock);
+
+    //Doubling the ring when it is full, the tasks between head and tail are copied in order
+    if (deque->tail - deque->head == deque->capacity) 
+    {
+        size_t newCapacity = deque->capacity ? deque->capacity * 2 : 64;
+        DirNode **newTasks = malloc(newCapacity * sizeof(DirNode *));
+
+        if (!newTasks) 
+        {
+            pthread_mutex_unlock(&deque->lock);
+            return -1;
+        }
+
+        for (size_t i = deque->head; i < deque->tail; i++) 
+            newTasks[i & (newCapacity - 1)] = deque->tasks[i & (deque->capacity - 1)];
+
+        free(deque->tasks);
+        deque->tasks = newTasks;
+        deque->capacity = newCapacity;
+    }
+
+    deque->tasks[deque->tail & (deque->capacity - 1)] = node;
+    deque->tail++;
+
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+
+DirNode *PopTask(WorkDeque *deque)
+{
+    DirNode *node = NULL;
+
+    //The owner takes the newest task so it keeps walking depth first on warm directories, tasks claimed by the emitter are skipped
+    pthread_mutex_lock(&deque->lock);
+
+    while (!node && deque->tail != deque->head) 
+    {
+        deque->tail--;
+        node = deque->tasks[deque->tail & (deque->capacity - 1)];
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return node;
+}
+
+
+DirNode *StealTask(WorkDeque *deque)
+{
+    DirNode *node = NULL;
+
+    //Thieves take the oldest task, which is the closest to the root and usually has the largest subtree
+    pthread_mutex_lock(&deque->lock);
+
+    while (!node && deque->tail != deque->head) 
+    {
+        node = deque->tasks[deque->head & (deque->capacity - 1)];
+        deque->head++;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return node;
+}
+
+
+int ClaimTask(WorkDeque *deque, DirNode *node)
+{
+    int found = 0;
+
+    //The task is left as a hole, the owner and the thieves step over it
+    pthread_mutex_lock(&deque->lock);
+
+    for (size_t i = deque->head; !found && i != deque->tail; i++) 
+    {
+        if (deque->tasks[i & (deque->capacity - 1)] == node)
+        {
+            deque->tasks[i & (deque->capacity - 1)] = NULL;
+            found = 1;
+        }
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+
+void *TraversalWorkerMain(void *arg)
+{
+    TraversalWorker *worker = arg;
+    TraversalPool *pool = worker->pool;
+
+    while (1) 
+    {
+        //Far enough ahead of the snapshot writer, waiting for the emitter to catch up. It reads the directories it needs itself.
+        DirNode *node = atomic_load(&pool->bufferedEntries) < MAX_BUFFERED_ENTRIES ? PopTask(&pool->deques[worker->id]) : NULL;
+
+        //Own deque is empty: trying to steal from the other workers and the emitter, starting with the next one
+        for (int i = 1; !node && i <= pool->numWorkers && atomic_load(&pool->bufferedEntries) < MAX_BUFFERED_ENTRIES; i++) 
+            node = StealTask(&pool->deques[(worker->id + i) % (pool->numWorkers + 1)]);
+
+        if (!node) 
+        {
+            //Nothing queued anywhere and nobody reading a directory that could queue more: the walk is over
+            if (atomic_load(&pool->pendingTasks) == 0)
+                break;
+
+            struct timespec pause = {0, 50000};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        ReadDirectoryNode(worker, node);
+        atomic_fetch_sub(&pool->pendingTasks, 1);
+    }
+
+    return NULL;
+}
+
+
+void ReadDirectoryNode(TraversalWorker *worker, DirNode *node)
+{
+    TraversalPool *pool = worker->pool;
+
+    //Once the snapshot cannot be written any more the directories still queued are only closed
+    if (!atomic_load(&pool->cancelled))
+        ListDirectoryNode(worker, node);
+    else if (node->fd != -1)
+    {
+        close(node->fd);
+        atomic_fetch_sub(&pool->openDirFds, 1);
+        node->fd = -1;
+    }
+
+    //The emitter may take the node from here on, nothing of it is touched after this
+    atomic_fetch_add(&pool->bufferedEntries, node->numEntries);
+    atomic_store_explicit(&node->ready, 1, memory_order_release);
+}
+
+
+void ListDirectoryNode(TraversalWorker *worker, DirNode *node)
+{
+    TraversalPool *pool = worker->pool;
+    int dirFd = node->fd;
+
+    //Directories queued while too many fds were open are reopened through their full path
+    if (dirFd == -1) 
+    {
+        char *nodePath = BuildNodePath(node);
+
+        if (nodePath)
+            dirFd = open(nodePath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        free(nodePath);
+
+        if (dirFd == -1) 
+        {
+            node->openFailed = 1;
+            return;
+        }
+    }
+    else
+        atomic_fetch_sub(&pool->openDirFds, 1);
+
+    node->fd = -1;
+
+    long bytesRead;
+    int stop = 0;
+    long long numDirReads = 0;
+    size_t numEntries = 0, namesLength = 0;
+    ArenaMark mark = ArenaGetMark(&worker->arena); //The names are copied to the arena while the batches are read, then to the block
+
+    //Reading the names in large batches, the entries are stat'ed once the directory is sorted
+    while (!stop && (numDirReads++, GovernorCharge(1, 0), bytesRead = syscall(SYS_getdents64, dirFd, worker->direntBuffer, GETDENTS_BUFFER_SIZE)) > 0) 
+    {
+        for (long offset = 0; offset < bytesRead; ) 
+        {
+            struct linux_dirent64 *dirEntry = (struct linux_dirent64 *)(worker->direntBuffer + offset);
+            offset += dirEntry->d_reclen;
+
+            //does not record the entries "." & ".." like the serial walk
+            if (strcmp(dirEntry->d_name, ".") == 0 || strcmp(dirEntry->d_name, "..") == 0)
+                continue;
+
+            //Growing the scratch array of the worker when it is full, it keeps its size for the next directories
+            if (numEntries == worker->scratchCapacity) 
+            {
+                size_t newCapacity = worker->scratchCapacity ? worker->scratchCapacity * 2 : 256;
+                TreeEntry *newEntries = realloc(worker->scratch, newCapacity * sizeof(TreeEntry));
+
+                if (!newEntries) 
+                {
+                    fprintf(stderr, "Error: Memory allocation failed for entry \"%s\"\n", dirEntry->d_name);
+                    stop = 1;
+                    break;
+                }
+
+                worker->scratch = newEntries;
+                worker->scratchCapacity = newCapacity;
+            }
+
+            TreeEntry *entry = &worker->scratch[numEntries];
+            size_t nameLength = strlen(dirEntry->d_name);
+            entry->name = ArenaCopyName(&worker->arena, dirEntry->d_name, nameLength);
+            namesLength += nameLength + 1;
+            entry->child = NULL;
+            entry->digest = NULL;
+
+            //Inode and type of the directory entry, kept in the stat information it is replaced by, to find hard links (-U)
+            entry->st.st_ino = dirEntry->d_ino;
+            entry->st.st_mode = DTTOIF(dirEntry->d_type);
+
+            if (!entry->name) 
+            {
+                fprintf(stderr, "Error: Memory allocation failed for entry \"%s\"\n", dirEntry->d_name);
+                stop = 1;
+                break;
+            }
+
+            numEntries++;
+        }
+    }
+
+    //Same name order as the serial walk, the snapshot comes out sorted by path
+    qsort(worker->scratch, numEntries, sizeof(TreeEntry), CompareTreeEntries);
+
+    //Moving the entries, room for their digests and their names to one block of their final size, freed once the directory is emitted.
+    //The scratch array and the arena are free again before any subdirectory is read.
+    //Names are copied rather than interned, a table shared across directories would keep every distinct name until the walk ends.
+    size_t digestLength = hashAlgorithm != HASH_NONE ? HashDigestLength(hashAlgorithm) : 0;
+    unsigned char *digests = NULL;
+
+    if (numEntries > 0 && !(node->entries = malloc(numEntries * (sizeof(TreeEntry) + digestLength) + namesLength))) 
+    {
+        fprintf(stderr, "Error: Memory allocation failed for path \"%s\"\n", node->name);
+        numEntries = 0;
+    }
+
+    if (numEntries > 0)
+    {
+        digests = (unsigned char *)(node->entries + numEntries);
+        char *names = (char *)(digests + numEntries * digestLength);
+
+        for (size_t i = 0; i < numEntries; i++)
+        {
+            size_t nameLength = strlen(worker->scratch[i].name) + 1;
+            node->entries[i] = worker->scratch[i];
+            node->entries[i].name = memcpy(names, worker->scratch[i].name, nameLength);
+            names += nameLength;
+        }
+    }
+
+    ArenaRelease(&worker->arena, mark);
+    node->numEntries = numEntries;
+
+    //Counted locally and folded once, the workers do not share a cache line per stat
+    long long statLatency[STATS_HISTOGRAM_BUCKETS] = {0};
+    long long numStatCalls = 0, numStatsShared = 0;
+
+    //Hard links are looked up in the inode table (-U) by the device of this directory
+    struct stat dirSt;
+    int shareStats = inodeTable && fstat(dirFd, &dirSt) == 0;
+
+    AddStat(&runStats.dirReads, numDirReads);
+
+    for (size_t i = 0; i < node->numEntries; i++) 
+    {
+        TreeEntry *entry = &node->entries[i];
+
+        //Another path of a hard-linked file stat'ed earlier in the run gets the same information without a stat
+        if (shareStats && FindLinkedStat(dirSt.st_dev, entry->st.st_ino, IFTODT(entry->st.st_mode), &entry->st)) 
+        {
+            numStatsShared++;
+            continue;
+        }
+
+        GovernorCharge(1, 0);
+
+        double statStart = MonotonicSeconds();
+        int statStatus = fstatat(dirFd, entry->name, &entry->st, AT_SYMLINK_NOFOLLOW);
+        double statDuration = MonotonicSeconds() - statStart;
+
+        statLatency[LatencyBucket(statDuration)]++;
+        numStatCalls++;
+        GovernorObserve(GOVERNOR_OP_STAT, statDuration, 0);
+
+        //Same as the serial walk, a failed stat ends the listing of this directory
+        if (statStatus == -1) 
+        {
+            node->statFailedName = entry->name;
+            node->numEntries = i;
+            break;
+        }
+
+        RecordLinkedInode(&entry->st);
+
+        if (!S_ISDIR(entry->st.st_mode))
+            continue;
+
+        //Queueing the subdirectory on this worker, it is opened relative to the current directory while it is hot
+        DirNode *child = calloc(1, sizeof(DirNode));
+
+        if (!child) 
+        {
+            fprintf(stderr, "Error: Memory allocation failed for entry \"%s\"\n", entry->name);
+            continue;
+        }
+
+        child->parent = node;
+        child->name = entry->name;
+        child->fd = -1;
+        child->owner = worker->id;
+        atomic_init(&child->ready, 0);
+
+        if (atomic_fetch_add(&pool->openDirFds, 1) < MAX_OPEN_DIR_FDS) 
+        {
+            child->fd = openat(dirFd, entry->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+            //Out of fds is retried by path later, any other error is reported like a failed opendir
+            if (child->fd == -1 && errno != EMFILE && errno != ENFILE)
+                child->openFailed = 1;
+        }
+
+        if (child->fd == -1)
+            atomic_fetch_sub(&pool->openDirFds, 1);
+
+        entry->child = child;
+
+        //Nothing to read, the emitter reports it when it gets there
+        if (child->openFailed)
+        {
+            atomic_store(&child->ready, 1);
+            continue;
+        }
+
+        atomic_fetch_add(&pool->pendingTasks, 1);
+
+        if (PushTask(&pool->deques[worker->id], child) == -1) 
+        {
+            //Queue could not grow: reading the subdirectory right away on this worker
+            ReadDirectoryNode(worker, child);
+            atomic_fetch_sub(&pool->pendingTasks, 1);
+        }
+    }
+
+    AddStat(&runStats.statCalls, numStatCalls);
+    AddStat(&runStats.statsShared, numStatsShared);
+    AddLatencies(runStats.statLatency, statLatency);
+
+    //Files are hashed once the subdirectories are queued, idle workers can steal them meanwhile
+    if (hashAlgorithm != HASH_NONE) 
+    {
+        unsigned char digest[HASH_MAX_DIGEST_SIZE];
+
+        for (size_t i = 0; i < node->numEntries; i++) 
+        {
+            TreeEntry *entry = &node->entries[i];
+
+            if (ComputeEntryDigest(dirFd, entry->name, &entry->st, digest))
+            {
+                entry->digest = digests + i * digestLength;
+                memcpy(entry->digest, digest, digestLength);
+            }
+        }
+    }
+
+    close(dirFd);
+}
+
+
+int CompareTreeEntries(const void *first, const void *second)
+{
+    return strcmp(((const TreeEntry *)first)->name, ((const TreeEntry *)second)->name);
+}
+
+
+int CompareWalkNames(const void *first, const void *second)
+{
+    //Byte order, like CompareEntryNames for scandir
+    return strcmp(((const WalkName *)first)->name, ((const WalkName *)second)->name);
+}
+
+
+char *BuildNodePath(const DirNode *node)
+{
+    size_t length = 1;
+
+    //Measuring the path first: every component, its separator and the null terminator
+    for (const DirNode *current = node; current; current = current->parent)
+        length += strlen(current->name) + (current->parent ? 1 : 0);
+
+    char *nodePath = malloc(length);
+
+    if (!nodePath)
+        return NULL;
+
+    //Filling the buffer from the end since the parent links go from the leaf to the root
+    size_t position = length - 1;
+    nodePath[position] = '\0';
+
+    for (const DirNode *current = node; current; current = current->parent) 
+    {
+        size_t nameLength = strlen(current->name);
+        position -= nameLength;
+        memcpy(nodePath + position, current->name, nameLength);
+
+        if (current->parent)
+            nodePath[--position] = '/';
+    }
+
+    return nodePath;
+}
+
+
+int PathBufferSet(PathBuffer *buffer, const char *path)
+{
+    buffer->length = 0;
+    return PathBufferAppend(buffer, path, 0);
+}
+
+
+int PathBufferAppend(PathBuffer *buffer, const char *component, int addSeparator)
+{
+    size_t componentLength = strlen(component);
+    size_t needed = buffer->length + componentLength + 2;
+
+    //Growing the buffer geometrically so long paths are not reallocated for every entry
+    if (needed > buffer->capacity) 
+    {
+        size_t newCapacity = buffer->capacity ? buffer->capacity : PATH_MAX;
+
+        while (newCapacity < needed)
+            newCapacity *= 2;
+
+        char *newData = realloc(buffer->data, newCapacity);
+
+        if (!newData) 
+        {
+            fprintf(stderr, "Error: Memory allocation failed for path \"%s\"\n", component);
+            return -1;
+        }
+
+        buffer->data = newData;
+        buffer->capacity = newCapacity;
+    }
+
+    if (addSeparator)
+        buffer->data[buffer->length++] = '/';
+
+    memcpy(buffer->data + buffer->length, component, componentLength + 1);
+    buffer->length += componentLength;
+    return 0;
+}
+
+
+int EmitDirNode(TraversalWorker *emitter, DirNode *node, PathBuffer *pathBuffer, SnapshotWriter *writer, char *isolatedPath)
+{
+    WaitForDirNode(emitter, node);
+
+    //Reporting the directory the way the serial walk does when opendir fails
+    if (node->openFailed) 
+    {
+        fprintf(stderr, "Error: Failed to open directory \"%s\"\n", monitoredDirName);
+        return 0;
+    }
+
+    size_t dirLength = pathBuffer->length;
+    int status = 0;
+
+    for (size_t i = 0; i < node->numEntries; i++) 
+    {
+        TreeEntry *entry = &node->entries[i];
+
+        //Constructs the path for every entry on top of the directory path
+        pathBuffer->length = dirLength;
+
+        if (status == 0 && PathBufferAppend(pathBuffer, entry->name, 1) == -1)
+            status = -1;
+
+        if (status == 0)
+        {
+            CheckPermissionsAndAnalyze(pathBuffer->data, entry->st, isolatedPath, writer->output.fd);
+
+            if (WriteEntryInfo(writer, pathBuffer->data, &entry->st, entry->digest) == -1)
+                status = -1;
+        }
+
+        //The workers stop reading once nothing more can be written, the directories already found are still freed
+        if (status == -1)
+            atomic_store(&emitter->pool->cancelled, 1);
+
+        //Subdirectories follow their own entry, like the recursion of the serial walk, and are freed right after it
+        if (entry->child)
+        {
+            if (status == 0)
+                status = EmitDirNode(emitter, entry->child, pathBuffer, writer, isolatedPath);
+            else
+                DiscardDirNode(emitter, entry->child);
+
+            ReleaseDirNode(emitter->pool, entry->child);
+        }
+    }
+
+    pathBuffer->length = dirLength;
+    pathBuffer->data[dirLength] = '\0';
+
+    if (node->statFailedName)
+        fprintf(stderr, "Error: Failed to get information for \"%s\"\n", node->statFailedName);
+
+    return status;
+}
+
+
+void WaitForDirNode(TraversalWorker *emitter, DirNode *node)
+{
+    TraversalPool *pool = emitter->pool;
+    int claimTried = 0;
+
+    while (!atomic_load_explicit(&node->ready, memory_order_acquire))
+    {
+        //Still queued: read here rather than wait for a worker, which may be paused for the emitter itself.
+        //Once a worker took it, it is never queued again, one look suffices.
+        if (!claimTried && ClaimTask(&pool->deques[node->owner], node))
+        {
+            ReadDirectoryNode(emitter, node);
+            atomic_fetch_sub(&pool->pendingTasks, 1);
+            break;
+        }
+
+        claimTried = 1;
+
+        struct timespec pause = {0, 50000};
+        nanosleep(&pause, NULL);
+    }
+}
+
+
+void DiscardDirNode(TraversalWorker *emitter, DirNode *node)
+{
+    //Waiting for every directory below, a worker may still be reading one
+    WaitForDirNode(emitter, node);
+
+    for (size_t i = 0; i < node->numEntries; i++) 
+    {
+        if (node->entries[i].child)
+        {
+            DiscardDirNode(emitter, node->entries[i].child);
+            ReleaseDirNode(emitter->pool, node->entries[i].child);
+        }
+    }
+}
+
+
+void ReleaseDirNode(TraversalPool *pool, DirNode *node)
+{
+    //The names of its own subdirectories live in the block, they are all released by now
+    atomic_fetch_sub(&pool->bufferedEntries, node->numEntries);
+    free(node->entries);
+    free(node);
+}
+
+
+void *ArenaAlloc(Arena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    ArenaChunk *chunk = arena->chunk;
+
+    //Starting a new block when the current one is full, what is left of the old one stays unused
+    if (!chunk || chunk->size - chunk->used < size) 
+    {
+        size_t chunkSize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        ArenaChunk *newChunk = malloc(sizeof(ArenaChunk) + chunkSize);
+
+        if (!newChunk)
+            return NULL;
+
+        newChunk->previous = chunk;
+        newChunk->size = chunkSize;
+        newChunk->used = 0;
+        arena->chunk = chunk = newChunk;
+        arena->bytes += chunkSize;
+
+        if (arena->bytes > arena->peakBytes)
+            arena->peakBytes = arena->bytes;
+    }
+
+    void *memory = chunk->data + chunk->used;
+    chunk->used += size;
+    return memory;
+}
+
+
+char *ArenaCopyName(Arena *arena, const char *name, size_t length)
+{
+    char *copy = ArenaAlloc(arena, length + 1);
+
+    if (copy) 
+    {
+        memcpy(copy, name, length);
+        copy[length] = '\0';
+    }
+
+    return copy;
+}
+
+
+ArenaMark ArenaGetMark(const Arena *arena)
+{
+    ArenaMark mark = {arena->chunk, arena->chunk ? arena->chunk->used : 0};
+    return mark;
+}
+
+
+void ArenaRelease(Arena *arena, ArenaMark mark)
+{
+    //Blocks started after the mark are freed, the oldest one is kept for the next allocations
+    while (arena->chunk && arena->chunk != mark.chunk && arena->chunk->previous) 
+    {
+        ArenaChunk *previous = arena->chunk->previous;
+        arena->bytes -= arena->chunk->size;
+        free(arena->chunk);
+        arena->chunk = previous;
+    }
+
+    if (arena->chunk)
+        arena->chunk->used = arena->chunk == mark.chunk ? mark.used : 0;
+}
+
+
+void FreeArena(Arena *arena)
+{
+    while (arena->chunk) 
+    {
+        ArenaChunk *previous = arena->chunk->previous;
+        free(arena->chunk);
+        arena->chunk = previous;
+    }
+
+    memset(arena, 0, sizeof(Arena));
+}
+
+
+InodeTable *OpenInodeTable(void)
+{
+    InodeTable *table = calloc(1, sizeof(InodeTable));
+
+    if (!table)
+        return NULL;
+
+    for (int i = 0; i < INODE_TABLE_SHARDS; i++)
+        pthread_mutex_init(&table->shards[i].lock, NULL);
+
+    return table;
+}
+
+
+void CloseInodeTable(InodeTable *table)
+{
+    //Records, paths and roots all live in the arenas, they go at once
+    for (int i = 0; i < INODE_TABLE_SHARDS; i++)
+    {
+        pthread_mutex_destroy(&table->shards[i].lock);
+        free(table->shards[i].buckets);
+        FreeArena(&table->shards[i].arena);
+    }
+
+    FreeArena(&table->arena);
+    free(table);
+}
+
+
+uint64_t HashInode(dev_t dev, ino_t ino)
+{
+    //Inode numbers are often consecutive, multiplying spreads them over the shards (top bits) and the buckets (low bits)
+    return ((uint64_t)ino * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)dev * 0xC2B2AE3D27D4EB4FULL);
+}
+
+
+InodeRecord *LookupInode(InodeShard *shard, uint64_t hash, dev_t dev, ino_t ino)
+{
+    if (!shard->buckets)
+        return NULL;
+
+    for (InodeRecord *record = shard->buckets[hash & shard->mask]; record; record = record->next)
+    {
+        if (record->ino == ino && record->dev == dev)
+            return record;
+    }
+
+    return NULL;
+}
+
+
+InodeRecord *FindInode(dev_t dev, ino_t ino)
+{
+    uint64_t hash = HashInode(dev, ino);
+    InodeShard *shard = &inodeTable->shards[hash >> 58];
+
+    pthread_mutex_lock(&shard->lock);
+    InodeRecord *record = LookupInode(shard, hash, dev, ino);
+    pthread_mutex_unlock(&shard->lock);
+
+    return record;
+}
+
+
+InodeRecord *AddInode(const struct stat *st)
+{
+    uint64_t hash = HashInode(st->st_dev, st->st_ino);
+    InodeShard *shard = &inodeTable->shards[hash >> 58];
+
+    pthread_mutex_lock(&shard->lock);
+    InodeRecord *record = LookupInode(shard, hash, st->st_dev, st->st_ino);
+
+    if (record)
+    {
+        pthread_mutex_unlock(&shard->lock);
+        return record;
+    }
+
+    //Doubling the buckets once there is a record per bucket, the chains stay short
+    if (!shard->buckets || shard->numRecords > shard->mask)
+    {
+        size_t newSize = shard->buckets ? 2 * (shard->mask + 1) : INODE_TABLE_INITIAL_BUCKETS;
+        InodeRecord **newBuckets = calloc(newSize, sizeof(InodeRecord *));
+
+        if (!newBuckets && !shard->buckets)
+        {
+            pthread_mutex_unlock(&shard->lock);
+            return NULL;
+        }
+
+        //A table that cannot grow keeps working with longer chains
+        if (newBuckets)
+        {
+            for (size_t i = 0; shard->buckets && i <= shard->mask; i++)
+            {
+                InodeRecord *next;
+
+                for (InodeRecord *moved = shard->buckets[i]; moved; moved = next)
+                {
+                    next = moved->next;
+                    size_t bucket = HashInode(moved->dev, moved->ino) & (newSize - 1);
+                    moved->next = newBuckets[bucket];
+                    newBuckets[bucket] = moved;
+                }
+            }
+
+            free(shard->buckets);
+            shard->buckets = newBuckets;
+            shard->mask = newSize - 1;
+        }
+    }
+
+    if ((record = ArenaAlloc(&shard->arena, sizeof(InodeRecord))))
+    {
+        memset(record, 0, sizeof(InodeRecord));
+        record->dev = st->st_dev;
+        record->ino = st->st_ino;
+        record->st = *st;
+        record->next = shard->buckets[hash & shard->mask];
+        shard->buckets[hash & shard->mask] = record;
+        shard->numRecords++;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    return record;
+}
+
+
+int FindLinkedStat(dev_t dev, ino_t ino, unsigned char type, struct stat *st)
+{
+    //Directories are always stat'ed, their timestamps drive the fast rescan; an unknown type could be one
+    if (type == DT_DIR || type == DT_UNKNOWN)
+        return 0;
+
+    uint64_t hash = HashInode(dev, ino);
+    InodeShard *shard = &inodeTable->shards[hash >> 58];
+    int found = 0;
+
+    pthread_mutex_lock(&shard->lock);
+    InodeRecord *record = LookupInode(shard, hash, dev, ino);
+
+    //The type the directory listing gives must agree with the recorded one, anything else is stat'ed as usual
+    if (record && record->st.st_nlink > 1 && IFTODT(record->st.st_mode) == type)
+    {
+        *st = record->st;
+        found = 1;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    return found;
+}
+
+
+void RecordLinkedInode(const struct stat *st)
+{
+    //Only files with more than one path can be met again
+    if (inodeTable && !S_ISDIR(st->st_mode) && st->st_nlink > 1)
+        AddInode(st);
+}
+
+
+void RecordSharedDirectory(const char *entryPath, const struct stat *st)
+{
+    SharedRoot *root = inodeTable->currentRoot;
+    InodeRecord *record;
+
+    if (!root || !(record = AddInode(st)))
+        return;
+
+    //The first complete snapshot a directory is in keeps it, a root below it is copied from there
+    if (!record->root || !record->root->complete)
+    {
+        const char *path = ArenaCopyName(&inodeTable->arena, entryPath, strlen(entryPath));
+
+        if (path)
+        {
+            record->path = path;
+            record->root = root;
+        }
+    }
+}
+
+
+const InodeRecord *BeginSharedRoot(const char *path, const char *snapshotFile)
+{
+    struct stat st;
+    InodeRecord *record;
+
+    inodeTable->currentRoot = NULL;
+
+    //The monitored path is opened with opendir, which follows a symbolic link, so it is looked up the same way
+    if (stat(path, &st) == -1 || !(record = AddInode(&st)))
+        return NULL;
+
+    if (record->root && record->root->complete)
+        return record;
+
+    //Directories read from here on are recorded under this root, they can be copied once its snapshot is complete
+    SharedRoot *root = ArenaAlloc(&inodeTable->arena, sizeof(SharedRoot));
+    const char *rootPath = ArenaCopyName(&inodeTable->arena, path, strlen(path));
+
+    if (!root || !rootPath || !(root->snapshotFile = ArenaCopyName(&inodeTable->arena, snapshotFile, strlen(snapshotFile))))
+        return NULL;
+
+    root->complete = 0;
+    record->path = rootPath;
+    record->root = root;
+    inodeTable->currentRoot = root;
+    return NULL;
+}
+
+
+int CopySharedSubtree(const InodeRecord *record, const char *path, SnapshotWriter *writer)
+{
+    SnapshotReader reader;
+
+    //The snapshot may be gone, when a later root with the same name replaced it in the history; the directory is then walked
+    if (OpenSnapshotReader(&reader, record->root->snapshotFile) == -1)
+        return -1;
+
+    PathBuffer pathBuffer = {NULL, 0, 0};
+    size_t prefixLength = strlen(record->path);
+    long long numEntries = 0;
+    int failed = 0;
+    int status = PathBufferSet(&pathBuffer, path);
+    size_t rootLength = pathBuffer.length;
+
+    if (status == 0)
+        status = SeekQueryStart(&reader, record->root->snapshotFile, record->path);
+
+    //The subtree follows the entry of the directory itself, each path gets this root in place of the directory
+    for (; status > 0; status = NextSnapshotEntry(&reader))
+    {
+        const char *entryPath = reader.entry.path;
+
+        if (strncmp(entryPath, record->path, prefixLength) != 0 || (entryPath[prefixLength] != '/' && entryPath[prefixLength] != '\0'))
+            break;
+
+        if (entryPath[prefixLength] == '\0')
+            continue;
+
+        pathBuffer.length = rootLength;
+
+        if (PathBufferAppend(&pathBuffer, entryPath + prefixLength, 0) == -1)
+        {
+            failed = 1;
+            break;
+        }
+
+        SnapshotEntry entry = reader.entry;
+        entry.path = pathBuffer.data;
+
+        if (WriteReusedEntry(writer, &entry) == -1)
+        {
+            failed = 1;
+            break;
+        }
+
+        numEntries++;
+    }
+
+    CloseSnapshotReader(&reader);
+    free(pathBuffer.data);
+
+    //Nothing written yet: the snapshot lists nothing below the directory or could not be read, the directory is walked instead
+    if (numEntries == 0 && !failed)
+        return -1;
+
+    //Entries are already in the snapshot, walking now would list them twice
+    if (failed || status == -1)
+    {
+        fprintf(stderr, "Error: Failed to copy the entries of \"%s\" from the snapshot \"%s\"\n", monitoredDirName, record->root->snapshotFile);
+        return -2;
+    }
+
+    fprintf(stdout, "\"%s\" was read as \"%s\" => %lld entries copied from the snapshot \"%s\".\n", path, record->path, numEntries, record->root->snapshotFile);
+    AddStat(&runStats.entriesDerived, numEntries);
+    return 0;
+}
+
+
+int CheckSharedAnalysis(const char *entryPath, const struct stat *st, char *isolatedDir, InodeRecord **analyzing)
+{
+    InodeRecord *record;
+
+    *analyzing = NULL;
+
+    //Files with a single path are analyzed as usual
+    if (!inodeTable || S_ISDIR(st->st_mode) || st->st_nlink < 2 || !(record = AddInode(st)))
+        return 0;
+
+    if (record->analysis == INODE_NOT_ANALYZED)
+    {
+        //The caller settles the record with whatever becomes of this analysis, or the other paths would wait forever
+        record->analysis = INODE_ANALYZING;
+        *analyzing = record;
+        return 0;
+    }
+
+    if (record->analysis == INODE_ANALYZING)
+    {
+        //The verdict of the other path is applied to this one too once it comes back
+        PendingLink *link = ArenaAlloc(&inodeTable->arena, sizeof(PendingLink));
+
+        if (!link || !(link->path = ArenaCopyName(&inodeTable->arena, entryPath, strlen(entryPath))))
+            return 0;
+
+        link->next = record->pendingLinks;
+        record->pendingLinks = link;
+        fprintf(stdout, "\"%s\" in \"%s\" is a hard link of a file being analyzed => Waiting for its verdict.\n", basename((char *)entryPath), monitoredDirName);
+    }
+    else if (record->analysis == INODE_SAFE)
+        fprintf(stdout, "\"%s\" in \"%s\" is safe (hard link of a file already analyzed).\n", basename((char *)entryPath), monitoredDirName);
+    else
+        ApplyAnalysisVerdict(entryPath, isolatedDir, 1, NULL, NULL);
+
+    AddStat(&runStats.analysesShared, 1);
+    return 1;
+}
+
+
+void SettleSharedAnalysis(InodeRecord *record, char *isolatedDir, int verdict)
+{
+    PendingLink *link = record->pendingLinks;
+
+    //After a failed analysis the next path met tries again
+    record->pendingLinks = NULL;
+    record->analysis = verdict > 0 ? INODE_MALICIOUS : verdict == 0 ? INODE_SAFE : INODE_NOT_ANALYZED;
+
+    for (; link; link = link->next)
+    {
+        if (verdict > 0)
+            ApplyAnalysisVerdict(link->path, isolatedDir, verdict, NULL, NULL);
+        else if (verdict == 0)
+            fprintf(stdout, "\"%s\" in \"%s\" is safe (hard link of a file already analyzed).\n", basename((char *)link->path), monitoredDirName);
+        else
+            fprintf(stderr, "Error: \"%s\" in \"%s\" was not analyzed, the analysis of another hard link of it failed\n", basename((char *)link->path), monitoredDirName);
+    }
+}
+
+
+void RunRootsInProcess(RootRun *runs, int *order, int numRoots, char *outputDir, char *isolatedDir)
+{
+    int *depths = malloc(numRoots * sizeof(int));
+
+    //Ancestors go first, so the directories below them are copied from their snapshot instead of walked again
+    if (depths)
+    {
+        for (int i = 0; i < numRoots; i++)
+        {
+            char resolved[PATH_MAX];
+            depths[i] = INT_MAX;
+
+            if (realpath(runs[i].path, resolved))
+            {
+                depths[i] = 0;
+
+                for (const char *c = resolved; *c; c++)
+                    depths[i] += *c == '/';
+            }
+        }
+
+        qsort_r(order, numRoots, sizeof(int), CompareRootDepths, depths);
+        free(depths);
+    }
+
+    if (!(inodeTable = OpenInodeTable()))
+        fprintf(stderr, "Error: Memory allocation failed for the inode table, every directory is read on its own\n");
+
+    for (int i = 0; i < numRoots; i++)
+    {
+        RootRun *run = &runs[order[i]];
+
+        //Every directory starts from zero, like a child process of its own
+        numProcesses = order[i] + 1;
+        numCorruptedFiles = 0;
+        numSnapshotEntries = 0;
+        memset(&runStats, 0, sizeof(runStats));
+
+        run->startTime = MonotonicSeconds();
+        int snapshotStatus = CreateSnapshot(run->path, outputDir, isolatedDir);
+
+        run->duration = MonotonicSeconds() - run->startTime;
+        run->entries = numSnapshotEntries;
+        run->corruptedFiles = numCorruptedFiles;
+        run->exitStatus = snapshotStatus == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        memcpy(&run->stats, &runStats, sizeof(runStats));
+
+        fprintf(stdout, "Directory %d done - %d corrupted files found in \"%s\"\n", numProcesses, numCorruptedFiles, run->name);
+    }
+
+    if (inodeTable)
+    {
+        CloseInodeTable(inodeTable);
+        inodeTable = NULL;
+    }
+}
+
+
+int CompareRootDepths(const void *first, const void *second, void *context)
+{
+    const int *depths = context;
+    int firstIndex = *(const int *)first, secondIndex = *(const int *)second;
+
+    //Ties keep the argument order
+    if (depths[firstIndex] != depths[secondIndex])
+        return depths[firstIndex] < depths[secondIndex] ? -1 : 1;
+
+    return firstIndex - secondIndex;
+}
+
+
+int CreateSnapshot(char *path, char *outputDir, char *isolatedDir) 
+{
+    char *dirName = basename((char *)path);  //From libgen library, gets the name of the input directory
+    monitoredDirName = dirName; //Storing the name in a global variable
+
+    double wallMark = MonotonicSeconds(), cpuMark = CpuSeconds(); //Start of the current phase, moved on by RecordPhase
+
+    //Checks if the directory given as argument for monitoring exist. If the path is incorrect the error message will be printed to stderr and it will be skipped.
+    DIR *dirCheck = opendir(path);
+    if (!dirCheck) 
+    {
+        fprintf(stderr, "Error: Directory \"%s\" does not exist.\n", dirName);
+        return -1;
+    }
+    closedir(dirCheck);
+
+    //Checking if the output directory given as argument exists. If it does not exists, then the directory will be created.
+    dirCheck=opendir(outputDir);
+    if (!dirCheck) 
+    {
+        mkdir(outputDir, 0777);
+    }
+    closedir(dirCheck);
+
+    //Checking if the isolated directory given as argument exists. If it does not exists, then the directory will be created.
+    dirCheck=opendir(isolatedDir);
+    if (!dirCheck) 
+    {
+        mkdir(isolatedDir, 0777);
+    }
+    closedir(dirCheck);
+
+    char snapshotFilePath[PATH_MAX];  //Buffer for storing the name of the snapshot file
+    int snapshotFd = OpenSnapshotFile(outputDir, dirName, snapshotFilePath, sizeof(snapshotFilePath));
+    
+    if (snapshotFd == -1) 
+    {
+        fprintf(stderr, "Error: Failed to open snapshot file \"%s\"\n", snapshotFilePath);
+        return -1;
+    }
+
+    SnapshotWriter *writer = OpenSnapshotWriter(snapshotFd, snapshotFormat, hashAlgorithm);
+
+    if (!writer) 
+    {
+        fprintf(stderr, "Error: Memory allocation failed for snapshot file \"%s\"\n", snapshotFilePath);
+        close(snapshotFd);
+        return -1;
+    }
+
+    //Output is formatted and written on its own thread while the traversal keeps stat'ing
+    if (StartSnapshotWriterThread(writer) == -1)
+        fprintf(stderr, "Error: Failed to start the snapshot writer for \"%s\", writing synchronously\n", dirName);
+
+    //In single-process mode (-U) a directory already in a complete snapshot of this run is copied from there.
+    //Nothing is read, hashed or analyzed for it, so its caches are left as they are.
+    const InodeRecord *sharedRoot = inodeTable ? BeginSharedRoot(path, snapshotFilePath) : NULL;
+
+    //Digests of files unchanged since the last run are taken from the cache instead of reading the files again
+    if (hashAlgorithm != HASH_NONE && !sharedRoot && !(hashCache = OpenHashCache(outputDir, dirName)))
+        fprintf(stderr, "Error: Failed to open the hash cache for \"%s\", hashing every file\n", dirName);
+
+    //Files found safe by an earlier run with the same rules are not analyzed again
+    if (!sharedRoot && !(verdictCache = OpenVerdictCache(outputDir, dirName)))
+        fprintf(stderr, "Error: Failed to open the verdict cache for \"%s\", analyzing every file\n", dirName);
+
+    //Suspicious files are analyzed next to the traversal, their verdicts are applied as they come back
+    if (numAnalysisWorkers > 0 && !sharedRoot && !(analysisPool = OpenAnalysisPool(numAnalysisWorkers)))
+        fprintf(stderr, "Error: Failed to start the analysis workers for \"%s\", analyzing inline\n", dirName);
+
+    //The fast rescan looks up every directory in the previous snapshot, which needs a binary one with directory summaries
+    if (fastRescan && !sharedRoot && !(previousSnapshot = OpenPreviousSnapshot(outputDir, dirName, strrchr(snapshotFilePath, '/') + 1)))
+        fprintf(stdout, "No binary snapshot with directory summaries to rescan \"%s\" from, reading every directory\n", dirName);
+
+    RecordPhase(PHASE_SETUP, &wallMark, &cpuMark);
+
+    //Large trees are read by a pool of directory workers, the resulting snapshot is identical to the serial walk.
+    //The fast rescan reads few directories, it stays on the serial walk.
+    //A directory copied from the snapshot of an earlier root (-U) is only walked if nothing could be copied.
+    int copyStatus = sharedRoot ? CopySharedSubtree(sharedRoot, path, writer) : -1;
+
+    if (copyStatus == -1) 
+    {
+        if (numTraversalThreads > 1 && !previousSnapshot)
+            ExploreDirectoriesParallel(path, writer, isolatedDir);
+        else
+            ExploreDirectories(path, writer, isolatedDir);
+    }
+
+    AddStat(&runStats.arenaBytes, walkArena.peakBytes);
+    FreeArena(&walkArena);
+
+    if (previousSnapshot) 
+    {
+        CloseSnapshotReader(previousSnapshot);
+        free(previousSnapshot);
+        previousSnapshot = NULL;
+    }
+
+    //A snapshot copied only in part would show the rest of the directory as removed, it is dropped and the history left as it is
+    if (copyStatus == -2)
+    {
+        CloseSnapshotWriter(writer);
+        close(snapshotFd);
+        unlink(snapshotFilePath);
+        fprintf(stderr, "Error: Snapshot of \"%s\" not kept, the previous snapshots are left unchanged\n", dirName);
+        return -1;
+    }
+
+    RecordPhase(PHASE_TRAVERSAL, &wallMark, &cpuMark);
+
+    //Waiting for the files still being analyzed, the timeout (-t) bounds how long a single file can take
+    if (analysisPool) 
+    {
+        CloseAnalysisPool(analysisPool, isolatedDir);
+        analysisPool = NULL;
+    }
+
+    //The last quarantine batch is made durable, originals copied to another file system are removed
+    FlushQuarantine();
+    RecordPhase(PHASE_ANALYSIS_WAIT, &wallMark, &cpuMark);
+
+    if (verdictCache) 
+    {
+        CloseVerdictCache(verdictCache);
+        verdictCache = NULL;
+    }
+
+    //Writing what is still buffered, plus the index and footer of a binary snapshot
+    int writeStatus = CloseSnapshotWriter(writer);
+
+    if (writeStatus == -1)
+        fprintf(stderr, "Error: Failed to write snapshot file \"%s\"\n", snapshotFilePath);
+    else if (inodeTable && inodeTable->currentRoot)
+        inodeTable->currentRoot->complete = 1; //Monitored directories below this one can be copied from it from now on
+
+    //The cache of this run replaces the previous one, files gone since then drop out of it
+    if (hashCache) 
+    {
+        fprintf(stdout, "Hashed %ld files in \"%s\", %ld digests reused from the cache.\n", atomic_load(&hashCache->numHashed), dirName, atomic_load(&hashCache->numReused));
+        CloseHashCache(hashCache);
+        hashCache = NULL;
+    }
+
+    close(snapshotFd);
+
+    //An incomplete snapshot, a binary one maybe without its footer, must not become the latest one: dropped like a partial copy
+    if (writeStatus == -1)
+    {
+        unlink(snapshotFilePath);
+        fprintf(stderr, "Error: Snapshot of \"%s\" not kept, the previous snapshots are left unchanged\n", dirName);
+        return -1;
+    }
+
+    RecordPhase(PHASE_OUTPUT, &wallMark, &cpuMark);
+
+    //Wall time of the walk up to the complete snapshot, with the CPU time of every thread next to it
+    double duration = runStats.phaseWall[PHASE_TRAVERSAL] + runStats.phaseWall[PHASE_ANALYSIS_WAIT] + runStats.phaseWall[PHASE_OUTPUT];
+    double cpuDuration = runStats.phaseCpu[PHASE_TRAVERSAL] + runStats.phaseCpu[PHASE_ANALYSIS_WAIT] + runStats.phaseCpu[PHASE_OUTPUT];
+
+    fprintf(stdout, "Snapshot created successfully for \"%s\" in %.2f seconds (%.2f CPU seconds).\n", dirName, duration, cpuDuration);
+
+    PreviousSnapshotCompare(outputDir, snapshotFilePath);
+    RecordPhase(PHASE_COMPARE, &wallMark, &cpuMark);
+    return 0;
+}
+
+
+int OpenSnapshotFile(const char *outputDir, const char *dirName, char *snapshotFilePath, size_t pathSize)
+{
+    time_t now = time(NULL);
+    struct tm *timestamp = localtime(&now);
+    char timestampStr[32];
+
+    strftime(timestampStr, sizeof(timestampStr), "%Y.%m.%d_%H:%M:%S", timestamp);
+
+    //Constructing the snapshot file name
+    snprintf(snapshotFilePath, pathSize, "%s/%s_Snapshot_%s.%s", outputDir, dirName, timestampStr, snapshotFormat == SNAPSHOT_FORMAT_BINARY ? "snap" : "txt");
+
+    int snapshotFd = open(snapshotFilePath, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+
+    //Runs within the same second get a numbered name, a snapshot kept in the history is never overwritten
+    for (int attempt = 2; snapshotFd == -1 && errno == EEXIST && attempt < 100; attempt++)
+    {
+        snprintf(snapshotFilePath, pathSize, "%s/%s_Snapshot_%s_%02d.%s", outputDir, dirName, timestampStr, attempt, snapshotFormat == SNAPSHOT_FORMAT_BINARY ? "snap" : "txt");
+        snapshotFd = open(snapshotFilePath, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    }
+
+    return snapshotFd;
+}
+
+
+int WatchDirectory(char *path, char *outputDir, char *isolatedDir)
+{
+    WatchState state;
+    memset(&state, 0, sizeof(state));
+    state.fd = -1;
+    state.root = path;
+    watchState = &state;
+
+    //The first snapshot is a full walk, the in-memory snapshot is filled from it
+    if (StartWatch(path, outputDir, isolatedDir) == -1)
+    {
+        StopWatch();
+        watchState = NULL;
+        return -1;
+    }
+
+    fprintf(stdout, "Watching \"%s\", the snapshot is refreshed every %.1f seconds when something changed\n", monitoredDirName, watchInterval);
+    fflush(stdout);
+
+    double nextRefresh = MonotonicSeconds() + watchInterval;
+    int status = 0;
+
+    while (!stopWatching)
+    {
+        struct pollfd pollFd = {state.fd, POLLIN, 0};
+        double wait = nextRefresh - MonotonicSeconds();
+        int ready = poll(&pollFd, 1, wait > 0 ? (int)(wait * 1000) + 1 : 0);
+
+        if (ready == -1 && errno != EINTR)
+        {
+            fprintf(stderr, "Error: Failed to wait for the changes in \"%s\"\n", monitoredDirName);
+            status = -1;
+            break;
+        }
+
+        if (ready > 0)
+            ReadWatchEvents();
+
+        //Once the kernel dropped events the in-memory snapshot cannot be trusted, the whole tree is read again
+        if (state.overflowed)
+        {
+            fprintf(stdout, "Event queue of \"%s\" overflowed => Rescanning the whole directory\n", monitoredDirName);
+            AddStat(&runStats.watchRescans, 1);
+            StopWatch();
+
+            if (StartWatch(path, outputDir, isolatedDir) == -1)
+            {
+                status = -1;
+                break;
+            }
+
+            nextRefresh = MonotonicSeconds() + watchInterval;
+            fflush(stdout);
+            continue;
+        }
+
+        //Changes are applied as soon as they are read, new files without access rights are analyzed right away
+        if (state.numChanges > 0)
+            ApplyWatchChanges(isolatedDir);
+
+        FlushQuarantine();
+
+        if (MonotonicSeconds() >= nextRefresh)
+        {
+            if (state.modified)
+                WriteWatchSnapshot(outputDir);
+
+            nextRefresh = MonotonicSeconds() + watchInterval;
+        }
+
+        fflush(stdout);
+    }
+
+    //The changes seen before the stop still make it into a last snapshot
+    if (status == 0)
+    {
+        ReadWatchEvents();
+
+        if (state.numChanges > 0)
+            ApplyWatchChanges(isolatedDir);
+
+        FlushQuarantine();
+
+        if (state.modified)
+            WriteWatchSnapshot(outputDir);
+    }
+
+    StopWatch();
+    watchState = NULL;
+    return status;
+}
+
+
+int StartWatch(char *path, char *outputDir, char *isolatedDir)
+{
+    watchState->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (watchState->fd == -1)
+    {
+        fprintf(stderr, "Error: Failed to start watching \"%s\"\n", basename(path));
+        return -1;
+    }
+
+    //Watches are in place before the walk, so nothing changed during it goes unseen
+    if (AddWatchTree(path) == -1)
+    {
+        fprintf(stderr, "Error: Failed to watch every directory of \"%s\", raise fs.inotify.max_user_watches\n", basename(path));
+        return -1;
+    }
+
+    numSnapshotEntries = 0;
+    watchState->modified = 0;
+    watchState->overflowed = 0;
+    return CreateSnapshot(path, outputDir, isolatedDir);
+}
+
+
+void StopWatch(void)
+{
+    if (watchState->fd != -1)
+        close(watchState->fd);
+
+    watchState->fd = -1;
+
+    for (int i = 0; i < watchState->watchCapacity; i++)
+        free(watchState->watchPaths[i]);
+
+    for (size_t i = 0; i < watchState->numEntries; i++)
+        free(watchState->entries[i].path);
+
+    for (size_t i = 0; i < watchState->numChanges; i++)
+        free(watchState->changes[i].path);
+
+    free(watchState->watchPaths);
+    free(watchState->entries);
+    free(watchState->changes);
+    free(watchState->updates);
+
+    watchState->watchPaths = NULL;
+    watchState->watchCapacity = 0;
+    watchState->entries = NULL;
+    watchState->numEntries = watchState->capacity = 0;
+    watchState->changes = NULL;
+    watchState->numChanges = watchState->changeCapacity = 0;
+    watchState->updates = NULL;
+    watchState->numUpdates = watchState->updateCapacity = 0;
+}
+
+
+int AddWatch(const char *path)
+{
+    int wd = inotify_add_watch(watchState->fd, path, WATCH_EVENT_MASK);
+
+    //Directories removed or closed to us in the meantime are left out, only running out of watches is an error
+    if (wd == -1)
+        return errno == ENOSPC || errno == ENOMEM ? -1 : 0;
+
+    if (wd >= watchState->watchCapacity)
+    {
+        int newCapacity = watchState->watchCapacity ? watchState->watchCapacity : 256;
+
+        while (newCapacity <= wd)
+            newCapacity *= 2;
+
+        char **newPaths = realloc(watchState->watchPaths, newCapacity * sizeof(char *));
+
+        if (!newPaths)
+            return -1;
+
+        memset(newPaths + watchState->watchCapacity, 0, (newCapacity - watchState->watchCapacity) * sizeof(char *));
+        watchState->watchPaths = newPaths;
+        watchState->watchCapacity = newCapacity;
+    }
+
+    //The same directory watched twice gets the same descriptor back
+    free(watchState->watchPaths[wd]);
+    watchState->watchPaths[wd] = strdup(path);
+    return watchState->watchPaths[wd] ? 0 : -1;
+}
+
+
+int AddWatchTree(const char *path)
+{
+    if (AddWatch(path) == -1)
+        return -1;
+
+    DIR *dir = opendir(path);
+
+    if (!dir)
+        return 0;
+
+    struct dirent *dirEntry;
+    char *childPath = NULL;
+    int status = 0;
+
+    //Only the subdirectories are visited, the files are read by the snapshot walk
+    while (status == 0 && (dirEntry = readdir(dir)) != NULL)
+    {
+        if (strcmp(dirEntry->d_name, ".") == 0 || strcmp(dirEntry->d_name, "..") == 0)
+            continue;
+
+        if (dirEntry->d_type != DT_DIR && dirEntry->d_type != DT_UNKNOWN)
+            continue;
+
+        char *newChildPath = realloc(childPath, strlen(path) + strlen(dirEntry->d_name) + 2);
+
+        if (!newChildPath)
+        {
+            status = -1;
+            break;
+        }
+
+        childPath = newChildPath;
+        sprintf(childPath, "%s/%s", path, dirEntry->d_name);
+
+        struct stat st;
+
+        if (dirEntry->d_type == DT_UNKNOWN && (lstat(childPath, &st) == -1 || !S_ISDIR(st.st_mode)))
+            continue;
+
+        status = AddWatchTree(childPath);
+    }
+
+    closedir(dir);
+    free(childPath);
+    return status;
+}
+
+
+void RemoveWatchTree(const char *path)
+{
+    size_t pathLength = strlen(path);
+
+    //The watches follow the directories, one moved out of the tree would keep reporting under its old path
+    for (int wd = 0; wd < watchState->watchCapacity; wd++)
+    {
+        const char *watchPath = watchState->watchPaths[wd];
+
+        if (watchPath && strncmp(watchPath, path, pathLength) == 0 && (watchPath[pathLength] == '\0' || watchPath[pathLength] == '/'))
+        {
+            inotify_rm_watch(watchState->fd, wd);
+            free(watchState->watchPaths[wd]);
+            watchState->watchPaths[wd] = NULL;
+        }
+    }
+}
+
+
+void ReadWatchEvents(void)
+{
+    //Events are read in large batches, aligned for the structures inside
+    char buffer[WATCH_EVENT_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1)
+    {
+        ssize_t length = read(watchState->fd, buffer, sizeof(buffer));
+
+        if (length <= 0)
+            break;
+
+        for (char *position = buffer; position < buffer + length; )
+        {
+            const struct inotify_event *event = (const struct inotify_event *)position;
+            position += sizeof(struct inotify_event) + event->len;
+            AddStat(&runStats.watchEvents, 1);
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                watchState->overflowed = 1;
+                continue;
+            }
+
+            if (event->wd < 0 || event->wd >= watchState->watchCapacity || !watchState->watchPaths[event->wd])
+                continue;
+
+            //The kernel dropped the watch, its directory is gone
+            if (event->mask & IN_IGNORED)
+            {
+                free(watchState->watchPaths[event->wd]);
+                watchState->watchPaths[event->wd] = NULL;
+                continue;
+            }
+
+            const char *dirPath = watchState->watchPaths[event->wd];
+
+            //A directory created, removed or moved brings or takes its whole subtree
+            if (event->len > 0)
+            {
+                char entryPath[PATH_MAX];
+                int tree = (event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO));
+
+                if (snprintf(entryPath, sizeof(entryPath), "%s/%s", dirPath, event->name) < (int)sizeof(entryPath))
+                    AddWatchChange(entryPath, tree ? WATCH_CHANGE_TREE : WATCH_CHANGE_ENTRY);
+            }
+
+            //The directory itself changed too, its mtime or its own attributes. The monitored directory is not an entry.
+            if (strcmp(dirPath, watchState->root) != 0)
+                AddWatchChange(dirPath, WATCH_CHANGE_ENTRY);
+        }
+    }
+}
+
+
+void AddWatchChange(const char *path, int kind)
+{
+    if (watchState->numChanges == watchState->changeCapacity)
+    {
+        size_t newCapacity = watchState->changeCapacity ? watchState->changeCapacity * 2 : 256;
+        WatchChange *newChanges = realloc(watchState->changes, newCapacity * sizeof(WatchChange));
+
+        //Losing a change is losing an event, the same as an overflow
+        if (!newChanges)
+        {
+            watchState->overflowed = 1;
+            return;
+        }
+
+        watchState->changes = newChanges;
+        watchState->changeCapacity = newCapacity;
+    }
+
+    char *pathCopy = strdup(path);
+
+    if (!pathCopy)
+    {
+        watchState->overflowed = 1;
+        return;
+    }
+
+    watchState->changes[watchState->numChanges].path = pathCopy;
+    watchState->changes[watchState->numChanges].kind = kind;
+    watchState->numChanges++;
+}
+
+
+void ApplyWatchChanges(char *isolatedDir)
+{
+    WatchChange *changes = watchState->changes;
+    size_t numChanges = 0;
+
+    //One change per path, in snapshot order, a subtree change covers the entry change
+    qsort(changes, watchState->numChanges, sizeof(WatchChange), CompareWatchChanges);
+
+    for (size_t i = 0; i < watchState->numChanges; i++)
+    {
+        if (numChanges > 0 && strcmp(changes[numChanges - 1].path, changes[i].path) == 0)
+        {
+            if (changes[i].kind == WATCH_CHANGE_TREE)
+                changes[numChanges - 1].kind = WATCH_CHANGE_TREE;
+
+            free(changes[i].path);
+            continue;
+        }
+
+        changes[numChanges++] = changes[i];
+    }
+
+    //Watches of replaced subtrees go first, a directory moved within the tree gets its watches again under the new path
+    for (size_t i = 0; i < numChanges; i++)
+    {
+        if (changes[i].kind == WATCH_CHANGE_TREE)
+            RemoveWatchTree(changes[i].path);
+    }
+
+    watchState->numUpdates = 0;
+
+    for (size_t i = 0; i < numChanges; i++)
+    {
+        struct stat st;
+
+        if (lstat(changes[i].path, &st) == -1)
+            AddWatchUpdate(changes[i].path, NULL, 1, isolatedDir);
+        else if (changes[i].kind == WATCH_CHANGE_TREE && S_ISDIR(st.st_mode))
+        {
+            //A directory new to the tree is watched before it is read, its entries are handled like new files
+            if (AddWatch(changes[i].path) == -1)
+                watchState->overflowed = 1;
+
+            AddWatchUpdate(changes[i].path, &st, 1, isolatedDir);
+            ScanWatchedDirectory(changes[i].path, isolatedDir);
+        }
+        else
+            AddWatchUpdate(changes[i].path, &st, changes[i].kind == WATCH_CHANGE_TREE || !S_ISDIR(st.st_mode), isolatedDir);
+
+        free(changes[i].path);
+    }
+
+    watchState->numChanges = 0;
+    MergeWatchUpdates();
+}
+
+
+void ScanWatchedDirectory(const char *path, char *isolatedDir)
+{
+    struct dirent **dirEntries;
+    int numDirEntries = scandir(path, &dirEntries, NULL, CompareEntryNames);
+    char *entryPath = NULL;
+
+    AddStat(&runStats.dirReads, 1);
+
+    if (numDirEntries == -1)
+        return;
+
+    for (int i = 0; i < numDirEntries; i++)
+    {
+        struct dirent *dirEntry = dirEntries[i];
+        char *newEntryPath;
+        struct stat st;
+
+        if (strcmp(dirEntry->d_name, ".") != 0 && strcmp(dirEntry->d_name, "..") != 0 &&
+            (newEntryPath = realloc(entryPath, strlen(path) + strlen(dirEntry->d_name) + 2)) != NULL)
+        {
+            entryPath = newEntryPath;
+            sprintf(entryPath, "%s/%s", path, dirEntry->d_name);
+            AddStat(&runStats.statCalls, 1);
+
+            if (lstat(entryPath, &st) == 0)
+            {
+                if (S_ISDIR(st.st_mode) && AddWatch(entryPath) == -1)
+                    watchState->overflowed = 1;
+
+                AddWatchUpdate(entryPath, &st, 1, isolatedDir);
+
+                if (S_ISDIR(st.st_mode))
+                    ScanWatchedDirectory(entryPath, isolatedDir);
+            }
+        }
+
+        free(dirEntry);
+    }
+
+    free(dirEntries);
+    free(entryPath);
+}
+
+
+void AddWatchUpdate(const char *path, const struct stat *st, int dropSubtree, char *isolatedDir)
+{
+    if (watchState->numUpdates == watchState->updateCapacity)
+    {
+        size_t newCapacity = watchState->updateCapacity ? watchState->updateCapacity * 2 : 256;
+        WatchUpdate *newUpdates = realloc(watchState->updates, newCapacity * sizeof(WatchUpdate));
+
+        if (!newUpdates)
+        {
+            watchState->overflowed = 1;
+            return;
+        }
+
+        watchState->updates = newUpdates;
+        watchState->updateCapacity = newCapacity;
+    }
+
+    WatchUpdate *update = &watchState->updates[watchState->numUpdates];
+    memset(update, 0, sizeof(WatchUpdate));
+    update->entry.path = strdup(path);
+    update->removed = st == NULL;
+    update->dropSubtree = dropSubtree;
+    update->sequence = watchState->numUpdates;
+
+    if (!update->entry.path)
+    {
+        watchState->overflowed = 1;
+        return;
+    }
+
+    watchState->numUpdates++;
+
+    if (!st)
+        return;
+
+    const SnapshotEntry *previous = FindWatchEntry(path);
+    int changed = !previous || previous->mode != st->st_mode || previous->size != st->st_size || previous->mtime != StatNanoseconds(&st->st_mtim);
+
+    //The digest of a file whose size and mtime stayed the same is kept, a change of permissions does not read it again
+    unsigned char digest[HASH_MAX_DIGEST_SIZE];
+    int hasDigest;
+
+    if (!changed && previous->hashAlgorithm == hashAlgorithm && hashAlgorithm != HASH_NONE)
+    {
+        memcpy(digest, previous->digest, HashDigestLength(hashAlgorithm));
+        hasDigest = 1;
+    }
+    else
+        hasDigest = ComputeEntryDigest(AT_FDCWD, path, st, digest);
+
+    FillSnapshotEntry(&update->entry, update->entry.path, st, hasDigest ? digest : NULL);
+
+    //New files and files whose mode or content changed are analyzed now, the analysis itself only leaves attribute events behind
+    if (changed)
+        CheckPermissionsAndAnalyze(path, *st, isolatedDir, -1);
+}
+
+
+const SnapshotEntry *FindWatchEntry(const char *path)
+{
+    size_t low = 0, high = watchState->numEntries;
+
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        int order = ComparePaths(watchState->entries[middle].path, path);
+
+        if (order == 0)
+            return &watchState->entries[middle];
+
+        if (order < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return NULL;
+}
+
+
+void MergeWatchUpdates(void)
+{
+    WatchUpdate *updates = watchState->updates;
+    size_t numUpdates = 0;
+
+    //The last look at a path wins, it was taken after every event before it
+    qsort(updates, watchState->numUpdates, sizeof(WatchUpdate), CompareWatchUpdates);
+
+    for (size_t i = 0; i < watchState->numUpdates; i++)
+    {
+        if (numUpdates > 0 && strcmp(updates[numUpdates - 1].entry.path, updates[i].entry.path) == 0)
+        {
+            int dropSubtree = updates[numUpdates - 1].dropSubtree || updates[i].dropSubtree;
+            free(updates[numUpdates - 1].entry.path);
+            updates[numUpdates - 1] = updates[i];
+            updates[numUpdates - 1].dropSubtree = dropSubtree;
+            continue;
+        }
+
+        updates[numUpdates++] = updates[i];
+    }
+
+    watchState->numUpdates = 0;
+
+    if (numUpdates == 0)
+        return;
+
+    SnapshotEntry *entries = malloc((watchState->numEntries + numUpdates) * sizeof(SnapshotEntry));
+    char **removedPaths = malloc(numUpdates * sizeof(char *));
+
+    if (!entries || !removedPaths)
+    {
+        for (size_t i = 0; i < numUpdates; i++)
+            free(updates[i].entry.path);
+
+        free(entries);
+        free(removedPaths);
+        watchState->overflowed = 1;
+        return;
+    }
+
+    //One pass over both sorted lists, the entries below a replaced or removed path only survive if the update lists them again
+    size_t numEntries = 0, i = 0, j = 0;
+    const char *dropped = NULL;
+    size_t droppedLength = 0;
+    size_t numRemoved = 0;
+
+    while (i < watchState->numEntries || j < numUpdates)
+    {
+        int order = i == watchState->numEntries ? 1 : j == numUpdates ? -1 : ComparePaths(watchState->entries[i].path, updates[j].entry.path);
+
+        if (order < 0)
+        {
+            SnapshotEntry *entry = &watchState->entries[i++];
+
+            if (dropped && strncmp(entry->path, dropped, droppedLength) == 0 && entry->path[droppedLength] == '/')
+            {
+                free(entry->path);
+                watchState->modified = 1;
+                continue;
+            }
+
+            entries[numEntries++] = *entry;
+            continue;
+        }
+
+        WatchUpdate *update = &updates[j++];
+        SnapshotEntry *previous = order == 0 ? &watchState->entries[i++] : NULL;
+        char fields[512];
+
+        //Nested updates keep the outermost dropped path, its whole subtree is being replaced
+        if ((update->removed || update->dropSubtree) &&
+            !(dropped && strncmp(update->entry.path, dropped, droppedLength) == 0 && update->entry.path[droppedLength] == '/'))
+        {
+            dropped = update->entry.path;
+            droppedLength = strlen(dropped);
+        }
+
+        if (update->removed)
+        {
+            if (previous)
+                watchState->modified = 1;
+        }
+        else
+        {
+            if (!previous || DescribeEntryChanges(previous, &update->entry, fields, sizeof(fields)) || (previous->mode & S_IFMT) != (update->entry.mode & S_IFMT))
+                watchState->modified = 1;
+
+            entries[numEntries++] = update->entry;
+        }
+
+        if (previous)
+            free(previous->path);
+
+        //Removed paths still mark their subtree until the pass is over
+        if (update->removed)
+            removedPaths[numRemoved++] = update->entry.path;
+    }
+
+    for (size_t k = 0; k < numRemoved; k++)
+        free(removedPaths[k]);
+
+    free(removedPaths);
+    free(watchState->entries);
+    watchState->entries = entries;
+    watchState->numEntries = numEntries;
+    watchState->capacity = watchState->numEntries + numUpdates;
+}
+
+
+int CompareWatchChanges(const void *first, const void *second)
+{
+    return ComparePaths(((const WatchChange *)first)->path, ((const WatchChange *)second)->path);
+}
+
+
+int CompareWatchUpdates(const void *first, const void *second)
+{
+    const WatchUpdate *firstUpdate = first, *secondUpdate = second;
+    int order = ComparePaths(firstUpdate->entry.path, secondUpdate->entry.path);
+
+    if (order != 0)
+        return order;
+
+    return firstUpdate->sequence < secondUpdate->sequence ? -1 : firstUpdate->sequence > secondUpdate->sequence;
+}
+
+
+int RecordWatchEntry(const char *entryPath, const struct stat *st, const unsigned char *digest)
+{
+    SnapshotEntry entry;
+    FillSnapshotEntry(&entry, (char *)entryPath, st, digest);
+    return AppendWatchEntry(&entry);
+}
+
+
+int AppendWatchEntry(const SnapshotEntry *entry)
+{
+    if (watchState->numEntries == watchState->capacity)
+    {
+        size_t newCapacity = watchState->capacity ? watchState->capacity * 2 : 1024;
+        SnapshotEntry *newEntries = realloc(watchState->entries, newCapacity * sizeof(SnapshotEntry));
+
+        if (!newEntries)
+            return -1;
+
+        watchState->entries = newEntries;
+        watchState->capacity = newCapacity;
+    }
+
+    //The walk writes its entries in snapshot order, the array stays sorted
+    SnapshotEntry *copy = &watchState->entries[watchState->numEntries];
+    *copy = *entry;
+
+    if (!(copy->path = strdup(entry->path)))
+        return -1;
+
+    watchState->numEntries++;
+    return 0;
+}
+
+
+int WriteWatchSnapshot(const char *outputDir)
+{
+    char snapshotFilePath[PATH_MAX];
+    int snapshotFd = OpenSnapshotFile(outputDir, monitoredDirName, snapshotFilePath, sizeof(snapshotFilePath));
+
+    if (snapshotFd == -1)
+    {
+        fprintf(stderr, "Error: Failed to open snapshot file \"%s\"\n", snapshotFilePath);
+        return -1;
+    }
+
+    SnapshotWriter *writer = OpenSnapshotWriter(snapshotFd, snapshotFormat, hashAlgorithm);
+    int status = writer ? 0 : -1;
+
+    //The snapshot is written from memory, no directory is read again
+    for (size_t i = 0; writer && i < watchState->numEntries && status == 0; i++)
+        status = WriteSnapshotEntry(writer, &watchState->entries[i]);
+
+    if (writer && CloseSnapshotWriter(writer) == -1)
+        status = -1;
+
+    close(snapshotFd);
+
+    if (status == -1)
+    {
+        fprintf(stderr, "Error: Failed to write snapshot file \"%s\"\n", snapshotFilePath);
+        unlink(snapshotFilePath);
+        return -1;
+    }
+
+    numSnapshotEntries = watchState->numEntries;
+    watchState->modified = 0;
+    AddStat(&runStats.watchRefreshes, 1);
+
+    fprintf(stdout, "Snapshot refreshed for \"%s\", %lld entries.\n", monitoredDirName, numSnapshotEntries);
+    PreviousSnapshotCompare(outputDir, snapshotFilePath);
+    return 0;
+}
+
+
+void StopWatching(int signalNumber)
+{
+    (void)signalNumber;
+    stopWatching = 1;
+}
+
+
+int ParseGovernorSpec(const char *spec)
+{
+    char *copy = strdup(spec);
+
+    if (!copy)
+        return -1;
+
+    char *savePointer = NULL;
+    int status = 0;
+
+    //Comma separated key=value settings, every one of them optional
+    for (char *setting = strtok_r(copy, ",", &savePointer); setting && status == 0; setting = strtok_r(NULL, ",", &savePointer))
+    {
+        char *value = strchr(setting, '=');
+        char *end;
+
+        if (!value)
+        {
+            status = -1;
+            break;
+        }
+
+        *value++ = '\0';
+
+        if (strcmp(setting, "ops") == 0 || strcmp(setting, "bytes") == 0)
+        {
+            double rate = strtod(value, &end);
+
+            //Byte budgets take K, M and G suffixes, powers of 1024
+            if (*end == 'K' || *end == 'k')
+                rate *= 1024, end++;
+            else if (*end == 'M' || *end == 'm')
+                rate *= 1024 * 1024, end++;
+            else if (*end == 'G' || *end == 'g')
+                rate *= 1024.0 * 1024 * 1024, end++;
+
+            if (end == value || *end != '\0' || rate <= 0)
+                status = -1;
+            else if (strcmp(setting, "ops") == 0)
+                governor.opsRate = rate;
+            else
+                governor.bytesRate = rate;
+        }
+        else if (strcmp(setting, "latency") == 0)
+        {
+            governor.latencyTarget = strtod(value, &end) / 1000;
+            status = end == value || *end != '\0' || governor.latencyTarget <= 0 ? -1 : 0;
+        }
+        else if (strcmp(setting, "psi") == 0)
+        {
+            governor.psiThreshold = strtod(value, &end);
+            status = end == value || *end != '\0' || governor.psiThreshold <= 0 || governor.psiThreshold > 100 ? -1 : 0;
+        }
+        else if (strcmp(setting, "nice") == 0)
+        {
+            governor.niceValue = strtol(value, &end, 10);
+            governor.setNice = 1;
+            status = end == value || *end != '\0' || governor.niceValue < -20 || governor.niceValue > 19 ? -1 : 0;
+        }
+        else if (strcmp(setting, "ioprio") == 0)
+        {
+            //idle, or be with an optional level from 0 (highest) to 7
+            if (strcmp(value, "idle") == 0)
+                governor.ioprioClass = GOVERNOR_IOPRIO_IDLE;
+            else if (strncmp(value, "be", 2) == 0 && (value[2] == '\0' || (value[2] == ':' && value[3] >= '0' && value[3] <= '7' && value[4] == '\0')))
+            {
+                governor.ioprioClass = GOVERNOR_IOPRIO_BE;
+                governor.ioprioLevel = value[2] ? value[3] - '0' : 4;
+            }
+            else
+                status = -1;
+        }
+        else
+            status = -1;
+    }
+
+    free(copy);
+
+    if (status == 0)
+    {
+        governor.enabled = governor.opsRate > 0 || governor.bytesRate > 0 || governor.latencyTarget > 0 || governor.psiThreshold > 0;
+
+        //Parsed in the parent before any child process is forked, so they all inherit the same budget
+        if ((governor.opsRate > 0 || governor.bytesRate > 0) && !governor.budget && !(governor.budget = OpenGovernorBudget()))
+            status = -1;
+    }
+
+    return status;
+}
+
+
+GovernorBudget *OpenGovernorBudget(void)
+{
+    GovernorBudget *budget = mmap(NULL, sizeof(GovernorBudget), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (budget == MAP_FAILED)
+        return NULL;
+
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&budget->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+
+    budget->opsTokens = governor.opsRate * GOVERNOR_BURST_SECONDS;
+    budget->bytesTokens = governor.bytesRate * GOVERNOR_BURST_SECONDS;
+    budget->lastRefill = MonotonicSeconds();
+    return budget;
+}
+
+
+void ApplyGovernorPriorities(void)
+{
+    //Set once before the child processes start, every process and thread created later inherits them
+    if (governor.ioprioClass && syscall(SYS_ioprio_set, GOVERNOR_IOPRIO_WHO_PROCESS, 0, governor.ioprioClass << GOVERNOR_IOPRIO_SHIFT | governor.ioprioLevel) == -1)
+        fprintf(stderr, "Error: Failed to set the I/O priority\n");
+
+    if (governor.setNice && setpriority(PRIO_PROCESS, 0, governor.niceValue) == -1)
+        fprintf(stderr, "Error: Failed to set the nice value\n");
+}
+
+
+void GovernorCharge(long long ops, long long bytes)
+{
+    if (!governor.enabled)
+        return;
+
+    pthread_mutex_lock(&governor.lock);
+
+    double now = MonotonicSeconds();
+    double wait = 0;
+
+    if (now >= governor.nextAdjust)
+        AdjustGovernorBackoff(now);
+
+    //Under pressure every operation and every chunk read also pays the backoff pause
+    double pause = governor.pause * (ops + (double)bytes / GOVERNOR_BYTES_PER_OP);
+
+    pthread_mutex_unlock(&governor.lock);
+
+    GovernorBudget *budget = governor.budget;
+
+    //Token buckets with a short burst, going into debt makes the later callers wait their turn, in any process of the run
+    if (budget)
+    {
+        if (pthread_mutex_lock(&budget->lock) == EOWNERDEAD)
+            pthread_mutex_consistent(&budget->lock);
+
+        double elapsed = now - budget->lastRefill;
+
+        if (elapsed > 0)
+            budget->lastRefill = now;
+        else
+            elapsed = 0;
+
+        if (governor.opsRate > 0)
+        {
+            budget->opsTokens += elapsed * governor.opsRate;
+
+            if (budget->opsTokens > governor.opsRate * GOVERNOR_BURST_SECONDS)
+                budget->opsTokens = governor.opsRate * GOVERNOR_BURST_SECONDS;
+
+            budget->opsTokens -= ops;
+
+            if (budget->opsTokens < 0)
+                wait = -budget->opsTokens / governor.opsRate;
+        }
+
+        if (governor.bytesRate > 0)
+        {
+            budget->bytesTokens += elapsed * governor.bytesRate;
+
+            if (budget->bytesTokens > governor.bytesRate * GOVERNOR_BURST_SECONDS)
+                budget->bytesTokens = governor.bytesRate * GOVERNOR_BURST_SECONDS;
+
+            budget->bytesTokens -= bytes;
+
+            if (budget->bytesTokens < 0 && -budget->bytesTokens / governor.bytesRate > wait)
+                wait = -budget->bytesTokens / governor.bytesRate;
+        }
+
+        pthread_mutex_unlock(&budget->lock);
+    }
+
+    wait += pause;
+
+    if (wait > 0)
+    {
+        struct timespec delay = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+        nanosleep(&delay, NULL);
+        AddStat(&runStats.governorWaitMicros, (long long)(wait * 1e6));
+    }
+}
+
+
+void GovernorObserve(int operation, double latency, long long bytes)
+{
+    if (!governor.enabled || governor.latencyTarget == 0)
+        return;
+
+    //A large read takes longer than a stat on an idle disk too, its latency is counted per GOVERNOR_BYTES_PER_OP bytes
+    if (bytes > GOVERNOR_BYTES_PER_OP)
+        latency *= (double)GOVERNOR_BYTES_PER_OP / bytes;
+
+    //A moving average per kind of operation, single slow calls and a mix of stats and reads do not trigger the backoff on their own
+    pthread_mutex_lock(&governor.lock);
+    governor.latencyAverage[operation] += (latency - governor.latencyAverage[operation]) * GOVERNOR_LATENCY_WEIGHT;
+    pthread_mutex_unlock(&governor.lock);
+}
+
+
+void AdjustGovernorBackoff(double now)
+{
+    governor.nextAdjust = now + GOVERNOR_ADJUST_INTERVAL;
+
+    if (governor.psiThreshold > 0 && now >= governor.nextPsiRead)
+    {
+        governor.psiSome = ReadIoPressure();
+        governor.nextPsiRead = now + GOVERNOR_PSI_INTERVAL;
+    }
+
+    int pressure = governor.psiThreshold > 0 && governor.psiSome > governor.psiThreshold;
+
+    for (int i = 0; i < GOVERNOR_NUM_OPS; i++)
+        pressure |= governor.latencyTarget > 0 && governor.latencyAverage[i] > governor.latencyTarget;
+
+    //The pause doubles while the disk is under pressure and halves away once it is not
+    if (pressure)
+    {
+        governor.pause = governor.pause > 0 ? governor.pause * 2 : GOVERNOR_MIN_PAUSE;
+
+        if (governor.pause > GOVERNOR_MAX_PAUSE)
+            governor.pause = GOVERNOR_MAX_PAUSE;
+
+        AddStat(&runStats.governorBackoffs, 1);
+    }
+    else if ((governor.pause /= 2) < GOVERNOR_MIN_PAUSE)
+        governor.pause = 0;
+}
+
+
+double ReadIoPressure(void)
+{
+    //"some avg10=..." is the share of the last 10 seconds in which some task waited for I/O
+    FILE *pressure = fopen("/proc/pressure/io", "re");
+    double some = 0;
+
+    if (!pressure)
+        return 0;
+
+    if (fscanf(pressure, "some avg10=%lf", &some) != 1)
+        some = 0;
+
+    fclose(pressure);
+    return some;
+}
+
+
+int GenerateTree(int argc, char *argv[])
+{
+    const char *root = NULL;
+    long long numFiles = 10000;
+    int fanOut = 10;
+    int depth = 3;
+    long long maxSize = 64 * 1024;
+    double suspiciousRatio = 0.01;
+    double maliciousRatio = 0.5;
+    uint64_t seed = 1;
+
+    //gentree <dir> [-n files] [-w fan out] [-d depth] [-z max file size] [-q suspicious ratio] [-m malicious ratio] [-S seed]
+    for (int i = 0; i < argc; i++)
+    {
+        if (i + 1 < argc && strcmp(argv[i], "-n") == 0)
+            numFiles = atoll(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-w") == 0)
+            fanOut = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-d") == 0)
+            depth = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-z") == 0)
+            maxSize = atoll(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-q") == 0)
+            suspiciousRatio = strtod(argv[++i], NULL);
+        else if (i + 1 < argc && strcmp(argv[i], "-m") == 0)
+            maliciousRatio = strtod(argv[++i], NULL);
+        else if (i + 1 < argc && strcmp(argv[i], "-S") == 0)
+            seed = strtoull(argv[++i], NULL, 10);
+        else if (argv[i][0] != '-' && !root)
+            root = argv[i];
+        else
+        {
+            fprintf(stderr, "Error: Invalid gentree argument \"%s\"\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!root || numFiles < 0 || fanOut < 1 || depth < 0 || maxSize < 0 || maxSize > GENTREE_MAX_FILE_SIZE ||
+        suspiciousRatio < 0 || suspiciousRatio > 1 || maliciousRatio < 0 || maliciousRatio > 1)
+    {
+        fprintf(stderr, "Error: Usage: gentree <dir> [-n files] [-w fan out] [-d depth] [-z max file size] [-q suspicious ratio] [-m malicious ratio] [-S seed]\n");
+        return EXIT_FAILURE;
+    }
+
+    //Every level of the tree has fanOut subdirectories per directory, the files are dealt over all of them
+    long long numDirs = 1;
+
+    for (long long levelDirs = 1, level = 0; level < depth; level++)
+    {
+        levelDirs *= fanOut;
+        numDirs += levelDirs;
+
+        if (numDirs > 10000000)
+        {
+            fprintf(stderr, "Error: Tree of fan out %d and depth %d has too many directories\n", fanOut, depth);
+            return EXIT_FAILURE;
+        }
+    }
+
+    char **dirs = malloc(numDirs * sizeof(char *));
+    char *content = malloc(maxSize + GENTREE_LINE_LENGTH);
+
+    if (!dirs || !content)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for tree \"%s\"\n", root);
+        free(dirs);
+        free(content);
+        return EXIT_FAILURE;
+    }
+
+    //Short lines of digits: plain ASCII without any keyword, so only the files made malicious on purpose are flagged
+    for (long long i = 0; i < maxSize + GENTREE_LINE_LENGTH; i++)
+        content[i] = i % GENTREE_LINE_LENGTH == GENTREE_LINE_LENGTH - 1 ? '\n' : '0' + i % 10;
+
+    //Directories in breadth first order, each level built from the one above
+    long long numCreated = 0;
+    long long levelEnd = 1; //End of the level the current parent belongs to
+    long long childLevelEnd = 1;
+    int level = 0;
+    int status = EXIT_SUCCESS;
+
+    mkdir(root, 0755);
+    dirs[numCreated++] = strdup(root);
+
+    for (long long parent = 0; parent < numCreated && status == EXIT_SUCCESS; parent++)
+    {
+        if (parent == levelEnd)
+        {
+            levelEnd = childLevelEnd;
+            level++;
+        }
+
+        //Directories of the last level get no children
+        if (level >= depth)
+            break;
+
+        for (int child = 0; child < fanOut; child++)
+        {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/d%03d", dirs[parent], child);
+
+            if ((mkdir(path, 0755) == -1 && errno != EEXIST) || !(dirs[numCreated] = strdup(path)))
+            {
+                fprintf(stderr, "Error: Failed to create directory \"%s\"\n", path);
+                status = EXIT_FAILURE;
+                break;
+            }
+
+            numCreated++;
+        }
+
+        childLevelEnd = numCreated;
+    }
+
+    uint64_t random = seed;
+    long long totalBytes = 0, numSuspicious = 0, numMalicious = 0;
+    int maxBits = 1;
+
+    while (maxBits < 62 && (1LL << maxBits) <= maxSize)
+        maxBits++;
+
+    //The same seed and parameters always produce the same names, sizes, contents and permissions
+    for (long long i = 0; i < numFiles && status == EXIT_SUCCESS; i++)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/f%08lld", dirs[i % numCreated], i);
+
+        //Sizes spread evenly over the powers of two up to the maximum: many small files and a few large ones.
+        //Drawn one after the other, the order of two calls within one expression is unspecified and the tree would depend on the compiler.
+        uint64_t sizeBits = NextRandom(&random) % maxBits;
+        uint64_t sizeDraw = NextRandom(&random);
+        long long size = (long long)(sizeDraw % (1ULL << sizeBits));
+
+        if (size > maxSize)
+            size = maxSize;
+
+        int suspicious = (NextRandom(&random) >> 11) * 0x1.0p-53 < suspiciousRatio;
+        int malicious = suspicious && (NextRandom(&random) >> 11) * 0x1.0p-53 < maliciousRatio;
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        if (fd == -1)
+        {
+            fprintf(stderr, "Error: Failed to create file \"%s\"\n", path);
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        //Malicious files carry one of the default keywords of the scanner
+        if ((malicious && WriteAll(fd, "malware\n", 8) == -1) || WriteAll(fd, content + i % GENTREE_LINE_LENGTH, size) == -1)
+        {
+            fprintf(stderr, "Error: Failed to write file \"%s\"\n", path);
+            status = EXIT_FAILURE;
+        }
+
+        //Suspicious files have no access rights at all, like the ones the monitor analyzes
+        if (suspicious)
+        {
+            fchmod(fd, 0);
+            numSuspicious++;
+            numMalicious += malicious;
+        }
+
+        totalBytes += size + (malicious ? 8 : 0);
+        close(fd);
+    }
+
+    if (status == EXIT_SUCCESS)
+        fprintf(stdout, "Generated %lld files (%lld suspicious, %lld malicious) in %lld directories, %lld bytes, under \"%s\"\n", numFiles, numSuspicious, numMalicious, numCreated, totalBytes, root);
+
+    for (long long i = 0; i < numCreated; i++)
+        free(dirs[i]);
+
+    free(dirs);
+    free(content);
+    return status;
+}
+
+
+uint64_t NextRandom(uint64_t *state)
+{
+    //splitmix64, small and reproducible on every platform
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+int RunBenchmark(int argc, char *argv[])
+{
+    const char *tree = NULL;
+    const char *workDir = "bench_work";
+    const char *resultsFile = NULL;
+    int numRuns = 3;
+    int cold = 0;
+    int json = 0;
+
+    //bench <tree> [-o work dir] [-n runs] [-c] [-J] [-R results file] [-j threads] [-f text|binary]
+    for (int i = 0; i < argc; i++)
+    {
+        if (i + 1 < argc && strcmp(argv[i], "-o") == 0)
+            workDir = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-n") == 0)
+            numRuns = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-R") == 0)
+            resultsFile = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-j") == 0)
+            numTraversalThreads = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-f") == 0)
+            snapshotFormat = strcmp(argv[++i], "binary") == 0 ? SNAPSHOT_FORMAT_BINARY : SNAPSHOT_FORMAT_TEXT;
+        else if (strcmp(argv[i], "-c") == 0)
+            cold = 1;
+        else if (strcmp(argv[i], "-J") == 0)
+            json = 1;
+        else if (argv[i][0] != '-' && !tree)
+            tree = argv[i];
+        else
+        {
+            fprintf(stderr, "Error: Invalid bench argument \"%s\"\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!tree || numRuns < 1 || numTraversalThreads < 1)
+    {
+        fprintf(stderr, "Error: Usage: bench <tree> [-o work dir] [-n runs] [-c] [-J] [-R results file] [-j threads] [-f text|binary]\n");
+        return EXIT_FAILURE;
+    }
+
+    char treeCopy[PATH_MAX];
+    snprintf(treeCopy, sizeof(treeCopy), "%s", tree);
+    monitoredDirName = basename(treeCopy);
+
+    if (mkdir(workDir, 0755) == -1 && errno != EEXIST)
+    {
+        fprintf(stderr, "Error: Failed to create the work directory \"%s\"\n", workDir);
+        return EXIT_FAILURE;
+    }
+
+    //The cold runs need to drop the page cache, which only root may do
+    if (cold && DropPageCache() == -1)
+    {
+        fprintf(stderr, "Error: Failed to drop the page cache, only warm runs are measured\n");
+        cold = 0;
+    }
+
+    if (LoadScanRules(&scanRules, NULL) == -1)
+        return EXIT_FAILURE;
+
+    //The files to analyze are found once, the analysis phase then only reads them
+    char **suspiciousFiles = NULL;
+    size_t numSuspicious = 0, suspiciousCapacity = 0;
+    CollectSuspiciousFiles(tree, &suspiciousFiles, &numSuspicious, &suspiciousCapacity);
+
+    //A first snapshot gives the diff of the first run something to compare against, the entries are not analyzed while timing the walk
+    char snapshotFile[PATH_MAX];
+    snprintf(snapshotFile, sizeof(snapshotFile), "%s/previous.%s", workDir, snapshotFormat == SNAPSHOT_FORMAT_BINARY ? "snap" : "txt");
+    analyzeEntries = 0;
+
+    if (WriteBenchmarkSnapshot(tree, snapshotFile) == -1)
+    {
+        fprintf(stderr, "Error: Failed to write snapshot file \"%s\"\n", snapshotFile);
+        return EXIT_FAILURE;
+    }
+
+    //Five phases per run, measured warm and optionally cold
+    BenchResult *results = calloc(numRuns * 2 * 5, sizeof(BenchResult));
+    int numResults = 0;
+    int status = results ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    for (int run = 0; run < numRuns && status == EXIT_SUCCESS; run++)
+    {
+        if (RunBenchmarkPhases(tree, workDir, run, 0, suspiciousFiles, numSuspicious, results, &numResults) == -1 ||
+            (cold && RunBenchmarkPhases(tree, workDir, run, 1, suspiciousFiles, numSuspicious, results, &numResults) == -1))
+        {
+            fprintf(stderr, "Error: Benchmark run %d on \"%s\" failed\n", run, tree);
+            status = EXIT_FAILURE;
+        }
+    }
+
+    FILE *output = resultsFile ? fopen(resultsFile, "w") : stdout;
+
+    if (!output)
+    {
+        fprintf(stderr, "Error: Failed to open the results file \"%s\"\n", resultsFile);
+        status = EXIT_FAILURE;
+    }
+    else if (results)
+    {
+        PrintBenchResults(output, results, numResults, json);
+
+        if (output != stdout)
+            fclose(output);
+    }
+
+    for (size_t i = 0; i < numSuspicious; i++)
+        free(suspiciousFiles[i]);
+
+    free(suspiciousFiles);
+    free(results);
+    return status;
+}
+
+
+int RunBenchmarkPhases(const char *tree, const char *workDir, int run, int cold, char **suspiciousFiles, size_t numSuspicious, BenchResult *results, int *numResults)
+{
+    const char *cache = cold ? "cold" : "warm";
+    const char *extension = snapshotFormat == SNAPSHOT_FORMAT_BINARY ? "snap" : "txt";
+    char previousFile[PATH_MAX], currentFile[PATH_MAX], quarantineDir[PATH_MAX];
+    snprintf(previousFile, sizeof(previousFile), "%s/previous.%s", workDir, extension);
+    snprintf(currentFile, sizeof(currentFile), "%s/current.%s", workDir, extension);
+    snprintf(quarantineDir, sizeof(quarantineDir), "%s/quarantine", workDir);
+
+    //Traversal: walking and stat'ing the tree, the entries are formatted but the output is discarded
+    BenchResult *traversal = &results[(*numResults)++];
+    *traversal = (BenchResult){"traversal", cache, run, 0, 0, 0, 0};
+
+    if (cold)
+        DropPageCache();
+
+    SnapshotWriter *writer = OpenSnapshotWriter(-1, snapshotFormat, HASH_NONE);
+
+    if (!writer)
+        return -1;
+
+    long long startEntries = numSnapshotEntries;
+    double startWall = MonotonicSeconds(), startCpu = CpuSeconds();
+
+    if (numTraversalThreads > 1)
+        ExploreDirectoriesParallel(tree, writer, NULL);
+    else
+        ExploreDirectories(tree, writer, NULL);
+
+    CloseSnapshotWriter(writer);
+    traversal->wallSeconds = MonotonicSeconds() - startWall;
+    traversal->cpuSeconds = CpuSeconds() - startCpu;
+    traversal->items = numSnapshotEntries - startEntries;
+
+    //Snapshot: the same walk with the writer thread and the file written like a monitoring run
+    BenchResult *snapshot = &results[(*numResults)++];
+    *snapshot = (BenchResult){"snapshot", cache, run, 0, 0, 0, 0};
+
+    if (cold)
+        DropPageCache();
+
+    startWall = MonotonicSeconds();
+    startCpu = CpuSeconds();
+    snapshot->items = WriteBenchmarkSnapshot(tree, currentFile);
+    snapshot->wallSeconds = MonotonicSeconds() - startWall;
+    snapshot->cpuSeconds = CpuSeconds() - startCpu;
+
+    struct stat st, previousSt;
+
+    if (snapshot->items == -1 || stat(currentFile, &st) == -1 || stat(previousFile, &previousSt) == -1)
+        return -1;
+
+    snapshot->bytes = st.st_size;
+
+    //Diff: merging the previous and the current snapshot, the change list is discarded
+    BenchResult *diff = &results[(*numResults)++];
+    *diff = (BenchResult){"diff", cache, run, snapshot->items, st.st_size + previousSt.st_size, 0, 0};
+
+    if (cold)
+        DropPageCache();
+
+    startWall = MonotonicSeconds();
+    startCpu = CpuSeconds();
+    long long numChanges = CompareSnapshots(previousFile, currentFile, -1, NULL);
+    diff->wallSeconds = MonotonicSeconds() - startWall;
+    diff->cpuSeconds = CpuSeconds() - startCpu;
+
+    if (numChanges == -1 || rename(currentFile, previousFile) == -1)
+        return -1;
+
+    //Analysis: scanning every file without access rights, the verdicts are kept for the quarantine phase
+    BenchResult *analysis = &results[(*numResults)++];
+    *analysis = (BenchResult){"analysis", cache, run, 0, 0, 0, 0};
+    char *verdicts = calloc(numSuspicious + 1, 1);
+
+    if (!verdicts)
+        return -1;
+
+    if (cold)
+        DropPageCache();
+
+    startWall = MonotonicSeconds();
+    startCpu = CpuSeconds();
+
+    for (size_t i = 0; i < numSuspicious; i++)
+    {
+        if (lstat(suspiciousFiles[i], &st) == -1)
+            continue;
+
+        verdicts[i] = ScanFile(suspiciousFiles[i], &st, &scanRules, 0) == 1;
+        analysis->bytes += st.st_size;
+        analysis->items++;
+    }
+
+    analysis->wallSeconds = MonotonicSeconds() - startWall;
+    analysis->cpuSeconds = CpuSeconds() - startCpu;
+
+    //Quarantine: the malicious files go through the same path as in a snapshot, they are moved back afterwards so the tree stays the same for the next run
+    BenchResult *quarantinePhase = &results[(*numResults)++];
+    *quarantinePhase = (BenchResult){"quarantine", cache, run, 0, 0, 0, 0};
+    char (*quarantinedNames)[NAME_MAX + 1] = calloc(numSuspicious + 1, sizeof(*quarantinedNames));
+
+    if (!quarantinedNames || (mkdir(quarantineDir, 0755) == -1 && errno != EEXIST))
+    {
+        free(quarantinedNames);
+        free(verdicts);
+        return -1;
+    }
+
+    startWall = MonotonicSeconds();
+    startCpu = CpuSeconds();
+
+    for (size_t i = 0; i < numSuspicious; i++)
+    {
+        if (verdicts[i] && QuarantineFile(suspiciousFiles[i], quarantineDir, quarantinedNames[i], sizeof(quarantinedNames[i])) == 0)
+            quarantinePhase->items++;
+        else
+            verdicts[i] = 0;
+    }
+
+    //The batch is made durable as at the end of a snapshot, which is part of the cost
+    FlushQuarantine();
+    quarantinePhase->wallSeconds = MonotonicSeconds() - startWall;
+    quarantinePhase->cpuSeconds = CpuSeconds() - startCpu;
+
+    for (size_t i = 0; i < numSuspicious; i++)
+    {
+        if (verdicts[i] && renameat(quarantine.dirFd, quarantinedNames[i], AT_FDCWD, suspiciousFiles[i]) == -1)
+            fprintf(stderr, "Error: Failed to move \"%s\" back from the quarantine\n", suspiciousFiles[i]);
+    }
+
+    free(quarantinedNames);
+    free(verdicts);
+    return 0;
+}
+
+
+long long WriteBenchmarkSnapshot(const char *tree, const char *snapshotFile)
+{
+    int snapshotFd = open(snapshotFile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+    if (snapshotFd == -1)
+        return -1;
+
+    SnapshotWriter *writer = OpenSnapshotWriter(snapshotFd, snapshotFormat, HASH_NONE);
+
+    if (!writer)
+    {
+        close(snapshotFd);
+        return -1;
+    }
+
+    StartSnapshotWriterThread(writer);
+    long long startEntries = numSnapshotEntries;
+
+    if (numTraversalThreads > 1)
+        ExploreDirectoriesParallel(tree, writer, NULL);
+    else
+        ExploreDirectories(tree, writer, NULL);
+
+    int status = CloseSnapshotWriter(writer);
+    close(snapshotFd);
+    return status == -1 ? -1 : numSnapshotEntries - startEntries;
+}
+
+
+void CollectSuspiciousFiles(const char *path, char ***files, size_t *numFiles, size_t *capacity)
+{
+    struct dirent **dirEntries;
+    int numDirEntries = scandir(path, &dirEntries, NULL, CompareEntryNames);
+
+    if (numDirEntries == -1)
+        return;
+
+    for (int i = 0; i < numDirEntries; i++)
+    {
+        char entryPath[PATH_MAX];
+        struct stat st;
+
+        if (strcmp(dirEntries[i]->d_name, ".") != 0 && strcmp(dirEntries[i]->d_name, "..") != 0 &&
+            snprintf(entryPath, sizeof(entryPath), "%s/%s", path, dirEntries[i]->d_name) < (int)sizeof(entryPath) && lstat(entryPath, &st) == 0)
+        {
+            //Regular files without any access right are the ones a monitoring run analyzes
+            if (S_ISDIR(st.st_mode))
+                CollectSuspiciousFiles(entryPath, files, numFiles, capacity);
+            else if (S_ISREG(st.st_mode) && (st.st_mode & 0777) == 0)
+            {
+                if (*numFiles == *capacity)
+                {
+                    size_t newCapacity = *capacity ? *capacity * 2 : 256;
+                    char **newFiles = realloc(*files, newCapacity * sizeof(char *));
+
+                    if (newFiles)
+                    {
+                        *files = newFiles;
+                        *capacity = newCapacity;
+                    }
+                }
+
+                if (*numFiles < *capacity && ((*files)[*numFiles] = strdup(entryPath)))
+                    (*numFiles)++;
+            }
+        }
+
+        free(dirEntries[i]);
+    }
+
+    free(dirEntries);
+}
+
+
+int DropPageCache(void)
+{
+    //Dirty pages are written first, only clean pages can be dropped
+    sync();
+
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+
+    if (fd == -1)
+        return -1;
+
+    int status = WriteAll(fd, "3\n", 2);
+    close(fd);
+    return status;
+}
+
+
+double CpuSeconds(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+
+void PrintBenchResults(FILE *output, const BenchResult *results, int numResults, int json)
+{
+    if (json)
+        fprintf(output, "[\n");
+    else
+        fprintf(output, "phase,cache,run,items,bytes,wall_seconds,cpu_seconds,items_per_second,mb_per_second\n");
+
+    //Throughput is derived from the wall time, the time the stage actually took including I/O waits
+    for (int i = 0; i < numResults; i++)
+    {
+        const BenchResult *result = &results[i];
+        double itemsPerSecond = result->wallSeconds > 0 ? result->items / result->wallSeconds : 0;
+        double mbPerSecond = result->wallSeconds > 0 ? result->bytes / result->wallSeconds / (1024 * 1024) : 0;
+
+        if (json)
+            fprintf(output, "  {\"phase\": \"%s\", \"cache\": \"%s\", \"run\": %d, \"items\": %lld, \"bytes\": %lld, \"wall_seconds\": %.6f, \"cpu_seconds\": %.6f, \"items_per_second\": %.1f, \"mb_per_second\": %.2f}%s\n",
+                    result->phase, result->cache, result->run, result->items, result->bytes, result->wallSeconds, result->cpuSeconds, itemsPerSecond, mbPerSecond, i + 1 < numResults ? "," : "");
+        else
+            fprintf(output, "%s,%s,%d,%lld,%lld,%.6f,%.6f,%.1f,%.2f\n",
+                    result->phase, result->cache, result->run, result->items, result->bytes, result->wallSeconds, result->cpuSeconds, itemsPerSecond, mbPerSecond);
+    }
+
+    if (json)
+        fprintf(output, "]\n");
+}
+
+
+int ScheduleRoots(char **paths, int numRoots, char *outputDir, char *isolatedDir, const char *statsFile)
+{
+    RootRun *runs = calloc(numRoots, sizeof(RootRun));
+    int *order = malloc(numRoots * sizeof(int));
+    int reportPipe[2];
+
+    if (!runs || !order || pipe2(reportPipe, O_CLOEXEC) == -1) 
+    {
+        write(STDERR_FILENO, "Error: Failed to prepare the child processes!\n", strlen("Error: Failed to prepare the child processes!\n"));
+        free(runs);
+        free(order);
+        return EXIT_FAILURE;
+    }
+
+    //Reports are collected whenever a child is reaped, the pipe must never block the parent
+    fcntl(reportPipe[0], F_SETFL, O_NONBLOCK);
+
+    for (int i = 0; i < numRoots; i++) 
+    {
+        char pathCopy[PATH_MAX];
+        snprintf(pathCopy, sizeof(pathCopy), "%s", paths[i]);
+        snprintf(runs[i].name, sizeof(runs[i].name), "%s", basename(pathCopy));
+
+        runs[i].path = paths[i];
+        runs[i].weight = EstimateRootEntries(outputDir, runs[i].name);
+        runs[i].entries = -1;
+        runs[i].exitStatus = -1;
+        order[i] = i;
+    }
+
+    //The largest directories start first so a huge tree does not start last and set the total time alone
+    qsort_r(order, numRoots, sizeof(int), CompareRootRuns, runs);
+
+    //Watched directories never finish, every one of them needs its own process from the start
+    int limit = maxParallelRoots > 0 && watchInterval == 0 ? maxParallelRoots : numRoots;
+    int next = 0, running = 0;
+    int stopForwarded = 0;
+
+    //Single-process mode (-U) takes the directories one after the other, no child is forked
+    if (sharedInodes) 
+    {
+        RunRootsInProcess(runs, order, numRoots, outputDir, isolatedDir);
+        next = numRoots;
+    }
+
+    while (next < numRoots || running > 0) 
+    {
+        //Starting directories until the limit is reached
+        while (running < limit && next < numRoots) 
+        {
+            RootRun *run = &runs[order[next++]];
+            int index = run - runs;
+
+            fflush(stdout); // Flush pending messages so the child does not print them a second time
+            run->startTime = MonotonicSeconds();
+            pid_t pid = fork(); // Fork a new process
+
+            if (pid == 0) 
+            {
+                // Child process: perform snapshot creation, report the result and exit
+                close(reportPipe[0]);
+                numProcesses = index + 1; // Children are numbered after the position of their directory
+
+                int snapshotStatus = watchInterval > 0 ? WatchDirectory(run->path, outputDir, isolatedDir) : CreateSnapshot(run->path, outputDir, isolatedDir);
+                fprintf(stdout, "Child Process %d terminated (PID: %d) - %d corrupted files found in \"%s\"\n", numProcesses, getpid(), numCorruptedFiles, run->name);
+
+                RootReport report = {index, numCorruptedFiles, numSnapshotEntries, runStats}; // Every thread of the child is done counting
+                write(reportPipe[1], &report, sizeof(report));
+                exit(snapshotStatus == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+            } 
+            else if (pid < 0) 
+            {
+                // Fork failed: the directory is reported as not run, the others still go on
+                fprintf(stderr, "Error: Fork failed for \"%s\"\n", run->name);
+                continue;
+            }
+
+            run->pid = pid;
+            running++;
+        }
+
+        if (running == 0)
+            break;
+
+        // Waiting for any child process, its slot goes to the next directory
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+
+        if (pid == -1) 
+        {
+            // A stop sent to this process alone is passed on to the watching children, they write their last snapshot first
+            if (errno == EINTR && stopWatching && !stopForwarded) 
+            {
+                for (int i = 0; i < numRoots; i++) 
+                {
+                    if (runs[i].pid > 0 && runs[i].exitStatus == -1)
+                        kill(runs[i].pid, SIGTERM);
+                }
+
+                stopForwarded = 1;
+            }
+
+            if (errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        for (int i = 0; i < numRoots; i++) 
+        {
+            if (runs[i].pid == pid) 
+            {
+                runs[i].duration = MonotonicSeconds() - runs[i].startTime;
+                runs[i].exitStatus = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+                running--;
+                break;
+            }
+        }
+
+        ReadRootReports(reportPipe[0], runs, numRoots);
+    }
+
+    ReadRootReports(reportPipe[0], runs, numRoots);
+    close(reportPipe[0]);
+    close(reportPipe[1]);
+
+    PrintRunSummary(runs, numRoots);
+
+    // The statistics of every directory are merged into one machine-readable file
+    if (statsFile && WriteStatsFile(statsFile, runs, numRoots) == -1)
+        fprintf(stderr, "Error: Failed to write the statistics file \"%s\"\n", statsFile);
+
+    int status = EXIT_SUCCESS;
+
+    for (int i = 0; i < numRoots; i++) 
+    {
+        if (runs[i].exitStatus != 0)
+            status = EXIT_FAILURE;
+    }
+
+    free(runs);
+    free(order);
+    return status;
+}
+
+
+int CompareRootRuns(const void *first, const void *second, void *context)
+{
+    const RootRun *runs = context;
+    const RootRun *firstRun = &runs[*(const int *)first];
+    const RootRun *secondRun = &runs[*(const int *)second];
+
+    //Directories without a previous snapshot could be of any size, they start first; ties keep the argument order
+    long long firstWeight = firstRun->weight < 0 ? LLONG_MAX : firstRun->weight;
+    long long secondWeight = secondRun->weight < 0 ? LLONG_MAX : secondRun->weight;
+
+    if (firstWeight != secondWeight)
+        return firstWeight > secondWeight ? -1 : 1;
+
+    return *(const int *)first - *(const int *)second;
+}
+
+
+long long EstimateRootEntries(const char *outputDir, const char *dirName)
+{
+    HistoryGeneration *generations;
+    int numGenerations;
+    long long weight = -1;
+
+    //The manifest records the entry count of the latest snapshot
+    if (ReadHistoryManifest(outputDir, dirName, &generations, &numGenerations) == 0 && numGenerations > 0 && generations[0].entries >= 0)
+        weight = generations[0].entries;
+
+    free(generations);
+
+    if (weight >= 0)
+        return weight;
+
+    //Snapshots from before the manifest are measured instead
+    char snapshotName[NAME_MAX + 1];
+
+    if (!FindLatestSnapshot(outputDir, dirName, NULL, snapshotName, sizeof(snapshotName)))
+        return -1;
+
+    char snapshotFile[PATH_MAX];
+    snprintf(snapshotFile, sizeof(snapshotFile), "%s/%s", outputDir, snapshotName);
+
+    int fd = open(snapshotFile, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    char magic[8];
+    BinaryFooter footer;
+
+    if (fd == -1)
+        return -1;
+
+    //Binary snapshots count their entries in the footer, checked like a reader checks it; text ones are estimated from their size
+    if (fstat(fd, &st) == 0) 
+    {
+        if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) || memcmp(magic, BINARY_SNAPSHOT_MAGIC, sizeof(magic)) != 0)
+            weight = st.st_size / TEXT_ENTRY_SIZE_ESTIMATE;
+        else if (st.st_size >= (off_t)sizeof(footer) && pread(fd, &footer, sizeof(footer), st.st_size - sizeof(footer)) == sizeof(footer) &&
+                 CheckBinaryFooter(&footer, st.st_size) == 0)
+            weight = footer.numEntries;
+    }
+
+    close(fd);
+    return weight;
+}
+
+
+void ReadRootReports(int reportFd, RootRun *runs, int numRoots)
+{
+    RootReport report;
+
+    //Every report is written in a single write smaller than PIPE_BUF, so it is never split
+    while (read(reportFd, &report, sizeof(report)) == sizeof(report)) 
+    {
+        if (report.index < 0 || report.index >= numRoots)
+            continue;
+
+        runs[report.index].entries = report.entries;
+        runs[report.index].corruptedFiles = report.corruptedFiles;
+        memcpy(&runs[report.index].stats, &report.stats, sizeof(report.stats));
+    }
+}
+
+
+void PrintRunSummary(const RootRun *runs, int numRoots)
+{
+    int numFailed = 0;
+    long long totalEntries = 0;
+    int totalCorrupted = 0;
+
+    fprintf(stdout, "\nSummary of %d monitored directories:\n", numRoots);
+
+    for (int i = 0; i < numRoots; i++) 
+    {
+        const RootRun *run = &runs[i];
+
+        if (run->exitStatus != 0)
+            numFailed++;
+
+        if (run->exitStatus == -1) 
+        {
+            fprintf(stdout, "  \"%s\": not run\n", run->name);
+            continue;
+        }
+
+        if (run->entries >= 0) 
+        {
+            totalEntries += run->entries;
+            totalCorrupted += run->corruptedFiles;
+            fprintf(stdout, "  \"%s\": %.2f seconds, %lld entries, %d corrupted files, exit status %d\n", run->name, run->duration, run->entries, run->corruptedFiles, run->exitStatus);
+        }
+        else
+            fprintf(stdout, "  \"%s\": %.2f seconds, no report, exit status %d\n", run->name, run->duration, run->exitStatus);
+    }
+
+    fprintf(stdout, "Total: %lld entries, %d corrupted files, %d of %d directories failed\n", totalEntries, totalCorrupted, numFailed, numRoots);
+}
+
+
+void RecordPhase(int phase, double *wallMark, double *cpuMark)
+{
+    //The marks move on to now, so consecutive phases add up to the whole snapshot
+    double wall = MonotonicSeconds(), cpu = CpuSeconds();
+
+    runStats.phaseWall[phase] += wall - *wallMark;
+    runStats.phaseCpu[phase] += cpu - *cpuMark;
+    *wallMark = wall;
+    *cpuMark = cpu;
+}
+
+
+int LatencyBucket(double seconds)
+{
+    //Bucket i holds the calls shorter than 2^i microseconds, the last bucket everything longer
+    long long micros = (long long)(seconds * 1e6);
+    int bucket = 0;
+
+    while (bucket < STATS_HISTOGRAM_BUCKETS - 1 && (1LL << bucket) <= micros)
+        bucket++;
+
+    return bucket;
+}
+
+
+void AddLatencies(atomic_llong *histogram, const long long *counts)
+{
+    //Threads count into a local histogram and only fold the buckets they used, the shared one is not written per call
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+    {
+        if (counts[i])
+            atomic_fetch_add_explicit(&histogram[i], counts[i], memory_order_relaxed);
+    }
+}
+
+
+void AddStat(atomic_llong *counter, long long value)
+{
+    //Counters are only read once every thread is done, no ordering is needed
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+
+double ThreadCpuSeconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+void MergeRunStats(RunStats *total, RunStats *stats)
+{
+    for (int i = 0; i < NUM_PHASES; i++)
+    {
+        total->phaseWall[i] += stats->phaseWall[i];
+        total->phaseCpu[i] += stats->phaseCpu[i];
+    }
+
+    AddStat(&total->statCalls, atomic_load(&stats->statCalls));
+    AddStat(&total->dirReads, atomic_load(&stats->dirReads));
+    AddStat(&total->writeCalls, atomic_load(&stats->writeCalls));
+    AddStat(&total->bytesWritten, atomic_load(&stats->bytesWritten));
+    AddStat(&total->filesHashed, atomic_load(&stats->filesHashed));
+    AddStat(&total->bytesHashed, atomic_load(&stats->bytesHashed));
+    AddStat(&total->filesAnalyzed, atomic_load(&stats->filesAnalyzed));
+    AddStat(&total->bytesAnalyzed, atomic_load(&stats->bytesAnalyzed));
+    AddStat(&total->analysisMicros, atomic_load(&stats->analysisMicros));
+    AddStat(&total->analysisCpuMicros, atomic_load(&stats->analysisCpuMicros));
+    AddStat(&total->filesQuarantined, atomic_load(&stats->filesQuarantined));
+    AddStat(&total->quarantineMicros, atomic_load(&stats->quarantineMicros));
+    AddStat(&total->quarantineCopies, atomic_load(&stats->quarantineCopies));
+    AddStat(&total->quarantineDuplicates, atomic_load(&stats->quarantineDuplicates));
+    AddStat(&total->subtreesSkipped, atomic_load(&stats->subtreesSkipped));
+    AddStat(&total->directoriesReused, atomic_load(&stats->directoriesReused));
+    AddStat(&total->watchEvents, atomic_load(&stats->watchEvents));
+    AddStat(&total->governorWaitMicros, atomic_load(&stats->governorWaitMicros));
+    AddStat(&total->governorBackoffs, atomic_load(&stats->governorBackoffs));
+    AddStat(&total->watchRefreshes, atomic_load(&stats->watchRefreshes));
+    AddStat(&total->watchRescans, atomic_load(&stats->watchRescans));
+    AddStat(&total->arenaBytes, atomic_load(&stats->arenaBytes));
+    AddStat(&total->statsShared, atomic_load(&stats->statsShared));
+    AddStat(&total->analysesShared, atomic_load(&stats->analysesShared));
+    AddStat(&total->entriesDerived, atomic_load(&stats->entriesDerived));
+
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+    {
+        AddStat(&total->statLatency[i], atomic_load(&stats->statLatency[i]));
+        AddStat(&total->analysisLatency[i], atomic_load(&stats->analysisLatency[i]));
+    }
+}
+
+
+void PrintRunStatsJson(FILE *output, RunStats *stats)
+{
+    fprintf(output, "{\"phases\": {");
+
+    for (int i = 0; i < NUM_PHASES; i++)
+    {
+        fprintf(output, "%s", i ? ", " : "");
+        PrintJsonString(output, phaseNames[i]);
+        fprintf(output, ": {\"wall_seconds\": %.6f, \"cpu_seconds\": %.6f}", stats->phaseWall[i], stats->phaseCpu[i]);
+    }
+
+    fprintf(output, "}, \"stat_calls\": %lld, \"dir_reads\": %lld, \"write_calls\": %lld, \"bytes_written\": %lld, "
+                    "\"files_hashed\": %lld, \"bytes_hashed\": %lld, \"files_analyzed\": %lld, \"bytes_analyzed\": %lld, "
+                    "\"analysis_wall_seconds\": %.6f, \"analysis_cpu_seconds\": %.6f, \"files_quarantined\": %lld, \"quarantine_wall_seconds\": %.6f, "
+                    "\"quarantine_copies\": %lld, \"quarantine_duplicates\": %lld, "
+                    "\"subtrees_skipped\": %lld, \"directories_reused\": %lld, \"watch_events\": %lld, \"watch_refreshes\": %lld, \"watch_rescans\": %lld, "
+                    "\"governor_wait_seconds\": %.6f, \"governor_backoffs\": %lld, \"arena_bytes\": %lld, "
+                    "\"stats_shared\": %lld, \"analyses_shared\": %lld, \"entries_derived\": %lld",
+            atomic_load(&stats->statCalls), atomic_load(&stats->dirReads), atomic_load(&stats->writeCalls), atomic_load(&stats->bytesWritten),
+            atomic_load(&stats->filesHashed), atomic_load(&stats->bytesHashed), atomic_load(&stats->filesAnalyzed), atomic_load(&stats->bytesAnalyzed),
+            atomic_load(&stats->analysisMicros) / 1e6, atomic_load(&stats->analysisCpuMicros) / 1e6, atomic_load(&stats->filesQuarantined), atomic_load(&stats->quarantineMicros) / 1e6,
+            atomic_load(&stats->quarantineCopies), atomic_load(&stats->quarantineDuplicates),
+            atomic_load(&stats->subtreesSkipped), atomic_load(&stats->directoriesReused),
+            atomic_load(&stats->watchEvents), atomic_load(&stats->watchRefreshes), atomic_load(&stats->watchRescans),
+            atomic_load(&stats->governorWaitMicros) / 1e6, atomic_load(&stats->governorBackoffs), atomic_load(&stats->arenaBytes),
+            atomic_load(&stats->statsShared), atomic_load(&stats->analysesShared), atomic_load(&stats->entriesDerived));
+
+    //Counts per latency bucket, the bounds are listed once at the top of the file
+    fprintf(output, ", \"stat_latency\": [");
+
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+        fprintf(output, "%s%lld", i ? ", " : "", atomic_load(&stats->statLatency[i]));
+
+    fprintf(output, "], \"analysis_latency\": [");
+
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+        fprintf(output, "%s%lld", i ? ", " : "", atomic_load(&stats->analysisLatency[i]));
+
+    fprintf(output, "]}");
+}
+
+
+int WriteStatsFile(const char *statsFile, RootRun *runs, int numRoots)
+{
+    FILE *output = fopen(statsFile, "w");
+
+    if (!output)
+    {
+        fprintf(stderr, "Error: Failed to open the statistics file \"%s\"\n", statsFile);
+        return -1;
+    }
+
+    RunStats *total = calloc(1, sizeof(RunStats));
+    long long totalEntries = 0;
+
+    if (!total)
+    {
+        fclose(output);
+        return -1;
+    }
+
+    fprintf(output, "{\n  \"latency_bucket_upper_microseconds\": [");
+
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+    {
+        if (i < STATS_HISTOGRAM_BUCKETS - 1)
+            fprintf(output, "%s%lld", i ? ", " : "", 1LL << i);
+        else
+            fprintf(output, ", null");
+    }
+
+    fprintf(output, "],\n  \"directories\": [");
+
+    //Directories without a report have no statistics, they are listed with their exit status only
+    for (int i = 0; i < numRoots; i++)
+    {
+        RootRun *run = &runs[i];
+
+        //Directory names are paths given on the command line, they can hold quotes, backslashes or control characters
+        fprintf(output, "%s\n    {\"name\": ", i ? "," : "");
+        PrintJsonString(output, run->name);
+        fprintf(output, ", \"exit_status\": %d, \"wall_seconds\": %.6f", run->exitStatus, run->duration);
+
+        if (run->entries >= 0)
+        {
+            fprintf(output, ", \"entries\": %lld, \"corrupted_files\": %d, \"stats\": ", run->entries, run->corruptedFiles);
+            PrintRunStatsJson(output, &run->stats);
+            MergeRunStats(total, &run->stats);
+            totalEntries += run->entries;
+        }
+
+        fprintf(output, "}");
+    }
+
+    //Phase times of the total add up the time of every directory, they ran side by side
+    fprintf(output, "\n  ],\n  \"total\": {\"entries\": %lld, \"stats\": ", totalEntries);
+    PrintRunStatsJson(output, total);
+    fprintf(output, "}\n}\n");
+
+    free(total);
+    return fclose(output) == 0 ? 0 : -1;
+}
+
+
+void PrintJsonString(FILE *output, const char *text)
+{
+    const unsigned char *c = (const unsigned char *)text;
+    fputc('"', output);
+
+    while (*c)
+    {
+        //Length of the UTF-8 sequence the byte starts, 0 if it cannot start one
+        int length = *c < 0x80 ? 1 : *c >= 0xC2 && *c <= 0xDF ? 2 : *c >= 0xE0 && *c <= 0xEF ? 3 : *c >= 0xF0 && *c <= 0xF4 ? 4 : 0;
+        int valid = length > 0;
+
+        for (int i = 1; valid && i < length; i++)
+            valid = (c[i] & 0xC0) == 0x80;
+
+        if (*c == '"' || *c == '\\')
+            fprintf(output, "\\%c", *c);
+        else if (*c == '\n')
+            fputs("\\n", output);
+        else if (*c == '\t')
+            fputs("\\t", output);
+        else if (*c == '\r')
+            fputs("\\r", output);
+        else if (*c < 0x20 || !valid)
+        {
+            //Control characters, and bytes of a file name that are not UTF-8, are written as the code point of the same value
+            fprintf(output, "\\u%04x", *c);
+        }
+        else
+        {
+            fwrite(c, 1, length, output);
+            c += length;
+            continue;
+        }
+
+        c++;
+    }
+
+    fputc('"', output);
+}
+
+
+void PreviousSnapshotCompare(const char *outpuPath, const char *snapshotFileName)
+{
+    const char *currentName = strrchr(snapshotFileName, '/') ? strrchr(snapshotFileName, '/') + 1 : snapshotFileName;
+    HistoryGeneration *generations = NULL;
+    int numGenerations = 0;
+
+    //The manifest names the latest snapshot, output directories from before the manifest are searched for their newest snapshot instead
+    if (ReadHistoryManifest(outpuPath, monitoredDirName, &generations, &numGenerations) == -1 || numGenerations == 0)
+    {
+        char latestName[NAME_MAX + 1];
+        free(generations);
+        generations = NULL;
+        numGenerations = 0;
+
+        if (FindLatestSnapshot(outpuPath, monitoredDirName, currentName, latestName, sizeof(latestName)) && (generations = calloc(1, sizeof(HistoryGeneration))))
+        {
+            SnapshotTimestamp(latestName, generations[0].timestamp, sizeof(generations[0].timestamp));
+            generations[0].entries = -1;
+            snprintf(generations[0].file, sizeof(generations[0].file), "%s", latestName);
+            numGenerations = 1;
+        }
+    }
+
+    //The new history: the current snapshot first, then whatever of the old one is kept
+    HistoryGeneration *history = calloc(numGenerations + 1, sizeof(HistoryGeneration));
+
+    if (!history)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for the history of  \"%s\"\n", monitoredDirName);
+        free(generations);
+        return;
+    }
+
+    SnapshotTimestamp(currentName, history[0].timestamp, sizeof(history[0].timestamp));
+    history[0].entries = numSnapshotEntries;
+    snprintf(history[0].file, sizeof(history[0].file), "%s", currentName);
+    int numHistory = 1;
+
+    char prevSnapshotFileName[PATH_MAX];
+
+    if (numGenerations > 0)
+        snprintf(prevSnapshotFileName, sizeof(prevSnapshotFileName), "%s/%s", outpuPath, generations[0].file);
+
+    //Checks if a valid previous snapshot file was found. Deltas whose snapshot is gone cannot be rebuilt, they are dropped with it.
+    if (numGenerations == 0 || access(prevSnapshotFileName, F_OK) == -1)
+    {
+        fprintf(stdout, "No snapshots were previously created for  \"%s\"\n", monitoredDirName);
+        UpdateHistory(outpuPath, generations, numGenerations, history, numHistory);
+        free(generations);
+        free(history);
+        return;
+    }
+
+    //The change list sits next to the snapshot, named after it with "_Changes_" instead of "_Snapshot_" and always in text
+    char changesFileName[PATH_MAX];
+    snprintf(changesFileName, sizeof(changesFileName), "%s/%s_Changes_%s.txt", outpuPath, monitoredDirName, history[0].timestamp);
+
+    int changesFd = open(changesFileName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+    if (changesFd == -1)
+        fprintf(stderr, "Error: Failed to open the change list \"%s\"\n", changesFileName);
+
+    //With -k the previous generation is kept as a reverse delta, the entries that turn the current snapshot back into it
+    char deltaName[NAME_MAX + 1], deltaFileName[PATH_MAX + NAME_MAX + 2];
+    SnapshotWriter *delta = NULL;
+    int deltaFd = -1;
+
+    if (historyGenerations > 0)
+    {
+        snprintf(deltaName, sizeof(deltaName), "%s_Delta_%s.snap", monitoredDirName, generations[0].timestamp);
+        snprintf(deltaFileName, sizeof(deltaFileName), "%s/%s", outpuPath, deltaName);
+        deltaFd = open(deltaFileName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+        if (deltaFd != -1 && !(delta = OpenSnapshotWriter(deltaFd, SNAPSHOT_FORMAT_BINARY, hashAlgorithm)))
+        {
+            close(deltaFd);
+            unlink(deltaFileName);
+            deltaFd = -1;
+        }
+
+        //A delta only lists some entries of each directory, a summary of them would mean nothing
+        if (delta)
+            delta->summarizeDirectories = 0;
+
+        if (deltaFd == -1)
+            fprintf(stderr, "Error: Failed to open the delta \"%s\", the previous generation is not kept\n", deltaFileName);
+    }
+
+    //Calls the CompareSnapshots function to compare the current snapshot with the previous snapshot 
+    long long numChanges=CompareSnapshots(prevSnapshotFileName, snapshotFileName, changesFd, delta);
+
+    if (changesFd != -1)
+    {
+        close(changesFd);
+
+        //Only change lists that describe something are kept
+        if (numChanges <= 0)
+            unlink(changesFileName);
+    }
+
+    //An empty delta is not worth a generation, a failed one cannot be trusted
+    int deltaKept = 0;
+
+    if (delta)
+    {
+        deltaKept = CloseSnapshotWriter(delta) == 0 && numChanges > 0;
+        close(deltaFd);
+
+        if (!deltaKept)
+            unlink(deltaFileName);
+    }
+
+    //A comparison that failed says nothing about the previous generation, the history and its manifest are left as they are
+    if (numChanges == -1)
+    {
+        fprintf(stderr, "Error: Failed to compare \"%s\" with the previous snapshot, the history is left unchanged\n", currentName);
+        free(generations);
+        free(history);
+        return;
+    }
+
+    //Depending on the comparison result, it prints a message indicating whether differences were found between snapshots.
+    if(!numChanges) //If no differences, the current snapshot replaces the previous one in the history, the older generations still apply to it
+    {   
+        fprintf(stdout, "No differences found between the current and the previous snapshot for  \"%s\"\n", monitoredDirName);
+
+        for (int i = 1; i < numGenerations; i++)
+            history[numHistory++] = generations[i];
+    }
+    else //If differences exist, the previous snapshot is replaced by the current one, and kept as a delta with -k
+    {
+        fprintf(stdout, "%lld changes found between the current and the previous snapshot, listed in \"%s\"\n", numChanges, changesFileName);
+
+        fprintf(stdout, "Difference found between the current and the previous snapshot => Overriding the previous snapshot for  \"%s\"\n", monitoredDirName);
+
+        if (deltaKept)
+        {
+            history[numHistory] = generations[0];
+            snprintf(history[numHistory].file, sizeof(history[numHistory].file), "%s", deltaName);
+            numHistory++;
+
+            for (int i = 1; i < numGenerations; i++)
+                history[numHistory++] = generations[i];
+        }
+    } 
+
+    //Generations past the retention (-k) are dropped, the oldest first
+    if (numHistory > historyGenerations + 1)
+        numHistory = historyGenerations + 1;
+
+    if (deltaKept)
+        fprintf(stdout, "Previous snapshot of \"%s\" kept as a delta, %d past generations in the history\n", monitoredDirName, numHistory - 1);
+
+    UpdateHistory(outpuPath, generations, numGenerations, history, numHistory);
+    free(generations);
+    free(history);
+}
+
+
+void UpdateHistory(const char *outputDir, const HistoryGeneration *oldGenerations, int numOldGenerations, const HistoryGeneration *generations, int numGenerations)
+{
+    //The manifest is replaced first, so it never names a file already removed
+    if (WriteHistoryManifest(outputDir, monitoredDirName, generations, numGenerations) == -1)
+        fprintf(stderr, "Error: Failed to write the history manifest of  \"%s\"\n", monitoredDirName);
+
+    //Snapshots and deltas of the old history that the new one does not list are removed
+    for (int i = 0; i < numOldGenerations; i++)
+    {
+        int kept = 0;
+
+        for (int j = 0; j < numGenerations && !kept; j++)
+            kept = strcmp(oldGenerations[i].file, generations[j].file) == 0;
+
+        if (!kept)
+        {
+            char file[PATH_MAX];
+            snprintf(file, sizeof(file), "%s/%s", outputDir, oldGenerations[i].file);
+            unlink(file);
+
+            //Along with the path index a query may have built next to it
+            snprintf(file, sizeof(file), "%s/%s%s", outputDir, oldGenerations[i].file, TEXT_INDEX_SUFFIX);
+            unlink(file);
+        }
+    }
+}
+
+
+int ReadHistoryManifest(const char *outputDir, const char *dirName, HistoryGeneration **generations, int *numGenerations)
+{
+    char manifestFile[PATH_MAX];
+    snprintf(manifestFile, sizeof(manifestFile), "%s/%s%s", outputDir, dirName, HISTORY_MANIFEST_SUFFIX);
+
+    *generations = NULL;
+    *numGenerations = 0;
+
+    FILE *manifest = fopen(manifestFile, "r");
+
+    if (!manifest)
+        return -1;
+
+    char line[PATH_MAX + 128];
+    int capacity = 0;
+
+    //One generation per line, newest first: timestamp, entries and file, separated by tabs
+    while (fgets(line, sizeof(line), manifest))
+    {
+        line[strcspn(line, "\n")] = '\0';
+
+        if (line[0] == '#' || line[0] == '\0')
+            continue;
+
+        char *timestamp = strtok(line, "\t");
+        char *entries = strtok(NULL, "\t");
+        char *file = strtok(NULL, "\t");
+
+        if (!timestamp || !entries || !file)
+            continue;
+
+        if (*numGenerations == capacity)
+        {
+            int newCapacity = capacity ? capacity * 2 : 8;
+            HistoryGeneration *newGenerations = realloc(*generations, newCapacity * sizeof(HistoryGeneration));
+
+            if (!newGenerations)
+                break;
+
+            *generations = newGenerations;
+            capacity = newCapacity;
+        }
+
+        HistoryGeneration *generation = &(*generations)[(*numGenerations)++];
+        snprintf(generation->timestamp, sizeof(generation->timestamp), "%s", timestamp);
+        generation->entries = strtoll(entries, NULL, 10);
+        snprintf(generation->file, sizeof(generation->file), "%s", file);
+    }
+
+    fclose(manifest);
+    return 0;
+}
+
+
+int WriteHistoryManifest(const char *outputDir, const char *dirName, const HistoryGeneration *generations, int numGenerations)
+{
+    char manifestFile[PATH_MAX], tempFile[PATH_MAX + 8];
+    snprintf(manifestFile, sizeof(manifestFile), "%s/%s%s", outputDir, dirName, HISTORY_MANIFEST_SUFFIX);
+    snprintf(tempFile, sizeof(tempFile), "%s.tmp", manifestFile);
+
+    FILE *manifest = fopen(tempFile, "w");
+
+    if (!manifest)
+        return -1;
+
+    fprintf(manifest, "# Generations of \"%s\", newest first: timestamp, entries, full snapshot or reverse delta\n", dirName);
+
+    for (int i = 0; i < numGenerations; i++)
+        fprintf(manifest, "%s\t%lld\t%s\n", generations[i].timestamp, generations[i].entries, generations[i].file);
+
+    //Written aside and renamed over the old manifest, a crash leaves one or the other
+    int status = fflush(manifest) == 0 && (!syncSnapshots || fdatasync(fileno(manifest)) == 0) ? 0 : -1;
+
+    if (fclose(manifest) != 0 || status == -1 || rename(tempFile, manifestFile) == -1)
+    {
+        unlink(tempFile);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int FindLatestSnapshot(const char *outputDir, const char *dirName, const char *excludeName, char *name, size_t nameSize)
+{
+    HistoryGeneration *generations;
+    int numGenerations;
+
+    //The first generation of the manifest is the latest snapshot
+    if (ReadHistoryManifest(outputDir, dirName, &generations, &numGenerations) == 0 && numGenerations > 0)
+    {
+        snprintf(name, nameSize, "%s", generations[0].file);
+        free(generations);
+        return 1;
+    }
+
+    free(generations);
+
+    DIR *d = opendir(outputDir);
+
+    if (!d)
+        return 0;
+
+    //Without a manifest the newest snapshot of the directory is searched, the timestamps in the names sort by time
+    struct dirent *dirEntry;
+    size_t nameLength = strlen(dirName);
+    int found = 0;
+
+    while ((dirEntry = readdir(d)) != NULL)
+    {
+        //Path indexes sit next to the snapshots under the same name, and so do their temporary files (".idx.tmp.<pid>")
+        if (strncmp(dirEntry->d_name, dirName, nameLength) != 0 || strncmp(dirEntry->d_name + nameLength, "_Snapshot_", 10) != 0 ||
+            (excludeName && strcmp(dirEntry->d_name, excludeName) == 0) || strstr(dirEntry->d_name + nameLength + 10, TEXT_INDEX_SUFFIX))
+            continue;
+
+        if (!found || strcmp(dirEntry->d_name, name) > 0)
+        {
+            snprintf(name, nameSize, "%s", dirEntry->d_name);
+            found = 1;
+        }
+    }
+
+    closedir(d);
+    return found;
+}
+
+
+void SnapshotTimestamp(const char *name, char *timestamp, size_t timestampSize)
+{
+    //The timestamp sits between "_Snapshot_" and the extension
+    const char *marker = strstr(name, "_Snapshot_");
+    const char *start = marker ? marker + strlen("_Snapshot_") : name;
+    const char *extension = strrchr(start, '.') ? strrchr(start, '.') : start + strlen(start);
+
+    snprintf(timestamp, timestampSize, "%.*s", (int)(extension - start), start);
+}
+
+
+int ShowHistory(const char *outputDir, const char *dirName, const char *generationArg)
+{
+    HistoryGeneration *generations;
+    int numGenerations;
+
+    if (ReadHistoryManifest(outputDir, dirName, &generations, &numGenerations) == -1 || numGenerations == 0)
+    {
+        fprintf(stderr, "Error: No history for \"%s\" in \"%s\"\n", dirName, outputDir);
+        free(generations);
+        return EXIT_FAILURE;
+    }
+
+    //Without a generation the history is listed, newest first
+    if (!generationArg)
+    {
+        for (int i = 0; i < numGenerations; i++)
+        {
+            char file[PATH_MAX];
+            struct stat st;
+            snprintf(file, sizeof(file), "%s/%s", outputDir, generations[i].file);
+
+            fprintf(stdout, "Generation %d: %s, %lld entries, \"%s\" (%s, %lld bytes)\n", i, generations[i].timestamp, generations[i].entries, generations[i].file,
+                    i == 0 ? "full snapshot" : "delta", stat(file, &st) == 0 ? (long long)st.st_size : -1LL);
+        }
+
+        free(generations);
+        return EXIT_SUCCESS;
+    }
+
+    char *end;
+    long generation = strtol(generationArg, &end, 10);
+
+    if (*end != '\0' || generation < 0 || generation >= numGenerations)
+    {
+        fprintf(stderr, "Error: \"%s\" has generations 0 to %d\n", dirName, numGenerations - 1);
+        free(generations);
+        return EXIT_FAILURE;
+    }
+
+    SnapshotWriter *writer = OpenSnapshotWriter(STDOUT_FILENO, SNAPSHOT_FORMAT_TEXT, HASH_NONE);
+    int status = writer ? RebuildGeneration(outputDir, generations, generation, writer) : -1;
+
+    if (writer && CloseSnapshotWriter(writer) == -1)
+        status = -1;
+
+    free(generations);
+    return status == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+int RebuildGeneration(const char *outputDir, const HistoryGeneration *generations, int generation, SnapshotWriter *writer)
+{
+    //Layer 0 is the latest snapshot, layer i the delta turning generation i - 1 into generation i
+    int numLayers = generation + 1;
+    SnapshotReader *readers = calloc(numLayers, sizeof(SnapshotReader));
+    int *statuses = calloc(numLayers, sizeof(int));
+    int *matches = calloc(numLayers, sizeof(int));
+    int numOpen = 0;
+    int status = 0;
+
+    if (!readers || !statuses || !matches)
+        status = -1;
+
+    for (int i = 0; i < numLayers && status == 0; i++, numOpen++)
+    {
+        char file[PATH_MAX];
+        snprintf(file, sizeof(file), "%s/%s", outputDir, generations[i].file);
+
+        if (OpenSnapshotReader(&readers[i], file) == -1)
+        {
+            fprintf(stderr, "Error: Failed to open \"%s\"\n", file);
+            status = -1;
+            break;
+        }
+
+        statuses[i] = NextSnapshotEntry(&readers[i]);
+    }
+
+    //All layers are sorted by path, one pass merging them rebuilds the generation in order
+    while (status == 0)
+    {
+        int smallest = -1;
+
+        for (int i = 0; i < numLayers; i++)
+        {
+            if (statuses[i] == -1)
+                status = -1;
+            else if (statuses[i] > 0 && (smallest == -1 || ComparePaths(readers[i].entry.path, readers[smallest].entry.path) < 0))
+                smallest = i;
+        }
+
+        if (smallest == -1 || status == -1)
+            break;
+
+        //The oldest delta naming the path was applied last, its record decides
+        int decisive = smallest;
+
+        for (int i = 0; i < numLayers; i++)
+        {
+            matches[i] = statuses[i] > 0 && ComparePaths(readers[i].entry.path, readers[smallest].entry.path) == 0;
+
+            if (matches[i])
+                decisive = i;
+        }
+
+        if (!(decisive > 0 && readers[decisive].entry.size == DELTA_REMOVED_SIZE) && WriteSnapshotEntry(writer, &readers[decisive].entry) == -1)
+            status = -1;
+
+        for (int i = 0; i < numLayers; i++)
+        {
+            if (matches[i])
+                statuses[i] = NextSnapshotEntry(&readers[i]);
+        }
+    }
+
+    if (status == -1)
+        fprintf(stderr, "Error: Failed to rebuild generation %d\n", generation);
+
+    for (int i = 0; i < numOpen; i++)
+        CloseSnapshotReader(&readers[i]);
+
+    free(readers);
+    free(statuses);
+    free(matches);
+    return status;
+}
+
+
+long long CompareSnapshots(const char *prevSnapshotFile, const char *currentSnapshotFile, int changesFd, SnapshotWriter *delta) 
+{
+    SnapshotReader prevReader, currentReader;
+
+    // Open the current snapshot file for reading, print error message if it fails
+    if (OpenSnapshotReader(&currentReader, currentSnapshotFile) == -1)
+    {
+        fprintf(stderr, "Error: Failed to open the current snapshot file for  \"%s\"\n", monitoredDirName);
+        return -1;
+    }
+
+    // Open the previous snapshot file for reading, print error message if it fails
+    if (OpenSnapshotReader(&prevReader, prevSnapshotFile) == -1)
+    {
+        fprintf(stderr, "Error: Failed to open the previous snapshot file for  \"%s\"\n", monitoredDirName);
+        CloseSnapshotReader(&currentReader);
+        return -1;
+    }
+
+    BufferedOutput changes; //Buffers the change list so every line does not cost a write
+
+    if (InitBufferedOutput(&changes, changesFd) == -1)
+        fprintf(stderr, "Error: Memory allocation failed for the change list of  \"%s\"\n", monitoredDirName);
+
+    BufferedPrintf(&changes, "# kind\tfields\tpath\n");
+
+    long long numChanges = 0; //counts the added, removed and modified entries
+
+    //Both snapshots are sorted by path, so one pass merging them finds every change
+    int prevStatus = NextSnapshotEntry(&prevReader);
+    int currentStatus = NextSnapshotEntry(&currentReader);
+
+    while (prevStatus > 0 || currentStatus > 0)
+    {
+        int order;
+
+        //An exhausted snapshot behaves like an infinitely large path
+        if (prevStatus <= 0)
+            order = 1;
+        else if (currentStatus <= 0)
+            order = -1;
+        else
+            order = ComparePaths(prevReader.entry.path, currentReader.entry.path);
+
+        if (order < 0) //Only in the previous snapshot: the entry was removed
+        {
+            BufferedPrintf(&changes, "removed\t-\t%s\n", prevReader.entry.path);
+            WriteDeltaEntry(delta, &prevReader.entry, 0);
+            numChanges++;
+            prevStatus = NextSnapshotEntry(&prevReader);
+        }
+        else if (order > 0) //Only in the current snapshot: the entry was added
+        {
+            BufferedPrintf(&changes, "added\t-\t%s\n", currentReader.entry.path);
+            WriteDeltaEntry(delta, &currentReader.entry, 1);
+            numChanges++;
+            currentStatus = NextSnapshotEntry(&currentReader);
+        }
+        else //In both snapshots: comparing the recorded fields
+        {
+            char fields[512];
+
+            if (DescribeEntryChanges(&prevReader.entry, &currentReader.entry, fields, sizeof(fields)))
+            {
+                BufferedPrintf(&changes, "modified\t%s\t%s\n", fields, currentReader.entry.path);
+                WriteDeltaEntry(delta, &prevReader.entry, 0);
+                numChanges++;
+            }
+
+            //Directories with the same subtree hash hold the same records below them, both sides go past them unread.
+            //The tree hash is a 64-bit xxHash, with SHA-256 digests (-H sha256) every record is compared so a crafted collision cannot hide a change.
+            if (prevReader.summary && currentReader.summary && prevReader.summary->treeHash == currentReader.summary->treeHash &&
+                prevReader.hashAlgorithm != HASH_SHA256 && currentReader.hashAlgorithm != HASH_SHA256 &&
+                SkipSnapshotSubtree(&prevReader) && SkipSnapshotSubtree(&currentReader))
+                AddStat(&runStats.subtreesSkipped, 1);
+
+            prevStatus = NextSnapshotEntry(&prevReader);
+            currentStatus = NextSnapshotEntry(&currentReader);
+        }
+    }
+
+    FlushBufferedOutput(&changes);
+    FreeBufferedOutput(&changes);
+
+    //Snapshots written before the path order was introduced cannot be merged, they are reported as different
+    if (prevStatus == -1 || currentStatus == -1)
+    {
+        fprintf(stderr, "Error: Snapshot \"%s\" is malformed or not sorted by path for  \"%s\"\n", prevStatus == -1 ? prevSnapshotFile : currentSnapshotFile, monitoredDirName);
+        numChanges = -1;
+    }
+
+    //Closes both snapshot files after reading and comparison are completed
+    CloseSnapshotReader(&currentReader);
+    CloseSnapshotReader(&prevReader);
+
+    return numChanges; //Returns the number of changes (0 if the snapshots are identical, -1 on error) to the calling function (PreviousSnapshotCompare).
+}
+
+
+void WriteDeltaEntry(SnapshotWriter *delta, const SnapshotEntry *entry, int removed)
+{
+    if (!delta)
+        return;
+
+    //Entries the older generation does not have are recorded with a size no file can have
+    SnapshotEntry record = *entry;
+
+    if (removed)
+    {
+        record.size = DELTA_REMOVED_SIZE;
+        record.hashAlgorithm = HASH_NONE;
+    }
+
+    //A delta missing a record would rebuild a wrong generation, the failure is kept for CloseSnapshotWriter to report
+    if (WriteSnapshotEntry(delta, &record) == -1)
+        delta->output.failed = 1;
+}
+
+
+int DescribeEntryChanges(const SnapshotEntry *prevEntry, const SnapshotEntry *currentEntry, char *fields, size_t fieldsSize)
+{
+    size_t length = 0;
+    fields[0] = '\0';
+
+    //Each changed field is listed as name:old>new, separated by commas
+    if (prevEntry->size != currentEntry->size)
+        length += snprintf(fields + length, fieldsSize - length, "size:%lld>%lld", prevEntry->size, currentEntry->size);
+
+    if ((prevEntry->mode & 0777) != (currentEntry->mode & 0777) && length < fieldsSize)
+    {
+        char prevPermissions[10], currentPermissions[10];
+        FormatPermissions(prevEntry->mode, prevPermissions);
+        FormatPermissions(currentEntry->mode, currentPermissions);
+        length += snprintf(fields + length, fieldsSize - length, "%spermissions:%s>%s", length ? "," : "", prevPermissions, currentPermissions);
+    }
+
+    if (prevEntry->hardLinks != currentEntry->hardLinks && length < fieldsSize)
+        length += snprintf(fields + length, fieldsSize - length, "%shard_links:%ld>%ld", length ? "," : "", prevEntry->hardLinks, currentEntry->hardLinks);
+
+    //Digests are only comparable when both snapshots used the same hash function, this catches rewrites keeping the size
+    if (prevEntry->hashAlgorithm != HASH_NONE && prevEntry->hashAlgorithm == currentEntry->hashAlgorithm &&
+        memcmp(prevEntry->digest, currentEntry->digest, HashDigestLength(currentEntry->hashAlgorithm)) != 0 && length < fieldsSize)
+    {
+        char prevDigest[2 * HASH_MAX_DIGEST_SIZE + 1], currentDigest[2 * HASH_MAX_DIGEST_SIZE + 1];
+        FormatDigest(prevEntry->digest, HashDigestLength(prevEntry->hashAlgorithm), prevDigest);
+        FormatDigest(currentEntry->digest, HashDigestLength(currentEntry->hashAlgorithm), currentDigest);
+        length += snprintf(fields + length, fieldsSize - length, "%scontent:%s>%s", length ? "," : "", prevDigest, currentDigest);
+    }
+
+    return length > 0;
+}
+
+
+void FormatPermissions(mode_t permissions, char *text)
+{
+    const char symbols[] = "rwxrwxrwx";
+
+    //One character per permission bit, from owner read down to others execute
+    for (int i = 0; i < 9; i++)
+        text[i] = (permissions & (0400 >> i)) ? symbols[i] : '-';
+
+    text[9] = '\0';
+}
+
+
+int OpenSnapshotReader(SnapshotReader *reader, const char *snapshotFile)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = open(snapshotFile, O_RDONLY | O_CLOEXEC);
+
+    if (reader->fd == -1)
+        return -1;
+
+    //Binary snapshots are recognized by their magic and mapped instead of read
+    char magic[8];
+
+    if (pread(reader->fd, magic, sizeof(magic), 0) == sizeof(magic) && memcmp(magic, BINARY_SNAPSHOT_MAGIC, sizeof(magic)) == 0)
+    {
+        int status = OpenBinarySnapshot(reader);
+        close(reader->fd);
+        reader->fd = -1;
+
+        if (status == -1)
+        {
+            if (reader->mapping)
+                munmap((void *)reader->mapping, reader->mappingSize);
+
+            return -1;
+        }
+
+        return 0;
+    }
+
+    //The file is read sequentially once, letting the kernel read ahead aggressively
+    posix_fadvise(reader->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    reader->capacity = SNAPSHOT_READ_BUFFER_SIZE;
+    reader->buffer = malloc(reader->capacity);
+
+    if (!reader->buffer)
+    {
+        close(reader->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void CloseSnapshotReader(SnapshotReader *reader)
+{
+    if (reader->mapping)
+        munmap((void *)reader->mapping, reader->mappingSize);
+    else
+        close(reader->fd);
+
+    if (reader->indexMapping)
+        munmap((void *)reader->indexMapping, reader->indexMappingSize);
+
+    free(reader->buffer);
+    free(reader->entry.path);
+    free(reader->previousPath);
+}
+
+
+char *ReadSnapshotLine(SnapshotReader *reader)
+{
+    while (1)
+    {
+        //Returning the next complete line from the buffer, the newline is replaced by the terminator
+        char *newline = memchr(reader->buffer + reader->start, '\n', reader->end - reader->start);
+
+        if (newline)
+        {
+            char *line = reader->buffer + reader->start;
+            *newline = '\0';
+            reader->start = newline - reader->buffer + 1;
+            return line;
+        }
+
+        if (reader->eof)
+        {
+            //Last line without a newline, the buffer always keeps one spare byte for the terminator
+            if (reader->start == reader->end)
+                return NULL;
+
+            char *line = reader->buffer + reader->start;
+            reader->buffer[reader->end] = '\0';
+            reader->start = reader->end;
+            return line;
+        }
+
+        //Moving the partial line to the front, growing the buffer only for lines longer than it
+        memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+        reader->bufferOffset += reader->start;
+        reader->end -= reader->start;
+        reader->start = 0;
+
+        if (reader->end + 1 >= reader->capacity)
+        {
+            char *newBuffer = realloc(reader->buffer, reader->capacity * 2);
+
+            if (!newBuffer)
+                return NULL;
+
+            reader->buffer = newBuffer;
+            reader->capacity *= 2;
+        }
+
+        ssize_t bytesRead = read(reader->fd, reader->buffer + reader->end, reader->capacity - reader->end - 1);
+
+        if (bytesRead <= 0)
+            reader->eof = 1;
+        else
+            reader->end += bytesRead;
+    }
+}
+
+
+int NextSnapshotEntry(SnapshotReader *reader)
+{
+    if (reader->format == SNAPSHOT_FORMAT_BINARY)
+        return NextBinarySnapshotEntry(reader);
+
+    char *line;
+
+    //Skipping the blank lines separating the entries
+    while ((line = ReadSnapshotLine(reader)) != NULL && line[0] == '\0')
+        ;
+
+    if (!line)
+        return 0;
+
+    //Every entry is four lines: path, size, permissions and hard links
+    if (strncmp(line, "Path: ", 6) != 0)
+        return -1;
+
+    reader->entryOffset = reader->bufferOffset + (line - reader->buffer);
+
+    //Keeping the previous path to check the order, the new one goes into the other buffer
+    char *swapPath = reader->previousPath;
+    size_t swapCapacity = reader->previousCapacity;
+    reader->previousPath = reader->entry.path;
+    reader->previousCapacity = reader->pathCapacity;
+    reader->entry.path = swapPath;
+    reader->pathCapacity = swapCapacity;
+
+    size_t pathLength = strlen(line + 6);
+
+    if (pathLength + 1 > reader->pathCapacity)
+    {
+        char *newPath = realloc(reader->entry.path, pathLength + 1);
+
+        if (!newPath)
+            return -1;
+
+        reader->entry.path = newPath;
+        reader->pathCapacity = pathLength + 1;
+    }
+
+    memcpy(reader->entry.path, line + 6, pathLength + 1);
+
+    if (reader->previousPath && ComparePaths(reader->previousPath, reader->entry.path) >= 0)
+        return -1;
+
+    char *end;
+    line = ReadSnapshotLine(reader);
+
+    if (!line || strncmp(line, "Size: ", 6) != 0)
+        return -1;
+
+    reader->entry.size = strtoll(line + 6, &end, 10);
+
+    if (end == line + 6)
+        return -1;
+
+    line = ReadSnapshotLine(reader);
+
+    if (!line || strncmp(line, "Permissions: ", 13) != 0 || strlen(line) < 13 + 11)
+        return -1;
+
+    //Rebuilding the permission bits from the three "rwx" groups
+    reader->entry.mode = 0;
+
+    for (int i = 0, bit = 0; i < 11; i++)
+    {
+        if (i == 3 || i == 7)
+            continue;
+
+        if (line[13 + i] != '-')
+            reader->entry.mode |= 0400 >> bit;
+
+        bit++;
+    }
+
+    line = ReadSnapshotLine(reader);
+
+    if (!line || strncmp(line, "Hard Links: ", 12) != 0)
+        return -1;
+
+    reader->entry.hardLinks = strtol(line + 12, &end, 10);
+
+    if (end == line + 12)
+        return -1;
+
+    //Snapshots written with -H add a digest line, the blank line separating the entries is consumed otherwise
+    reader->entry.hashAlgorithm = HASH_NONE;
+    line = ReadSnapshotLine(reader);
+
+    if (line && strncmp(line, "Hash: ", 6) == 0)
+        return ParseDigest(line + 6, &reader->entry) == -1 ? -1 : 1;
+
+    return !line || line[0] == '\0' ? 1 : -1;
+}
+
+
+SnapshotWriter *OpenSnapshotWriter(int fd, int format, int hashAlgorithm)
+{
+    SnapshotWriter *writer = calloc(1, sizeof(SnapshotWriter));
+
+    if (!writer)
+        return NULL;
+
+    writer->format = format;
+    writer->hashAlgorithm = hashAlgorithm;
+
+    if (InitBufferedOutput(&writer->output, fd) == -1)
+    {
+        free(writer);
+        return NULL;
+    }
+
+    //A binary snapshot starts with its magic and version, the records follow right after
+    if (format == SNAPSHOT_FORMAT_BINARY)
+    {
+        BinaryHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, BINARY_SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = BINARY_SNAPSHOT_VERSION;
+        header.flags = hashAlgorithm & BINARY_HASH_FLAGS_MASK;
+
+        BufferedWrite(&writer->output, &header, sizeof(header));
+        writer->offset = sizeof(header);
+        writer->summarizeDirectories = 1;
+    }
+
+    return writer;
+}
+
+
+int WriteSnapshotEntry(SnapshotWriter *writer, const SnapshotEntry *entry)
+{
+    //Text entries are formatted once, straight into the output buffer
+    if (writer->format == SNAPSHOT_FORMAT_TEXT)
+    {
+        char permissions[10];
+        FormatPermissions(entry->mode, permissions);
+        BufferedPrintf(&writer->output, "Path: %s\nSize: %lld bytes\nPermissions: %.3s %.3s %.3s\nHard Links: %ld\n", entry->path, entry->size, permissions, permissions + 3, permissions + 6, entry->hardLinks);
+
+        if (entry->hashAlgorithm != HASH_NONE)
+        {
+            char digest[2 * HASH_MAX_DIGEST_SIZE + 1];
+            FormatDigest(entry->digest, HashDigestLength(entry->hashAlgorithm), digest);
+            BufferedPrintf(&writer->output, "Hash: %s:%s\n", HashAlgorithmName(entry->hashAlgorithm), digest);
+        }
+
+        BufferedWrite(&writer->output, "\n", 1);
+        writer->numEntries++;
+        return 0;
+    }
+
+    //The subtrees this record closes get their summary before the record is placed
+    //A record left out would break the prefix compression of the next ones, the whole snapshot is marked as failed
+    if (writer->summarizeDirectories && SummarizeDirectoryEntry(writer, entry) == -1)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for entry \"%s\"\n", entry->path);
+        writer->output.failed = 1;
+        return -1;
+    }
+
+    size_t pathLength = strlen(entry->path);
+    size_t sharedLength = 0;
+
+    //Every few records the full path is stored and its offset goes to the index, the others only keep what differs from the record before
+    if (writer->numEntries % BINARY_RESTART_INTERVAL == 0)
+    {
+        if (writer->numRestarts == writer->restartCapacity)
+        {
+            size_t newCapacity = writer->restartCapacity ? writer->restartCapacity * 2 : 1024;
+            uint64_t *newOffsets = realloc(writer->restartOffsets, newCapacity * sizeof(uint64_t));
+
+            if (!newOffsets)
+            {
+                fprintf(stderr, "Error: Memory allocation failed for entry \"%s\"\n", entry->path);
+                writer->output.failed = 1;
+                return -1;
+            }
+
+            writer->restartOffsets = newOffsets;
+            writer->restartCapacity = newCapacity;
+        }
+
+        writer->restartOffsets[writer->numRestarts++] = writer->offset;
+    }
+    else
+    {
+        while (sharedLength < writer->previousLength && sharedLength < pathLength && writer->previousPath[sharedLength] == entry->path[sharedLength])
+            sharedLength++;
+    }
+
+    BinaryRecord record;
+    record.size = entry->size;
+    record.hardLinks = entry->hardLinks;
+    record.mode = entry->mode;
+    record.sharedLength = sharedLength;
+    record.suffixLength = pathLength - sharedLength;
+    record.reserved = 0;
+
+    //The suffix keeps its terminator so restart paths can be compared in place, records stay 8 byte aligned
+    size_t digestLength = HashDigestLength(writer->hashAlgorithm);
+    size_t recordLength = sizeof(record) + digestLength + record.suffixLength + 1;
+    size_t padding = (8 - recordLength % 8) % 8;
+    static const char zeros[HASH_MAX_DIGEST_SIZE];
+
+    BufferedWrite(&writer->output, &record, sizeof(record));
+
+    //Entries without a digest of this hash function, like directories, store zeros
+    if (digestLength)
+        BufferedWrite(&writer->output, entry->hashAlgorithm == writer->hashAlgorithm ? (const char *)entry->digest : zeros, digestLength);
+
+    BufferedWrite(&writer->output, entry->path + sharedLength, record.suffixLength + 1);
+    BufferedWrite(&writer->output, zeros, padding);
+    writer->offset += recordLength + padding;
+
+    //Remembering the path for the prefix of the next record
+    if (pathLength + 1 > writer->previousCapacity)
+    {
+        char *newPath = realloc(writer->previousPath, pathLength + 1);
+
+        if (!newPath)
+        {
+            fprintf(stderr, "Error: Memory allocation failed for entry \"%s\"\n", entry->path);
+            writer->output.failed = 1;
+            return -1;
+        }
+
+        writer->previousPath = newPath;
+        writer->previousCapacity = pathLength + 1;
+    }
+
+    memcpy(writer->previousPath, entry->path, pathLength + 1);
+    writer->previousLength = pathLength;
+    writer->numEntries++;
+    return 0;
+}
+
+
+int SummarizeDirectoryEntry(SnapshotWriter *writer, const SnapshotEntry *entry)
+{
+    size_t pathLength = strlen(entry->path);
+
+    //Directories whose subtree this entry is not part of are complete, entries come in path order
+    while (writer->numOpenDirs > 0)
+    {
+        const OpenDirectory *innermost = &writer->openDirs[writer->numOpenDirs - 1];
+
+        if (pathLength > innermost->pathLength && entry->path[innermost->pathLength] == '/' && memcmp(entry->path, writer->openDirPath, innermost->pathLength) == 0)
+            break;
+
+        CloseOpenDirectory(writer);
+    }
+
+    const char *name = strrchr(entry->path, '/') ? strrchr(entry->path, '/') + 1 : entry->path;
+    uint64_t recordHash = HashEntryRecord(entry, name);
+
+    //Other entries count towards the directory they are in right away
+    if (!S_ISDIR(entry->mode))
+    {
+        if (writer->numOpenDirs > 0)
+            writer->openDirs[writer->numOpenDirs - 1].childrenHash = MixTreeHash(writer->openDirs[writer->numOpenDirs - 1].childrenHash, recordHash);
+
+        return 0;
+    }
+
+    if (writer->numSummaries == writer->summaryCapacity)
+    {
+        size_t newCapacity = writer->summaryCapacity ? writer->summaryCapacity * 2 : 256;
+        DirectorySummary *newSummaries = realloc(writer->summaries, newCapacity * sizeof(DirectorySummary));
+
+        if (!newSummaries)
+            return -1;
+
+        writer->summaries = newSummaries;
+        writer->summaryCapacity = newCapacity;
+    }
+
+    if (writer->numOpenDirs == writer->openDirCapacity)
+    {
+        size_t newCapacity = writer->openDirCapacity ? writer->openDirCapacity * 2 : 32;
+        OpenDirectory *newOpenDirs = realloc(writer->openDirs, newCapacity * sizeof(OpenDirectory));
+
+        if (!newOpenDirs)
+            return -1;
+
+        writer->openDirs = newOpenDirs;
+        writer->openDirCapacity = newCapacity;
+    }
+
+    //The path of every open directory is a prefix of the innermost one, a single buffer holds them all
+    if (pathLength + 1 > writer->openDirPathCapacity)
+    {
+        char *newPath = realloc(writer->openDirPath, pathLength + 1);
+
+        if (!newPath)
+            return -1;
+
+        writer->openDirPath = newPath;
+        writer->openDirPathCapacity = pathLength + 1;
+    }
+
+    memcpy(writer->openDirPath, entry->path, pathLength + 1);
+
+    DirectorySummary *summary = &writer->summaries[writer->numSummaries];
+    summary->recordOffset = writer->offset;
+    summary->subtreeEnd = 0;
+    summary->mtime = entry->mtime;
+    summary->ctime = entry->ctime;
+    summary->treeHash = 0;
+
+    OpenDirectory *dir = &writer->openDirs[writer->numOpenDirs++];
+    dir->pathLength = pathLength;
+    dir->summaryIndex = writer->numSummaries++;
+    dir->childrenHash = XXH64_PRIME5;
+    dir->recordHash = recordHash;
+    return 0;
+}
+
+
+void CloseOpenDirectory(SnapshotWriter *writer)
+{
+    OpenDirectory *dir = &writer->openDirs[--writer->numOpenDirs];
+    DirectorySummary *summary = &writer->summaries[dir->summaryIndex];
+
+    //The next record is the first one after the subtree
+    summary->subtreeEnd = writer->offset;
+    summary->treeHash = dir->childrenHash;
+
+    //The parent sees the directory as its own record combined with its whole subtree
+    if (writer->numOpenDirs > 0)
+        writer->openDirs[writer->numOpenDirs - 1].childrenHash = MixTreeHash(writer->openDirs[writer->numOpenDirs - 1].childrenHash, MixTreeHash(dir->recordHash, summary->treeHash));
+}
+
+
+uint64_t HashEntryRecord(const SnapshotEntry *entry, const char *name)
+{
+    Xxh64State state;
+    unsigned char digest[8];
+    uint64_t fields[4] = {(uint64_t)entry->size, entry->mode, (uint64_t)entry->hardLinks, (uint64_t)entry->hashAlgorithm};
+
+    //Everything the compare looks at: the name, the recorded fields and the content digest
+    Xxh64Init(&state);
+    Xxh64Update(&state, (const unsigned char *)name, strlen(name) + 1);
+    Xxh64Update(&state, (const unsigned char *)fields, sizeof(fields));
+
+    if (entry->hashAlgorithm != HASH_NONE)
+        Xxh64Update(&state, entry->digest, HashDigestLength(entry->hashAlgorithm));
+
+    Xxh64Final(&state, digest);
+
+    uint64_t hash = 0;
+
+    for (int i = 0; i < 8; i++)
+        hash = hash << 8 | digest[i];
+
+    return hash;
+}
+
+
+uint64_t MixTreeHash(uint64_t hash, uint64_t value)
+{
+    //Order dependent, the children of a directory are always combined in path order
+    return RotateLeft64(hash ^ Xxh64Round(0, value), 27) * XXH64_PRIME1 + XXH64_PRIME4;
+}
+
+
+int CloseSnapshotWriter(SnapshotWriter *writer)
+{
+    //Letting the writer thread drain the ring before the footer is added
+    if (writer->ring)
+    {
+        atomic_store_explicit(&writer->closing, 1, memory_order_release);
+        pthread_join(writer->thread, NULL);
+        free(writer->ring);
+        writer->ring = NULL;
+    }
+
+    //A binary snapshot ends with the offsets of its restart records and a footer locating them
+    if (writer->format == SNAPSHOT_FORMAT_BINARY)
+    {
+        //The directories still open end with the records, their summaries come next, located by a trailer
+        while (writer->numOpenDirs > 0)
+            CloseOpenDirectory(writer);
+
+        DirectoryTableTrailer trailer = {writer->offset, writer->numSummaries};
+        BufferedWrite(&writer->output, writer->summaries, writer->numSummaries * sizeof(DirectorySummary));
+        BufferedWrite(&writer->output, &trailer, sizeof(trailer));
+        writer->offset += writer->numSummaries * sizeof(DirectorySummary) + sizeof(trailer);
+
+        BinaryFooter footer;
+        memset(&footer, 0, sizeof(footer));
+        footer.indexOffset = writer->offset;
+        footer.numRestarts = writer->numRestarts;
+        footer.numEntries = writer->numEntries;
+        footer.restartInterval = BINARY_RESTART_INTERVAL;
+        footer.version = BINARY_SNAPSHOT_VERSION;
+        memcpy(footer.magic, BINARY_SNAPSHOT_MAGIC, sizeof(footer.magic));
+
+        BufferedWrite(&writer->output, writer->restartOffsets, writer->numRestarts * sizeof(uint64_t));
+        BufferedWrite(&writer->output, &footer, sizeof(footer));
+    }
+
+    FlushBufferedOutput(&writer->output);
+    int status = writer->output.failed ? -1 : 0;
+
+    //Only the data has to be durable, one fdatasync once the whole snapshot is out
+    if (syncSnapshots && status == 0 && fdatasync(writer->output.fd) == -1)
+        status = -1;
+
+    FreeBufferedOutput(&writer->output);
+    free(writer->previousPath);
+    free(writer->restartOffsets);
+    free(writer->summaries);
+    free(writer->openDirs);
+    free(writer->openDirPath);
+    free(writer);
+    return status;
+}
+
+
+int StartSnapshotWriterThread(SnapshotWriter *writer)
+{
+    writer->ring = malloc(WRITER_RING_SIZE * sizeof(EntryRecord));
+
+    if (!writer->ring)
+        return -1;
+
+    atomic_init(&writer->ringHead, 0);
+    atomic_init(&writer->ringTail, 0);
+    atomic_init(&writer->closing, 0);
+    atomic_init(&writer->failed, 0);
+
+    //Without a thread the entries are formatted by the caller like before
+    if (pthread_create(&writer->thread, NULL, SnapshotWriterMain, writer) != 0)
+    {
+        free(writer->ring);
+        writer->ring = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int PushEntryRecord(SnapshotWriter *writer, const char *entryPath, const struct stat *st, const unsigned char *digest)
+{
+    size_t tail = atomic_load_explicit(&writer->ringTail, memory_order_relaxed);
+    int spins = 0;
+
+    //An entry the writer thread could not write ends the snapshot, like a failed write on the synchronous path
+    if (atomic_load_explicit(&writer->failed, memory_order_acquire))
+        return -1;
+
+    //Ring full: the traversal waits for the writer thread to free a slot
+    while (tail - atomic_load_explicit(&writer->ringHead, memory_order_acquire) == WRITER_RING_SIZE)
+        WaitForRing(&spins);
+
+    EntryRecord *record = &writer->ring[tail & (WRITER_RING_SIZE - 1)];
+    size_t pathLength = strlen(entryPath);
+
+    record->size = st->st_size;
+    record->mode = st->st_mode;
+    record->hardLinks = st->st_nlink;
+    record->mtime = StatNanoseconds(&st->st_mtim);
+    record->ctime = StatNanoseconds(&st->st_ctim);
+    record->hasDigest = digest != NULL;
+    record->longPath = NULL;
+
+    if (digest)
+        memcpy(record->digest, digest, HashDigestLength(hashAlgorithm));
+
+    if (pathLength < sizeof(record->path))
+        memcpy(record->path, entryPath, pathLength + 1);
+    else if (!(record->longPath = strdup(entryPath)))
+    {
+        fprintf(stderr, "Error: Memory allocation failed for entry \"%s\"\n", basename((char *)entryPath));
+        return -1;
+    }
+
+    //Publishing the slot, the release store makes its content visible to the writer thread
+    atomic_store_explicit(&writer->ringTail, tail + 1, memory_order_release);
+    return 0;
+}
+
+
+void *SnapshotWriterMain(void *arg)
+{
+    SnapshotWriter *writer = arg;
+    size_t head = atomic_load_explicit(&writer->ringHead, memory_order_relaxed);
+    int spins = 0;
+
+    while (1)
+    {
+        size_t tail = atomic_load_explicit(&writer->ringTail, memory_order_acquire);
+
+        if (head == tail)
+        {
+            //The closing flag is only trusted once the ring was seen empty after it was set
+            if (atomic_load_explicit(&writer->closing, memory_order_acquire) && head == atomic_load_explicit(&writer->ringTail, memory_order_acquire))
+                break;
+
+            WaitForRing(&spins);
+            continue;
+        }
+
+        spins = 0;
+
+        //Formatting every published record, the slots are handed back as a batch
+        for (; head != tail; head++)
+        {
+            EntryRecord *record = &writer->ring[head & (WRITER_RING_SIZE - 1)];
+            SnapshotEntry entry;
+
+            entry.path = record->longPath ? record->longPath : record->path;
+            entry.size = record->size;
+            entry.mode = record->mode;
+            entry.hardLinks = record->hardLinks;
+            entry.mtime = record->mtime;
+            entry.ctime = record->ctime;
+            entry.hashAlgorithm = record->hasDigest ? hashAlgorithm : HASH_NONE;
+
+            if (record->hasDigest)
+                memcpy(entry.digest, record->digest, HashDigestLength(hashAlgorithm));
+
+            //A record that could not be written would leave the next ones compressed against the wrong path.
+            //Nothing more is written, the slots are still handed back so the traversal never waits on a full ring.
+            if (!atomic_load_explicit(&writer->failed, memory_order_relaxed) && WriteSnapshotEntry(writer, &entry) == -1)
+                atomic_store_explicit(&writer->failed, 1, memory_order_release);
+
+            free(record->longPath);
+        }
+
+        atomic_store_explicit(&writer->ringHead, head, memory_order_release);
+    }
+
+    return NULL;
+}
+
+
+void WaitForRing(int *spins)
+{
+    //Spinning briefly, then yielding, then sleeping so an idle side does not burn a core
+    if (*spins < 64)
+        ;
+    else if (*spins < 128)
+        sched_yield();
+    else
+    {
+        struct timespec pause = {0, 20000};
+        nanosleep(&pause, NULL);
+    }
+
+    (*spins)++;
+}
+
+int OpenBinarySnapshot(SnapshotReader *reader)
+{
+    struct stat st;
+
+    if (fstat(reader->fd, &st) == -1 || (size_t)st.st_size < sizeof(BinaryHeader) + sizeof(BinaryFooter))
+        return -1;
+
+    //The whole file is mapped, records are decoded in place without any read calls
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+
+    if (mapping == MAP_FAILED)
+        return -1;
+
+    reader->mapping = mapping;
+    reader->mappingSize = st.st_size;
+    madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+
+    //Checking the footer before trusting any offset stored in the file
+    BinaryFooter footer;
+    memcpy(&footer, reader->mapping + reader->mappingSize - sizeof(footer), sizeof(footer));
+
+    if (CheckBinaryFooter(&footer, reader->mappingSize) == -1)
+        return -1;
+
+    //The header flags name the hash function of the digest stored in every record, none before version 2
+    BinaryHeader header;
+    memcpy(&header, reader->mapping, sizeof(header));
+    reader->hashAlgorithm = footer.version >= 2 ? (int)(header.flags & BINARY_HASH_FLAGS_MASK) : HASH_NONE;
+    reader->digestLength = HashDigestLength(reader->hashAlgorithm);
+    reader->recordSize = footer.version >= 4 ? sizeof(BinaryRecord) : sizeof(LegacyBinaryRecord);
+
+    if (footer.version >= 2 && (header.flags & ~BINARY_HASH_FLAGS_MASK || (reader->hashAlgorithm != HASH_NONE && !reader->digestLength)))
+        return -1;
+
+    reader->format = SNAPSHOT_FORMAT_BINARY;
+    reader->position = sizeof(BinaryHeader);
+    reader->recordsEnd = footer.indexOffset;
+
+    //From version 3 the records end with the directory summaries and their trailer
+    if (footer.version >= 3)
+    {
+        DirectoryTableTrailer trailer;
+
+        if (footer.indexOffset < sizeof(BinaryHeader) + sizeof(trailer))
+            return -1;
+
+        memcpy(&trailer, reader->mapping + footer.indexOffset - sizeof(trailer), sizeof(trailer));
+
+        if (trailer.offset < sizeof(BinaryHeader) || trailer.offset % 8 != 0 || trailer.offset > footer.indexOffset - sizeof(trailer) ||
+            trailer.numDirectories != (footer.indexOffset - sizeof(trailer) - trailer.offset) / sizeof(DirectorySummary) ||
+            trailer.offset + trailer.numDirectories * sizeof(DirectorySummary) + sizeof(trailer) != footer.indexOffset)
+            return -1;
+
+        reader->recordsEnd = trailer.offset;
+        reader->directories = (const DirectorySummary *)(reader->mapping + trailer.offset);
+        reader->numDirectories = trailer.numDirectories;
+    }
+    reader->numRestarts = footer.numRestarts;
+    reader->restartOffsets = (const uint64_t *)(reader->mapping + footer.indexOffset);
+    reader->numEntries = footer.numEntries;
+    return 0;
+}
+
+
+int CheckBinaryFooter(const BinaryFooter *footer, uint64_t fileSize)
+{
+    if (fileSize < sizeof(BinaryHeader) + sizeof(BinaryFooter) || memcmp(footer->magic, BINARY_SNAPSHOT_MAGIC, sizeof(footer->magic)) != 0 ||
+        footer->version < 1 || footer->version > BINARY_SNAPSHOT_VERSION || footer->indexOffset < sizeof(BinaryHeader) || footer->indexOffset % 8 != 0 ||
+        footer->indexOffset > fileSize - sizeof(BinaryFooter) ||
+        footer->numRestarts > (fileSize - sizeof(BinaryFooter) - footer->indexOffset) / sizeof(uint64_t) ||
+        footer->indexOffset + footer->numRestarts * sizeof(uint64_t) + sizeof(BinaryFooter) != fileSize)
+        return -1;
+
+    //Every record takes at least its fixed part, a count beyond that cannot come from this file
+    if (footer->numEntries > (footer->indexOffset - sizeof(BinaryHeader)) / (footer->version >= 4 ? sizeof(BinaryRecord) : sizeof(LegacyBinaryRecord)))
+        return -1;
+
+    return 0;
+}
+
+
+int NextBinarySnapshotEntry(SnapshotReader *reader)
+{
+    if (reader->position >= reader->recordsEnd)
+        return 0;
+
+    if (reader->recordsEnd - reader->position < reader->recordSize + reader->digestLength)
+        return -1;
+
+    BinaryRecord record;
+    DecodeBinaryRecord(reader, reader->position, &record);
+
+    //A record can only reuse the path it follows and must fit before the index
+    if (record.sharedLength > reader->pathLength || record.suffixLength >= reader->recordsEnd - reader->position - reader->recordSize - reader->digestLength)
+        return -1;
+
+    const unsigned char *digest = reader->mapping + reader->position + reader->recordSize;
+    const char *suffix = (const char *)digest + reader->digestLength;
+
+    //Like the text reader, an entry that does not come after the one before it means a corrupted file.
+    //Both share the first sharedLength bytes, the rest of the previous path is still in place.
+    if (suffix[record.suffixLength] != '\0' || (reader->pathLength > 0 && ComparePaths(reader->entry.path + record.sharedLength, suffix) >= 0))
+        return -1;
+
+    //A digest of zeros stands for an entry that was not hashed
+    reader->entry.hashAlgorithm = HASH_NONE;
+
+    for (size_t i = 0; i < reader->digestLength; i++)
+    {
+        if (digest[i])
+        {
+            reader->entry.hashAlgorithm = reader->hashAlgorithm;
+            memcpy(reader->entry.digest, digest, reader->digestLength);
+            break;
+        }
+    }
+
+    size_t pathLength = (size_t)record.sharedLength + record.suffixLength;
+
+    if (pathLength + 1 > reader->pathCapacity)
+    {
+        char *newPath = realloc(reader->entry.path, pathLength + 1);
+
+        if (!newPath)
+            return -1;
+
+        reader->entry.path = newPath;
+        reader->pathCapacity = pathLength + 1;
+    }
+
+    //Rebuilding the path on top of the shared prefix left by the previous record
+    memcpy(reader->entry.path + record.sharedLength, suffix, record.suffixLength);
+    reader->entry.path[pathLength] = '\0';
+    reader->pathLength = pathLength;
+
+    reader->entry.size = record.size;
+    reader->entry.mode = record.mode;
+    reader->entry.hardLinks = record.hardLinks;
+
+    //Directories carry their timestamps and subtree hash in the summary table
+    reader->summary = S_ISDIR(record.mode) ? FindDirectorySummary(reader, reader->position) : NULL;
+    reader->entry.mtime = reader->summary ? reader->summary->mtime : 0;
+    reader->entry.ctime = reader->summary ? reader->summary->ctime : 0;
+
+    size_t recordLength = reader->recordSize + reader->digestLength + record.suffixLength + 1;
+    reader->position += recordLength + (8 - recordLength % 8) % 8;
+    return 1;
+}
+
+
+void DecodeBinaryRecord(const SnapshotReader *reader, uint64_t offset, BinaryRecord *record)
+{
+    if (reader->recordSize == sizeof(BinaryRecord))
+    {
+        memcpy(record, reader->mapping + offset, sizeof(*record));
+        return;
+    }
+
+    //Records before version 4 are widened on the way in
+    LegacyBinaryRecord legacy;
+    memcpy(&legacy, reader->mapping + offset, sizeof(legacy));
+
+    record->size = legacy.size;
+    record->hardLinks = legacy.hardLinks;
+    record->mode = legacy.mode;
+    record->sharedLength = legacy.sharedLength;
+    record->suffixLength = legacy.suffixLength;
+    record->reserved = 0;
+}
+
+
+const DirectorySummary *FindDirectorySummary(const SnapshotReader *reader, uint64_t recordOffset)
+{
+    //The table is in record order, a binary search finds the summary of a record
+    size_t low = 0, high = reader->numDirectories;
+
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+
+        if (reader->directories[middle].recordOffset < recordOffset)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low < reader->numDirectories && reader->directories[low].recordOffset == recordOffset ? &reader->directories[low] : NULL;
+}
+
+
+int SkipSnapshotSubtree(SnapshotReader *reader)
+{
+    //Only directories with a summary can be skipped
+    if (!reader->summary || reader->summary->subtreeEnd < reader->position || reader->summary->subtreeEnd > reader->recordsEnd)
+        return 0;
+
+    //The record after the subtree shares at most the path of the directory, which is still the current path
+    reader->position = reader->summary->subtreeEnd;
+    reader->summary = NULL;
+    return 1;
+}
+
+
+long long StatNanoseconds(const struct timespec *time)
+{
+    return (long long)time->tv_sec * 1000000000LL + time->tv_nsec;
+}
+
+
+int SeekSnapshotReader(SnapshotReader *reader, const char *path)
+{
+    //Binary snapshots carry their path index, text ones have it next to them once OpenTextSnapshotIndex found or built it
+    if (reader->format != SNAPSHOT_FORMAT_BINARY)
+        return reader->indexMapping ? SeekTextSnapshotReader(reader, path) : -1;
+
+    //Binary search for the last restart record whose full path does not come after the wanted one
+    size_t low = 0, high = reader->numRestarts;
+
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        uint64_t offset = reader->restartOffsets[middle];
+
+        if (offset < sizeof(BinaryHeader) || offset + reader->recordSize + reader->digestLength >= reader->recordsEnd)
+            return -1;
+
+        const char *restartPath = (const char *)reader->mapping + offset + reader->recordSize + reader->digestLength;
+
+        if (ComparePaths(restartPath, path) <= 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    reader->position = low ? reader->restartOffsets[low - 1] : sizeof(BinaryHeader);
+    reader->pathLength = 0;
+
+    //Scanning at most one restart interval to the first entry at or after the path
+    int status;
+
+    while ((status = NextBinarySnapshotEntry(reader)) > 0)
+    {
+        if (ComparePaths(reader->entry.path, path) >= 0)
+            return 1;
+    }
+
+    return status;
+}
+
+
+int DumpSnapshot(const char *snapshotFile, const char *lookupPath)
+{
+    SnapshotReader reader;
+
+    if (OpenSnapshotReader(&reader, snapshotFile) == -1)
+    {
+        fprintf(stderr, "Error: Failed to open snapshot file \"%s\"\n", snapshotFile);
+        return EXIT_FAILURE;
+    }
+
+    SnapshotWriter *writer = OpenSnapshotWriter(STDOUT_FILENO, SNAPSHOT_FORMAT_TEXT, HASH_NONE);
+
+    if (!writer)
+    {
+        CloseSnapshotReader(&reader);
+        return EXIT_FAILURE;
+    }
+
+    int status;
+
+    //With a path only that entry is looked up through the index, otherwise the whole snapshot is converted to text
+    if (lookupPath && reader.format != SNAPSHOT_FORMAT_BINARY && OpenTextSnapshotIndex(&reader, snapshotFile) == -1)
+    {
+        fprintf(stderr, "Error: No path index could be built for \"%s\"\n", snapshotFile);
+        status = -2;
+    }
+    else if (lookupPath)
+    {
+        status = SeekSnapshotReader(&reader, lookupPath);
+
+        if (status > 0 && strcmp(reader.entry.path, lookupPath) == 0)
+            WriteSnapshotEntry(writer, &reader.entry);
+        else if (status >= 0)
+        {
+            fprintf(stderr, "Error: \"%s\" is not in snapshot \"%s\"\n", lookupPath, snapshotFile);
+            status = -2;
+        }
+    }
+    else
+    {
+        while ((status = NextSnapshotEntry(&reader)) > 0)
+            WriteSnapshotEntry(writer, &reader.entry);
+    }
+
+    if (status == -1 && reader.format == SNAPSHOT_FORMAT_BINARY)
+        fprintf(stderr, "Error: Snapshot \"%s\" is malformed\n", snapshotFile);
+
+    CloseSnapshotWriter(writer);
+    CloseSnapshotReader(&reader);
+    return status < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int OpenTextSnapshotIndex(SnapshotReader *reader, const char *snapshotFile)
+{
+    char indexFile[PATH_MAX + 8];
+    struct stat st;
+
+    if (reader->format != SNAPSHOT_FORMAT_TEXT || fstat(reader->fd, &st) == -1)
+        return -1;
+
+    snprintf(indexFile, sizeof(indexFile), "%s%s", snapshotFile, TEXT_INDEX_SUFFIX);
+
+    //The index is built by the first lookup that needs it, and again if the snapshot it describes was replaced
+    if (MapTextSnapshotIndex(reader, indexFile, &st) == 0)
+        return 0;
+
+    if (BuildTextSnapshotIndex(snapshotFile, indexFile, &st) == -1)
+        return -1;
+
+    return MapTextSnapshotIndex(reader, indexFile, &st);
+}
+
+
+int MapTextSnapshotIndex(SnapshotReader *reader, const char *indexFile, const struct stat *snapshotSt)
+{
+    int fd = open(indexFile, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fd == -1)
+        return -1;
+
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(TextIndexHeader) + 1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED)
+        return -1;
+
+    //Checking the header before trusting any offset, the last byte terminates the last path so every path ends inside the file
+    const unsigned char *data = mapping;
+    TextIndexHeader header;
+    memcpy(&header, data, sizeof(header));
+
+    if (memcmp(header.magic, TEXT_INDEX_MAGIC, sizeof(header.magic)) != 0 || header.version != TEXT_INDEX_VERSION ||
+        header.snapshotSize != (uint64_t)snapshotSt->st_size || header.snapshotMtime != StatNanoseconds(&snapshotSt->st_mtim) ||
+        header.numRestarts > ((size_t)st.st_size - sizeof(header)) / sizeof(TextIndexRecord) || data[st.st_size - 1] != '\0')
+    {
+        munmap(mapping, st.st_size);
+        return -1;
+    }
+
+    reader->indexMapping = data;
+    reader->indexMappingSize = st.st_size;
+    reader->textRestarts = (const TextIndexRecord *)(data + sizeof(header));
+    reader->numRestarts = header.numRestarts;
+    reader->numEntries = header.numEntries;
+    return 0;
+}
+
+
+int BuildTextSnapshotIndex(const char *snapshotFile, const char *indexFile, const struct stat *snapshotSt)
+{
+    SnapshotReader reader;
+
+    if (OpenSnapshotReader(&reader, snapshotFile) == -1)
+        return -1;
+
+    //Every 16th entry is indexed like the restart records of a binary snapshot, a lookup reads at most one interval of text
+    TextIndexRecord *records = NULL;
+    char *paths = NULL;
+    size_t numRecords = 0, recordCapacity = 0, pathsLength = 0, pathsCapacity = 0;
+    uint64_t numEntries = 0;
+    int status;
+
+    while ((status = NextSnapshotEntry(&reader)) > 0)
+    {
+        if (numEntries++ % BINARY_RESTART_INTERVAL != 0)
+            continue;
+
+        size_t pathLength = strlen(reader.entry.path) + 1;
+
+        if (numRecords == recordCapacity)
+        {
+            size_t newCapacity = recordCapacity ? recordCapacity * 2 : 1024;
+            TextIndexRecord *newRecords = realloc(records, newCapacity * sizeof(TextIndexRecord));
+
+            if (!newRecords)
+            {
+                status = -1;
+                break;
+            }
+
+            records = newRecords;
+            recordCapacity = newCapacity;
+        }
+
+        if (pathsLength + pathLength > pathsCapacity)
+        {
+            size_t newCapacity = pathsCapacity ? pathsCapacity : 64 * 1024;
+
+            while (newCapacity < pathsLength + pathLength)
+                newCapacity *= 2;
+
+            char *newPaths = realloc(paths, newCapacity);
+
+            if (!newPaths)
+            {
+                status = -1;
+                break;
+            }
+
+            paths = newPaths;
+            pathsCapacity = newCapacity;
+        }
+
+        records[numRecords].entryOffset = reader.entryOffset;
+        records[numRecords].pathOffset = pathsLength;
+        memcpy(paths + pathsLength, reader.entry.path, pathLength);
+        pathsLength += pathLength;
+        numRecords++;
+    }
+
+    CloseSnapshotReader(&reader);
+
+    //An empty snapshot still gets its index, with a lone terminator standing for the paths
+    if (status == 0 && pathsLength == 0 && !(paths = malloc(1)))
+        status = -1;
+
+    if (status == 0 && pathsLength == 0)
+        paths[pathsLength++] = '\0';
+
+    int fd = -1;
+    char tempFile[PATH_MAX + 32];
+    snprintf(tempFile, sizeof(tempFile), "%s.tmp.%d", indexFile, (int)getpid());
+
+    if (status == 0)
+    {
+        //The paths follow the records, their offsets are made relative to the start of the file
+        for (size_t i = 0; i < numRecords; i++)
+            records[i].pathOffset += sizeof(TextIndexHeader) + numRecords * sizeof(TextIndexRecord);
+
+        TextIndexHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, TEXT_INDEX_MAGIC, sizeof(header.magic));
+        header.version = TEXT_INDEX_VERSION;
+        header.restartInterval = BINARY_RESTART_INTERVAL;
+        header.snapshotSize = snapshotSt->st_size;
+        header.snapshotMtime = StatNanoseconds(&snapshotSt->st_mtim);
+        header.numEntries = numEntries;
+        header.numRestarts = numRecords;
+
+        //Written aside and renamed into place, a concurrent query sees either no index or a complete one
+        fd = open(tempFile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+        if (fd == -1 || WriteAll(fd, (const char *)&header, sizeof(header)) == -1 ||
+            WriteAll(fd, (const char *)records, numRecords * sizeof(TextIndexRecord)) == -1 || WriteAll(fd, paths, pathsLength) == -1 ||
+            close(fd) == -1 || rename(tempFile, indexFile) == -1)
+            status = -1;
+
+        if (status == -1 && fd != -1)
+            unlink(tempFile);
+    }
+
+    free(records);
+    free(paths);
+    return status;
+}
+
+
+int SeekQueryStart(SnapshotReader *reader, const char *snapshotFile, const char *path)
+{
+    //Text snapshots are searched through their sidecar index, built here on the first query
+    if (reader->format == SNAPSHOT_FORMAT_BINARY || OpenTextSnapshotIndex(reader, snapshotFile) == 0)
+        return SeekSnapshotReader(reader, path);
+
+    //Without an index (an output directory that is not writable) the snapshot is streamed from the start
+    fprintf(stderr, "Note: No path index could be built for \"%s\", reading the whole snapshot\n", snapshotFile);
+    int status;
+
+    while ((status = NextSnapshotEntry(reader)) > 0)
+    {
+        if (ComparePaths(reader->entry.path, path) >= 0)
+            return 1;
+    }
+
+    return status;
+}
+
+
+int InQuerySelection(const char *entryPath, const char *path, size_t pathLength, int mode)
+{
+    //Every selection is one contiguous run of the path order, starting at the first entry at or after the path
+    if (mode == QUERY_ENTRY)
+        return strcmp(entryPath, path) == 0;
+
+    if (strncmp(entryPath, path, pathLength) != 0)
+        return 0;
+
+    return mode == QUERY_PREFIX || entryPath[pathLength] == '\0' || entryPath[pathLength] == '/';
+}
+
+
+int QuerySnapshot(int argc, char *argv[])
+{
+    const char *usage = "Usage: ./Project query [-s | -p] [-d <older snapshot>] <snapshot> <path>\n";
+    const char *olderFile = NULL, *snapshotFile = NULL;
+    char *path = NULL;
+    int mode = QUERY_ENTRY;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-s") == 0)
+            mode = QUERY_SUBTREE;
+        else if (strcmp(argv[i], "-p") == 0)
+            mode = QUERY_PREFIX;
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+            olderFile = argv[++i];
+        else if (!snapshotFile)
+            snapshotFile = argv[i];
+        else if (!path)
+            path = argv[i];
+        else
+        {
+            fprintf(stderr, "%s", usage);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!snapshotFile || !path)
+    {
+        fprintf(stderr, "%s", usage);
+        return EXIT_FAILURE;
+    }
+
+    //A subtree is named by its directory, a trailing separator would sort after every path below it
+    size_t pathLength = strlen(path);
+
+    while (mode == QUERY_SUBTREE && pathLength > 1 && path[pathLength - 1] == '/')
+        path[--pathLength] = '\0';
+
+    SnapshotReader reader, olderReader;
+
+    if (OpenSnapshotReader(&reader, snapshotFile) == -1)
+    {
+        fprintf(stderr, "Error: Failed to open snapshot file \"%s\"\n", snapshotFile);
+        return EXIT_FAILURE;
+    }
+
+    if (olderFile && OpenSnapshotReader(&olderReader, olderFile) == -1)
+    {
+        fprintf(stderr, "Error: Failed to open snapshot file \"%s\"\n", olderFile);
+        CloseSnapshotReader(&reader);
+        return EXIT_FAILURE;
+    }
+
+    int status;
+    long long numResults = 0;
+
+    if (olderFile)
+    {
+        numResults = QueryChanges(&olderReader, olderFile, &reader, snapshotFile, path, mode);
+        status = numResults < 0 ? -1 : 1;
+        CloseSnapshotReader(&olderReader);
+    }
+    else
+    {
+        //The selected entries are written in the text format as they are found
+        SnapshotWriter *writer = OpenSnapshotWriter(STDOUT_FILENO, SNAPSHOT_FORMAT_TEXT, HASH_NONE);
+
+        if (!writer)
+        {
+            CloseSnapshotReader(&reader);
+            return EXIT_FAILURE;
+        }
+
+        for (status = SeekQueryStart(&reader, snapshotFile, path); status > 0 && InQuerySelection(reader.entry.path, path, pathLength, mode); status = NextSnapshotEntry(&reader))
+        {
+            WriteSnapshotEntry(writer, &reader.entry);
+            numResults++;
+        }
+
+        if (status == -1)
+            fprintf(stderr, "Error: Snapshot \"%s\" is malformed or not sorted by path\n", snapshotFile);
+
+        CloseSnapshotWriter(writer);
+    }
+
+    CloseSnapshotReader(&reader);
+
+    if (status == -1)
+        return EXIT_FAILURE;
+
+    //A path that is not in the snapshot is an error for a lookup, an empty listing is a valid answer otherwise
+    if (mode == QUERY_ENTRY && !olderFile && numResults == 0)
+    {
+        fprintf(stderr, "Error: \"%s\" is not in snapshot \"%s\"\n", path, snapshotFile);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+long long QueryChanges(SnapshotReader *olderReader, const char *olderFile, SnapshotReader *reader, const char *snapshotFile, const char *path, int mode)
+{
+    BufferedOutput changes;
+
+    if (InitBufferedOutput(&changes, STDOUT_FILENO) == -1)
+        return -1;
+
+    BufferedPrintf(&changes, "# kind\tfields\tpath\n");
+
+    //Both snapshots start at the selection, then the merge of CompareSnapshots runs until both sides leave it
+    size_t pathLength = strlen(path);
+    int olderStatus = SeekQueryStart(olderReader, olderFile, path);
+    int status = SeekQueryStart(reader, snapshotFile, path);
+    long long numChanges = 0;
+
+    while (1)
+    {
+        int olderIn = olderStatus > 0 && InQuerySelection(olderReader->entry.path, path, pathLength, mode);
+        int in = status > 0 && InQuerySelection(reader->entry.path, path, pathLength, mode);
+
+        if (!olderIn && !in)
+            break;
+
+        int order = !olderIn ? 1 : (!in ? -1 : ComparePaths(olderReader->entry.path, reader->entry.path));
+
+        if (order < 0)
+        {
+            BufferedPrintf(&changes, "removed\t-\t%s\n", olderReader->entry.path);
+            numChanges++;
+            olderStatus = NextSnapshotEntry(olderReader);
+        }
+        else if (order > 0)
+        {
+            BufferedPrintf(&changes, "added\t-\t%s\n", reader->entry.path);
+            numChanges++;
+            status = NextSnapshotEntry(reader);
+        }
+        else
+        {
+            char fields[512];
+
+            if (DescribeEntryChanges(&olderReader->entry, &reader->entry, fields, sizeof(fields)))
+            {
+                BufferedPrintf(&changes, "modified\t%s\t%s\n", fields, reader->entry.path);
+                numChanges++;
+            }
+
+            //Identical subtrees of binary snapshots are stepped over like in the compare of a run, never with SHA-256 digests
+            if (olderReader->summary && reader->summary && olderReader->summary->treeHash == reader->summary->treeHash &&
+                olderReader->hashAlgorithm != HASH_SHA256 && reader->hashAlgorithm != HASH_SHA256 &&
+                SkipSnapshotSubtree(olderReader))
+                SkipSnapshotSubtree(reader);
+
+            olderStatus = NextSnapshotEntry(olderReader);
+            status = NextSnapshotEntry(reader);
+        }
+    }
+
+    FlushBufferedOutput(&changes);
+    FreeBufferedOutput(&changes);
+
+    if (olderStatus == -1 || status == -1)
+    {
+        fprintf(stderr, "Error: Snapshot \"%s\" is malformed or not sorted by path\n", olderStatus == -1 ? olderFile : snapshotFile);
+        return -1;
+    }
+
+    return numChanges;
+}
+
+
+int SeekTextSnapshotReader(SnapshotReader *reader, const char *path)
+{
+    //Binary search for the last indexed entry whose path does not come after the wanted one
+    size_t low = 0, high = reader->numRestarts;
+
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        uint64_t pathOffset = reader->textRestarts[middle].pathOffset;
+
+        if (pathOffset < sizeof(TextIndexHeader) || pathOffset >= reader->indexMappingSize)
+            return -1;
+
+        if (ComparePaths((const char *)reader->indexMapping + pathOffset, path) <= 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    //Reading on from the indexed entry, the buffered text and the paths kept for the order check belong to the old position
+    uint64_t offset = low ? reader->textRestarts[low - 1].entryOffset : 0;
+
+    if (lseek(reader->fd, offset, SEEK_SET) == -1)
+        return -1;
+
+    reader->start = reader->end = 0;
+    reader->eof = 0;
+    reader->bufferOffset = offset;
+
+    free(reader->entry.path);
+    free(reader->previousPath);
+    reader->entry.path = reader->previousPath = NULL;
+    reader->pathCapacity = reader->previousCapacity = 0;
+
+    //Scanning at most one index interval to the first entry at or after the path
+    int status;
+
+    while ((status = NextSnapshotEntry(reader)) > 0)
+    {
+        if (ComparePaths(reader->entry.path, path) >= 0)
+            return 1;
+    }
+
+    return status;
+}
+
+
+int InitBufferedOutput(BufferedOutput *output, int fd)
+{
+    output->fd = fd;
+    output->failed = 0;
+    output->block = 0;
+    output->used = 0;
+    output->data = NULL;
+
+    if (fd == -1)
+        return 0;
+
+    output->data = malloc(OUTPUT_BLOCK_COUNT * OUTPUT_BLOCK_SIZE);
+
+    //Without a buffer nothing can be written, the output is discarded and reported as failed
+    if (!output->data)
+    {
+        output->fd = -1;
+        output->failed = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void FreeBufferedOutput(BufferedOutput *output)
+{
+    free(output->data);
+    output->data = NULL;
+}
+
+
+void NextOutputBlock(BufferedOutput *output)
+{
+    //Once every block is full they all go to the file in one writev call
+    output->blockUsed[output->block] = output->used;
+
+    if (output->block + 1 == OUTPUT_BLOCK_COUNT)
+    {
+        FlushBufferedOutput(output);
+        return;
+    }
+
+    output->block++;
+    output->used = 0;
+}
+
+
+void BufferedPrintf(BufferedOutput *output, const char *format, ...)
+{
+    //Without a destination the output is discarded, the callers still get the counts
+    if (output->fd == -1)
+        return;
+
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(output->data + output->block * OUTPUT_BLOCK_SIZE + output->used, OUTPUT_BLOCK_SIZE - output->used, format, args);
+    va_end(args);
+
+    if (length < 0)
+        return;
+
+    //Line did not fit: moving to the next block and formatting it again at its start
+    if ((size_t)length >= OUTPUT_BLOCK_SIZE - output->used)
+    {
+        NextOutputBlock(output);
+
+        va_start(args, format);
+        length = vsnprintf(output->data + output->block * OUTPUT_BLOCK_SIZE, OUTPUT_BLOCK_SIZE, format, args);
+        va_end(args);
+
+        //Longer than a whole block: writing it directly from a temporary copy
+        if ((size_t)length >= OUTPUT_BLOCK_SIZE)
+        {
+            char *line = malloc(length + 1);
+
+            if (line)
+            {
+                va_start(args, format);
+                vsnprintf(line, length + 1, format, args);
+                va_end(args);
+
+                FlushBufferedOutput(output);
+
+                if (WriteAll(output->fd, line, length) == -1)
+                    output->failed = 1;
+
+                free(line);
+            }
+            else
+                output->failed = 1;
+
+            return;
+        }
+    }
+
+    output->used += length;
+}
+
+
+void BufferedWrite(BufferedOutput *output, const void *data, size_t length)
+{
+    if (output->fd == -1)
+        return;
+
+    //Copying the data block by block, a full block is left for the next one
+    while (length > 0)
+    {
+        if (output->used == OUTPUT_BLOCK_SIZE)
+            NextOutputBlock(output);
+
+        size_t chunk = OUTPUT_BLOCK_SIZE - output->used < length ? OUTPUT_BLOCK_SIZE - output->used : length;
+        memcpy(output->data + output->block * OUTPUT_BLOCK_SIZE + output->used, data, chunk);
+
+        output->used += chunk;
+        data = (const char *)data + chunk;
+        length -= chunk;
+    }
+}
+
+
+void FlushBufferedOutput(BufferedOutput *output)
+{
+    if (output->fd == -1)
+        return;
+
+    struct iovec blocks[OUTPUT_BLOCK_COUNT];
+    int numBlocks = 0;
+
+    //Gathering the filled blocks, the current one included, into a single writev
+    output->blockUsed[output->block] = output->used;
+
+    for (int i = 0; i <= output->block; i++)
+    {
+        if (output->blockUsed[i] == 0)
+            continue;
+
+        blocks[numBlocks].iov_base = output->data + i * OUTPUT_BLOCK_SIZE;
+        blocks[numBlocks].iov_len = output->blockUsed[i];
+        numBlocks++;
+    }
+
+    if (numBlocks > 0 && WriteAllVector(output->fd, blocks, numBlocks) == -1)
+        output->failed = 1;
+
+    output->block = 0;
+    output->used = 0;
+}
+
+
+int WriteAllVector(int fd, struct iovec *blocks, int numBlocks)
+{
+    //writev may store less than asked, skipping what was written and retrying with the rest
+    while (numBlocks > 0)
+    {
+        ssize_t written = writev(fd, blocks, numBlocks);
+
+        AddStat(&runStats.writeCalls, 1);
+
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        AddStat(&runStats.bytesWritten, written);
+
+        while (numBlocks > 0 && (size_t)written >= blocks->iov_len)
+        {
+            written -= blocks->iov_len;
+            blocks++;
+            numBlocks--;
+        }
+
+        if (numBlocks > 0)
+        {
+            blocks->iov_base = (char *)blocks->iov_base + written;
+            blocks->iov_len -= written;
+        }
+    }
+
+    return 0;
+}
+
+
+int WriteAll(int fd, const char *data, size_t length)
+{
+    //write may store less than asked, looping until everything is out or an error occurs
+    while (length > 0)
+    {
+        ssize_t written = write(fd, data, length);
+
+        AddStat(&runStats.writeCalls, 1);
+
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        AddStat(&runStats.bytesWritten, written);
+
+        data += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+
+void CheckPermissionsAndAnalyze(const char *entryPath, struct stat filePermission, char *isolatedDir, int snapshotFd) 
+{
+    pid_t pid;
+    int pipe_fd[2];
+
+    // The benchmark times the traversal on its own
+    if (!analyzeEntries)
+        return;
+
+    // Apply the verdicts the analysis workers finished in the meantime
+    if (analysisPool)
+        DrainAnalysisResults(analysisPool, isolatedDir);
+
+    // Check if file has no access rights (read, write, execute)
+    if (!(filePermission.st_mode & S_IXUSR) && !(filePermission.st_mode & S_IRUSR) && !(filePermission.st_mode & S_IWUSR) &&
+        !(filePermission.st_mode & S_IRGRP) && !(filePermission.st_mode & S_IWGRP) && !(filePermission.st_mode & S_IXGRP) &&
+        !(filePermission.st_mode & S_IROTH) && !(filePermission.st_mode & S_IWOTH) && !(filePermission.st_mode & S_IXOTH)) 
+    {
+        // A file found safe before and not changed since is not analyzed again
+        if (verdictCache && LookupVerdictCache(verdictCache, &filePermission))
+        {
+            AddVerdictCacheRecord(verdictCache, &filePermission);
+            verdictCache->numReused++;
+            fprintf(stdout, "\"%s\" in \"%s\" is safe (unchanged since its last analysis).\n", basename((char *)entryPath), monitoredDirName);
+            return;
+        }
+
+        // A hard link of a file analyzed in this run (-U) gets its verdict, or waits for it
+        InodeRecord *sharedRecord;
+
+        if (CheckSharedAnalysis(entryPath, &filePermission, isolatedDir, &sharedRecord))
+            return;
+
+         // Print message indicating no access rights and perform syntactic analysis
+        fprintf(stdout, "No access rights for \"%s\" in \"%s\" => Performing Syntactic Analysis.\n", basename((char *)entryPath), monitoredDirName);
+
+        // The file is handed to the analysis workers and the traversal goes on, its verdict is applied once it comes back
+        if (analysisPool && SubmitAnalysisJob(analysisPool, entryPath, filePermission.st_mode, sharedRecord) == 0)
+            return;
+
+        // The built-in scanner runs in this process, no fork, pipe or shell is needed
+        if (!scanRules.useScript)
+        {
+            struct stat analyzedSt;
+            int verdict = AnalyzeEntry(entryPath, filePermission.st_mode, AnalysisDeadline(), &analyzedSt);
+
+            ApplyAnalysisVerdict(entryPath, isolatedDir, verdict, sharedRecord, &analyzedSt);
+            write(STDOUT_FILENO, "\n", 1);  // Write a newline to stdout
+            return;
+        }
+
+        // Create a pipe for inter-process communication with the process running the script
+        if (pipe(pipe_fd) == -1) 
+        {
+            // If pipe creation fails, print an error message and return
+            write(STDERR_FILENO, "Error: Pipe creation failed!\n", strlen("Error: Pipe creation failed!\n"));
+
+            if (sharedRecord)
+                SettleSharedAnalysis(sharedRecord, isolatedDir, -1);
+            return;
+        }
+
+        int fileStatus;
+        double analysisStart = MonotonicSeconds(); // The analysis runs in another process, only its wall time is counted
+        fflush(stdout); // Flush pending messages so the child does not print them a second time when it exits
+        pid = fork(); // Create a new process (child process)
+        numSubProcesses++; // Create a new process (child process)
+
+        if (pid == 0) 
+        {
+            // Child process: close unnecessary file descriptors and execute file analysis
+            close(snapshotFd); // Close the file descriptor associated with the snapshot
+            close(pipe_fd[0]); // Close the read end of the pipe
+
+            fileStatus = AnalyzeFile(entryPath, pipe_fd[1]); // Execute file analysis and write results to pipe
+
+            close(pipe_fd[1]); // Close the write end of the pipe
+            exit(fileStatus); // Exit the child process with the file analysis status
+        } 
+        else if (pid < 0) 
+        {
+            // Fork failed: print an error message and return
+            write(STDERR_FILENO, "Error: Fork failed for child process!\n", strlen("Error: Fork failed for child process!\n"));
+            close(pipe_fd[0]);
+            close(pipe_fd[1]);
+
+            if (sharedRecord)
+                SettleSharedAnalysis(sharedRecord, isolatedDir, -1);
+            return;
+        } 
+        else 
+        {
+            // Parent process: handle analysis result from the child process
+            HandleAnalysisResult(pipe_fd, entryPath, isolatedDir, pid, sharedRecord);
+
+            double duration = MonotonicSeconds() - analysisStart;
+            AddStat(&runStats.filesAnalyzed, 1);
+            AddStat(&runStats.analysisMicros, (long long)(duration * 1e6));
+            AddStat(&runStats.analysisLatency[LatencyBucket(duration)], 1);
+        }
+
+        // Print termination message for the subprocess
+        fprintf(stdout, "Subprocess %d.%d (PID: %d) terminated with exit code %d for \"%s\" in \"%s\"\n", numProcesses, numSubProcesses, getpid(), pid, basename((char *)entryPath), monitoredDirName);
+        write(STDOUT_FILENO, "\n", 1);  // Write a newline to stdout
+    }
+}
+
+
+int AnalyzeFile(const char *entryPath, int pipeFd) 
+{
+    struct stat before, after;
+
+    if (lstat(entryPath, &before) == -1)
+        before.st_mode = 0;
+
+    // Grant read permission through the pinned inode, so a path swapped for a symlink cannot redirect the chmod
+    struct stat pinnedSt;
+    int pinFd = PinAnalyzedFile(entryPath, before.st_mode ? &before : NULL, &pinnedSt);
+    int fileStatus = -1;
+
+    if (pinFd != -1)
+    {
+        ChmodPinnedFile(pinFd, S_IRUSR);
+
+        // Run the shell script analyzing the file for malicious content
+        fileStatus = RunAnalysisScript(entryPath, AnalysisDeadline());
+
+        ChmodPinnedFile(pinFd, 0); // Revoke read permission from the file
+        close(pinFd);
+    }
+
+    // The parent caches a safe verdict under the stat the file has once the script is done
+    StatAfterAnalysis(entryPath, &before, &after);
+
+    write(pipeFd, &fileStatus, sizeof(fileStatus)); // Write the exit status of the shell script to the pipe for communication with the parent process
+    write(pipeFd, &after, sizeof(after));
+    close(pipeFd); // Close the write end of the pipe
+
+    return fileStatus; // Return the exit status of the shell script (indicating analysis result)
+}
+
+void HandleAnalysisResult(int pipeFd[2], const char *entryPath, char *isolatedDir, pid_t pid, InodeRecord *record) 
+{
+    close(pipeFd[1]); // Close the write end of the pipe (not needed for reading)
+
+    // Read the analysis result (fileStatus) from the pipe
+    int fileStatus = -1;
+    struct stat analyzedSt;
+    read(pipeFd[0], &fileStatus, sizeof(fileStatus));
+
+    if (read(pipeFd[0], &analyzedSt, sizeof(analyzedSt)) != sizeof(analyzedSt))
+        analyzedSt.st_mode = 0;
+
+    close(pipeFd[0]); // Close the read end of the pipe after reading
+
+    waitpid(pid, NULL, 0); // Collect the analysis process so it does not stay a zombie
+
+    // Like the exit status of the script, any non zero result means the file is not safe, negative ones mean it was not analyzed
+    ApplyAnalysisVerdict(entryPath, isolatedDir, fileStatus < 0 ? fileStatus : fileStatus != 0, record, &analyzedSt);
+}
+
+
+void ApplyAnalysisVerdict(const char *entryPath, char *isolatedDir, int verdict, InodeRecord *record, const struct stat *analyzedSt)
+{
+    // In single-process mode (-U) the other paths of the file get the same verdict, even if this one is gone by now
+    if (record)
+        SettleSharedAnalysis(record, isolatedDir, verdict);
+
+    // Check the analysis result 
+    if (verdict > 0) 
+    {
+        // Move the corrupted/malicious file to the isolated directory, under a name no other quarantined file has
+        char quarantinedName[NAME_MAX + 1];
+        double quarantineStart = MonotonicSeconds();
+        int moved = QuarantineFile(entryPath, isolatedDir, quarantinedName, sizeof(quarantinedName));
+        AddStat(&runStats.quarantineMicros, (long long)((MonotonicSeconds() - quarantineStart) * 1e6));
+
+        numCorruptedFiles++; // Increment the count of corrupted/malicious files
+
+        if (moved == -1) 
+        {
+            fprintf(stderr, "Error: \"%s\" in \"%s\" is malicious or corrupted but could not be moved to the isolated directory\n", basename((char *)entryPath), monitoredDirName);
+            return;
+        }
+
+        AddStat(&runStats.filesQuarantined, 1);
+        
+        // Print a message indicating the file is malicious or corrupted and has been moved
+        fprintf(stdout, "\"%s\" in \"%s\" is malicious or corrupted => Moved to isolated directory as \"%s\".\n", basename((char *)entryPath), monitoredDirName, quarantinedName);
+    } 
+    else if (verdict == ANALYSIS_TIMED_OUT)
+    {
+        // The analysis took longer than the timeout, the file is left in place
+        fprintf(stderr, "Error: Analysis of \"%s\" in \"%s\" timed out\n", basename((char *)entryPath), monitoredDirName);
+    }
+    else if (verdict < 0)
+    {
+        // The file could not be read, it is left in place
+        fprintf(stderr, "Error: Failed to analyze \"%s\" in \"%s\"\n", basename((char *)entryPath), monitoredDirName);
+    }
+    else 
+    {
+        // Print a message indicating the file is safe
+        fprintf(stdout, "\"%s\" in \"%s\" is safe.\n", basename((char *)entryPath), monitoredDirName);
+
+        // Remembering the verdict under the stat taken where the file was analyzed, the analysis itself changed its ctime.
+        // Looking the file up now could pick up a write made after the scan and cache the new content as safe.
+        if (verdictCache && analyzedSt && analyzedSt->st_mode != 0)
+            AddVerdictCacheRecord(verdictCache, analyzedSt);
+    }
+}
+
+
+int QuarantineFile(const char *entryPath, const char *isolatedDir, char *quarantinedName, size_t nameSize)
+{
+    if (OpenQuarantine(isolatedDir) == -1)
+        return -1;
+
+    //The file is pinned once, the digest, the copy and the check before the move all see the same inode
+    struct stat pinnedSt;
+    int pinFd = PinAnalyzedFile(entryPath, NULL, &pinnedSt);
+
+    if (pinFd == -1)
+        return -1;
+
+    int status = QuarantinePinnedFile(entryPath, pinFd, &pinnedSt, quarantinedName, nameSize);
+
+    int savedErrno = errno;
+    close(pinFd);
+    errno = savedErrno;
+    return status;
+}
+
+
+int QuarantinePinnedFile(const char *entryPath, int pinFd, const struct stat *pinnedSt, char *quarantinedName, size_t nameSize)
+{
+    struct stat st = *pinnedSt;
+    const char *method = "rename";
+    char digestText[2 * HASH_MAX_DIGEST_SIZE + 1] = "-";
+    char *name = basename((char *)entryPath);
+
+    //Content addressed, the name is the SHA-256 of the file and a sample already kept is not stored again
+    if (contentAddressedQuarantine)
+    {
+        unsigned char digest[HASH_MAX_DIGEST_SIZE];
+
+        if (ContentAddress(pinFd, st.st_mode, digest) == -1)
+            return -1;
+
+        FormatDigest(digest, HashDigestLength(HASH_SHA256), digestText);
+        name = digestText;
+
+        struct stat existing;
+
+        if (fstatat(quarantine.dirFd, name, &existing, AT_SYMLINK_NOFOLLOW) == 0 && existing.st_size == st.st_size)
+        {
+            snprintf(quarantinedName, nameSize, "%s", name);
+            AddStat(&runStats.quarantineDuplicates, 1);
+            return FinishQuarantine(entryPath, 1, -1, "duplicate", &st, digestText, quarantinedName);
+        }
+    }
+
+    //The rename goes through the directory of the file, so the name checked against the pinned inode is the name moved
+    char directory[PATH_MAX];
+    snprintf(directory, sizeof(directory), "%s", entryPath);
+
+    int parentFd = open(dirname(directory), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (parentFd == -1)
+        return -1;
+
+    const char *entryName = strrchr(entryPath, '/') ? strrchr(entryPath, '/') + 1 : entryPath;
+    struct stat current;
+
+    if (fstatat(parentFd, entryName, &current, AT_SYMLINK_NOFOLLOW) == -1 || current.st_dev != st.st_dev || current.st_ino != st.st_ino)
+    {
+        //Another file now at the path was never analyzed, it is left in place
+        fprintf(stderr, "Error: \"%s\" was replaced after it was analyzed, the new file is left in place\n", entryPath);
+        close(parentFd);
+        errno = ESTALE;
+        return -1;
+    }
+
+    //A rename within the file system moves nothing but the directory entry, and never replaces a file already in quarantine
+    int status = MoveQuarantinedFile(parentFd, entryName, name, quarantinedName, nameSize);
+
+    int savedErrno = errno;
+    close(parentFd);
+    errno = savedErrno;
+
+    if (status == 0)
+        return FinishQuarantine(entryPath, 0, -1, method, &st, digestText, quarantinedName);
+
+    if (errno != EXDEV)
+        return -1;
+
+    //The isolated directory is on another file system, the pinned content is cloned or copied and the file removed once the copy is durable
+    int sourceFd = OpenPinnedFile(pinFd, O_RDONLY | O_CLOEXEC);
+
+    if (sourceFd == -1 && errno == EACCES && ChmodPinnedFile(pinFd, S_IRUSR) == 0)
+    {
+        sourceFd = OpenPinnedFile(pinFd, O_RDONLY | O_CLOEXEC);
+        ChmodPinnedFile(pinFd, st.st_mode & 07777);
+    }
+
+    if (sourceFd == -1)
+        return -1;
+
+    char tempName[NAME_MAX + 1];
+    snprintf(tempName, sizeof(tempName), ".quarantine.%d.tmp", getpid());
+    unlinkat(quarantine.dirFd, tempName, 0);
+
+    int copyFd = openat(quarantine.dirFd, tempName, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+    if (copyFd == -1)
+    {
+        close(sourceFd);
+        return -1;
+    }
+
+    status = CopyQuarantinedContent(sourceFd, copyFd, st.st_size, &method);
+    close(sourceFd);
+
+    //The copy keeps the mode of the original, a file without access rights stays without them
+    if (status == 0 && fchmod(copyFd, st.st_mode & 07777) == -1)
+        status = -1;
+
+    if (status == 0)
+        status = MoveQuarantinedFile(quarantine.dirFd, tempName, name, quarantinedName, nameSize);
+
+    //A content addressed sample stored in the meantime makes this copy a duplicate
+    if (status == -1 && errno == EEXIST && contentAddressedQuarantine)
+    {
+        snprintf(quarantinedName, nameSize, "%s", name);
+        method = "duplicate";
+        AddStat(&runStats.quarantineDuplicates, 1);
+        status = 0;
+    }
+
+    if (status == -1 || strcmp(method, "duplicate") == 0)
+    {
+        unlinkat(quarantine.dirFd, tempName, 0);
+        close(copyFd);
+        return status == -1 ? -1 : FinishQuarantine(entryPath, 1, -1, method, &st, digestText, quarantinedName);
+    }
+
+    AddStat(&runStats.quarantineCopies, 1);
+    return FinishQuarantine(entryPath, 1, copyFd, method, &st, digestText, quarantinedName);
+}
+
+
+int OpenQuarantine(const char *isolatedDir)
+{
+    if (quarantine.dirFd != -1)
+        return 0;
+
+    quarantine.dirFd = open(isolatedDir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (quarantine.dirFd == -1)
+        return -1;
+
+    //Every child process appends whole batches of lines, O_APPEND keeps them from overwriting each other
+    int manifestFd = openat(quarantine.dirFd, QUARANTINE_MANIFEST, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+    if (manifestFd == -1 || InitBufferedOutput(&quarantine.manifest, manifestFd) == -1)
+    {
+        if (manifestFd != -1)
+            close(manifestFd);
+
+        close(quarantine.dirFd);
+        quarantine.dirFd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int ContentAddress(int pinFd, mode_t mode, unsigned char *digest)
+{
+    //Files without access rights are made readable, through the pinned descriptor, for the time it takes to open them
+    int fd = OpenPinnedFile(pinFd, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1 && errno == EACCES && ChmodPinnedFile(pinFd, S_IRUSR) == 0)
+    {
+        fd = OpenPinnedFile(pinFd, O_RDONLY | O_CLOEXEC);
+        ChmodPinnedFile(pinFd, mode & 07777);
+    }
+
+    if (fd == -1)
+        return -1;
+
+    unsigned char buffer[HASH_READ_SIZE];
+    Sha256State sha256;
+    ssize_t bytesRead;
+
+    Sha256Init(&sha256);
+
+    while ((bytesRead = read(fd, buffer, sizeof(buffer))) > 0)
+        Sha256Update(&sha256, buffer, bytesRead);
+
+    close(fd);
+
+    if (bytesRead == -1)
+        return -1;
+
+    Sha256Final(&sha256, digest);
+    return 0;
+}
+
+
+int MoveQuarantinedFile(int fromDirFd, const char *fromPath, const char *name, char *quarantinedName, size_t nameSize)
+{
+    //Files of the same name get a numbered suffix, RENAME_NOREPLACE makes the check and the move one step
+    for (int attempt = 1; attempt <= QUARANTINE_MAX_NAME_ATTEMPTS; attempt++)
+    {
+        if (attempt == 1 || contentAddressedQuarantine)
+            snprintf(quarantinedName, nameSize, "%s", name);
+        else
+            snprintf(quarantinedName, nameSize, "%s.%d", name, attempt);
+
+        int status = renameat2(fromDirFd, fromPath, quarantine.dirFd, quarantinedName, RENAME_NOREPLACE);
+
+        //Some file systems and older kernels have no RENAME_NOREPLACE, a hard link also refuses an existing name
+        if (status == -1 && (errno == EINVAL || errno == ENOSYS))
+        {
+            status = linkat(fromDirFd, fromPath, quarantine.dirFd, quarantinedName, 0);
+
+            //The original goes once the quarantined name exists, if it cannot the link is taken back
+            if (status == 0 && unlinkat(fromDirFd, fromPath, 0) == -1)
+            {
+                int savedErrno = errno;
+                unlinkat(quarantine.dirFd, quarantinedName, 0);
+                errno = savedErrno;
+                return -1;
+            }
+        }
+
+        if (status == 0)
+            return 0;
+
+        //Content addressed names never get a suffix, the same name is the same content
+        if (errno != EEXIST || contentAddressedQuarantine)
+            return -1;
+    }
+
+    return -1;
+}
+
+
+int CopyQuarantinedContent(int sourceFd, int copyFd, off_t size, const char **method)
+{
+    //A reflink shares the blocks, which works between subvolumes or mounts of one file system
+    if (ioctl(copyFd, FICLONE, sourceFd) == 0)
+    {
+        *method = "reflink";
+        return 0;
+    }
+
+    //copy_file_range copies inside the kernel, and lets the file system offload it
+    off_t copied = 0;
+    *method = "copy_file_range";
+
+    while (copied < size)
+    {
+        ssize_t length = copy_file_range(sourceFd, NULL, copyFd, NULL, size - copied > QUARANTINE_COPY_CHUNK ? QUARANTINE_COPY_CHUNK : size - copied, 0);
+
+        if (length <= 0)
+            break;
+
+        copied += length;
+    }
+
+    if (copied == size)
+        return 0;
+
+    //Kernels and file systems without it get a plain copy, from where copy_file_range stopped
+    char buffer[HASH_READ_SIZE];
+    ssize_t bytesRead;
+    *method = "copy";
+
+    if (lseek(sourceFd, copied, SEEK_SET) == -1 || lseek(copyFd, copied, SEEK_SET) == -1)
+        return -1;
+
+    while ((bytesRead = read(sourceFd, buffer, sizeof(buffer))) > 0)
+    {
+        if (WriteAll(copyFd, buffer, bytesRead) == -1)
+            return -1;
+    }
+
+    return bytesRead == -1 ? -1 : 0;
+}
+
+
+int FinishQuarantine(const char *entryPath, int removeOriginal, int copyFd, const char *method, const struct stat *st, const char *digestText, const char *quarantinedName)
+{
+    //The original of a copy is only removed once the batch is synced, a crash before that leaves it in place
+    if (removeOriginal && quarantine.numPending == quarantine.pendingCapacity)
+    {
+        size_t newCapacity = quarantine.pendingCapacity ? quarantine.pendingCapacity * 2 : QUARANTINE_SYNC_BATCH;
+        QuarantinePending *newPending = realloc(quarantine.pending, newCapacity * sizeof(QuarantinePending));
+
+        if (!newPending)
+        {
+            if (copyFd != -1)
+            {
+                fdatasync(copyFd);
+                close(copyFd);
+            }
+
+            return RemoveQuarantinedOriginal(entryPath, st->st_dev, st->st_ino);
+        }
+
+        quarantine.pending = newPending;
+        quarantine.pendingCapacity = newCapacity;
+    }
+
+    if (removeOriginal)
+    {
+        quarantine.pending[quarantine.numPending].path = strdup(entryPath);
+        quarantine.pending[quarantine.numPending].dev = st->st_dev;
+        quarantine.pending[quarantine.numPending].ino = st->st_ino;
+        quarantine.pending[quarantine.numPending].copyFd = copyFd;
+        quarantine.numPending++;
+    }
+
+    char timeText[32];
+    time_t now = time(NULL);
+    strftime(timeText, sizeof(timeText), "%Y.%m.%d_%H:%M:%S", localtime(&now));
+
+    //One line per file: time, method, size, content digest with -C, name in the isolated directory, original path
+    BufferedPrintf(&quarantine.manifest, "%s\t%s\t%lld\t%s\t%s\t%s\n", timeText, method, (long long)st->st_size, digestText, quarantinedName, entryPath);
+    quarantine.numUnsynced++;
+
+    if (quarantine.numUnsynced >= QUARANTINE_SYNC_BATCH)
+        FlushQuarantine();
+
+    return 0;
+}
+
+
+void FlushQuarantine(void)
+{
+    if (quarantine.dirFd == -1 || quarantine.numUnsynced == 0)
+        return;
+
+    //The copies reach the disk first, then one fsync of the isolated directory covers every name created in the batch
+    for (size_t i = 0; i < quarantine.numPending; i++)
+    {
+        if (quarantine.pending[i].copyFd != -1)
+        {
+            fdatasync(quarantine.pending[i].copyFd);
+            close(quarantine.pending[i].copyFd);
+        }
+    }
+
+    fsync(quarantine.dirFd);
+
+    //Only now are the originals safe to remove
+    for (size_t i = 0; i < quarantine.numPending; i++)
+    {
+        if (quarantine.pending[i].path && RemoveQuarantinedOriginal(quarantine.pending[i].path, quarantine.pending[i].dev, quarantine.pending[i].ino) == -1 && errno != ENOENT)
+            fprintf(stderr, "Error: Failed to remove \"%s\" after copying it to the isolated directory\n", quarantine.pending[i].path);
+
+        free(quarantine.pending[i].path);
+    }
+
+    FlushBufferedOutput(&quarantine.manifest);
+    fdatasync(quarantine.manifest.fd);
+
+    quarantine.numPending = 0;
+    quarantine.numUnsynced = 0;
+}
+
+
+int RemoveQuarantinedOriginal(const char *path, dev_t dev, ino_t ino)
+{
+    //The original is removed long after it was copied, through its directory so the name checked is the name removed
+    char directory[PATH_MAX];
+    snprintf(directory, sizeof(directory), "%s", path);
+
+    int dirFd = open(dirname(directory), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (dirFd == -1)
+        return -1;
+
+    const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    struct stat st;
+    int status = fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW);
+
+    //Another file now at the path was never copied, it is left in place
+    if (status == 0 && (st.st_dev != dev || st.st_ino != ino))
+    {
+        fprintf(stderr, "Error: \"%s\" was replaced after it was copied to the isolated directory, the new file is left in place\n", path);
+        close(dirFd);
+        return 0;
+    }
+
+    if (status == 0)
+        status = unlinkat(dirFd, name, 0);
+
+    int savedErrno = errno;
+    close(dirFd);
+    errno = savedErrno;
+    return status;
+}
+
+
+void ResolveAnalysisScript(void)
+{
+    char resolved[PATH_MAX];
+    char executable[PATH_MAX];
+
+    //The script in the working directory first, as before, then the one installed next to the program
+    if (realpath(ANALYSIS_SCRIPT, resolved))
+    {
+        snprintf(analysisScript, sizeof(analysisScript), "%s", resolved);
+        return;
+    }
+
+    ssize_t length = readlink("/proc/self/exe", executable, sizeof(executable) - 1);
+
+    if (length <= 0)
+        return;
+
+    executable[length] = '\0';
+    snprintf(resolved, sizeof(resolved), "%s/%s", dirname(executable), ANALYSIS_SCRIPT + 2);
+
+    if (access(resolved, X_OK) == 0)
+        snprintf(analysisScript, sizeof(analysisScript), "%s", resolved);
+}
+
+
+int RunAnalysisScript(const char *entryPath, double deadline)
+{
+    // The path is passed as an argument so it is never truncated or reparsed by a shell
+    pid_t scriptPid = fork();
+
+    if (scriptPid == 0)
+    {
+        setpgid(0, 0); // Own process group, so a timeout also stops the commands the script started
+        execl(analysisScript, analysisScript, entryPath, (char *)NULL);
+        _exit(127); // The script could not be executed
+    }
+    else if (scriptPid < 0)
+        return -1;
+
+    setpgid(scriptPid, scriptPid); // Also set from this side so the kill below cannot miss the group
+
+    int status;
+    struct timespec pause = {0, 2 * 1000 * 1000};
+
+    while (1)
+    {
+        pid_t done = waitpid(scriptPid, &status, deadline > 0 ? WNOHANG : 0);
+
+        if (done == scriptPid)
+            return WIFEXITED(status) ? WEXITSTATUS(status) : -1; // Capture the exit status of the script
+
+        if (done == -1 && errno != EINTR)
+            return -1;
+
+        if (done == 0)
+        {
+            // Past the deadline the script is stopped and the file is left as it is
+            if (MonotonicSeconds() >= deadline)
+            {
+                kill(-scriptPid, SIGKILL);
+                waitpid(scriptPid, NULL, 0);
+                return ANALYSIS_TIMED_OUT;
+            }
+
+            nanosleep(&pause, NULL);
+        }
+    }
+}
+
+
+int AnalyzeEntry(const char *entryPath, mode_t mode, double deadline, struct stat *analyzedSt)
+{
+    double wallStart = MonotonicSeconds(), cpuStart = ThreadCpuSeconds();
+    int verdict;
+    struct stat before;
+
+    if (lstat(entryPath, &before) == -1)
+        before.st_mode = 0;
+
+    if (!scanRules.useScript)
+        verdict = ScanFile(entryPath, before.st_mode ? &before : NULL, &scanRules, deadline);
+    else
+    {
+        // The script opens the file itself, so it stays readable until the script is done.
+        // The mode is changed through the pinned inode, a path swapped for a symlink meanwhile cannot redirect it.
+        struct stat pinnedSt;
+        int pinFd = PinAnalyzedFile(entryPath, before.st_mode ? &before : NULL, &pinnedSt);
+        int fileStatus = -1;
+
+        if (pinFd != -1)
+        {
+            ChmodPinnedFile(pinFd, S_IRUSR);
+            fileStatus = RunAnalysisScript(entryPath, deadline);
+            ChmodPinnedFile(pinFd, mode & 07777);
+            close(pinFd);
+        }
+
+        verdict = fileStatus < 0 ? fileStatus : fileStatus != 0;
+    }
+
+    StatAfterAnalysis(entryPath, &before, analyzedSt);
+
+    // Every analysis is timed where it runs, on a worker or on the traversal thread
+    double duration = MonotonicSeconds() - wallStart;
+
+    AddStat(&runStats.filesAnalyzed, 1);
+    AddStat(&runStats.analysisMicros, (long long)(duration * 1e6));
+    AddStat(&runStats.analysisCpuMicros, (long long)((ThreadCpuSeconds() - cpuStart) * 1e6));
+    AddStat(&runStats.analysisLatency[LatencyBucket(duration)], 1);
+    return verdict;
+}
+
+
+void StatAfterAnalysis(const char *entryPath, const struct stat *before, struct stat *after)
+{
+    // The verdict is only known to hold for the content read if no write landed between the two stats, st_mode 0 marks a stat not to cache under
+    if (before->st_mode == 0 || lstat(entryPath, after) == -1 || after->st_dev != before->st_dev || after->st_ino != before->st_ino ||
+        after->st_size != before->st_size || after->st_mtim.tv_sec != before->st_mtim.tv_sec || after->st_mtim.tv_nsec != before->st_mtim.tv_nsec)
+        after->st_mode = 0;
+}
+
+
+double AnalysisDeadline(void)
+{
+    // 0 stands for no deadline
+    return analysisTimeout > 0 ? MonotonicSeconds() + analysisTimeout : 0;
+}
+
+
+double MonotonicSeconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+AnalysisPool *OpenAnalysisPool(int numThreads)
+{
+    AnalysisPool *pool = calloc(1, sizeof(AnalysisPool));
+
+    if (!pool)
+        return NULL;
+
+    pool->threads = malloc(numThreads * sizeof(pthread_t));
+
+    if (!pool->threads)
+    {
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->jobReady, NULL);
+    pthread_cond_init(&pool->slotFree, NULL);
+    atomic_init(&pool->numResults, 0);
+
+    //A pool missing a few threads still works, one without any is not used
+    for (int i = 0; i < numThreads; i++)
+    {
+        if (pthread_create(&pool->threads[pool->numThreads], NULL, AnalysisWorkerMain, pool) == 0)
+            pool->numThreads++;
+    }
+
+    if (pool->numThreads == 0)
+    {
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->jobReady);
+        pthread_cond_destroy(&pool->slotFree);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+
+int SubmitAnalysisJob(AnalysisPool *pool, const char *entryPath, mode_t mode, InodeRecord *record)
+{
+    //The path buffer of the traversal is reused for the next entry, the job keeps its own copy
+    size_t pathLength = strlen(entryPath);
+    AnalysisJob *job = malloc(sizeof(AnalysisJob) + pathLength + 1);
+
+    if (!job)
+        return -1;
+
+    job->next = NULL;
+    job->mode = mode;
+    job->verdict = -1;
+    job->record = record;
+    memcpy(job->path, entryPath, pathLength + 1);
+
+    pthread_mutex_lock(&pool->lock);
+
+    //A full queue makes the traversal wait for a worker, the memory held by queued jobs stays bounded
+    while (pool->numJobs >= ANALYSIS_QUEUE_SIZE)
+        pthread_cond_wait(&pool->slotFree, &pool->lock);
+
+    if (pool->jobsTail)
+        pool->jobsTail->next = job;
+    else
+        pool->jobsHead = job;
+
+    pool->jobsTail = job;
+    pool->numJobs++;
+
+    pthread_cond_signal(&pool->jobReady);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+
+void *AnalysisWorkerMain(void *arg)
+{
+    AnalysisPool *pool = arg;
+
+    while (1)
+    {
+        pthread_mutex_lock(&pool->lock);
+
+        while (pool->numJobs == 0 && !pool->closing)
+            pthread_cond_wait(&pool->jobReady, &pool->lock);
+
+        //The pool only closes once the traversal is over, so an empty queue then means there is nothing left
+        if (pool->numJobs == 0)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        AnalysisJob *job = pool->jobsHead;
+        pool->jobsHead = job->next;
+
+        if (!pool->jobsHead)
+            pool->jobsTail = NULL;
+
+        pool->numJobs--;
+        pthread_cond_signal(&pool->slotFree);
+        pthread_mutex_unlock(&pool->lock);
+
+        //Each file gets its own deadline, a slow file only holds up the worker analyzing it
+        job->verdict = AnalyzeEntry(job->path, job->mode, AnalysisDeadline(), &job->analyzedSt);
+        job->next = NULL;
+
+        pthread_mutex_lock(&pool->lock);
+
+        if (pool->resultsTail)
+            pool->resultsTail->next = job;
+        else
+            pool->resultsHead = job;
+
+        pool->resultsTail = job;
+        atomic_fetch_add(&pool->numResults, 1);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+
+void DrainAnalysisResults(AnalysisPool *pool, char *isolatedDir)
+{
+    //Most entries are checked while no verdict is waiting, that case does not take the lock
+    if (atomic_load(&pool->numResults) == 0)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    AnalysisJob *job = pool->resultsHead;
+    pool->resultsHead = NULL;
+    pool->resultsTail = NULL;
+    atomic_store(&pool->numResults, 0);
+    pthread_mutex_unlock(&pool->lock);
+
+    //Quarantine, counting and messages all happen on this thread, in the order the verdicts arrived
+    while (job)
+    {
+        AnalysisJob *next = job->next;
+        ApplyAnalysisVerdict(job->path, isolatedDir, job->verdict, job->record, &job->analyzedSt);
+        free(job);
+        job = next;
+    }
+}
+
+
+void CloseAnalysisPool(AnalysisPool *pool, char *isolatedDir)
+{
+    //The workers finish the queued jobs before they stop
+    pthread_mutex_lock(&pool->lock);
+    pool->closing = 1;
+    pthread_cond_broadcast(&pool->jobReady);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->numThreads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    DrainAnalysisResults(pool, isolatedDir);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->jobReady);
+    pthread_cond_destroy(&pool->slotFree);
+    free(pool->threads);
+    free(pool);
+}
+
+
+int LoadScanRules(ScanRules *rules, const char *rulesFile)
+{
+    memset(rules, 0, sizeof(*rules));
+
+    //Defaults reproduce verify_for_malicious.sh: a few keywords, any non ASCII byte, or fewer than 3 lines holding over 1000 words and 2000 characters
+    rules->maxNonAsciiRatio = 0.0;
+    rules->shapeMaxLines = 3;
+    rules->shapeMinWords = 1000;
+    rules->shapeMinChars = 2000;
+
+    if (!rulesFile)
+    {
+        const char *keywords[] = {"corrupted", "dangerous", "risk", "attack", "malware", "malicious"};
+
+        for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++)
+        {
+            if (AddScanPattern(rules, (const unsigned char *)keywords[i], strlen(keywords[i])) == -1)
+                return -1;
+        }
+
+        return BuildScanAutomaton(rules);
+    }
+
+    FILE *file = fopen(rulesFile, "r");
+
+    if (!file)
+    {
+        fprintf(stderr, "Error: Failed to open the rule set \"%s\"\n", rulesFile);
+        return -1;
+    }
+
+    char line[1024];
+    int lineNumber = 0;
+    int status = 0;
+
+    //One rule per line: keyword <text>, pattern <hex bytes>, max_non_ascii_ratio <ratio>, shape <max lines> <min words> <min chars>
+    while (status == 0 && fgets(line, sizeof(line), file))
+    {
+        lineNumber++;
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+
+        if (strncmp(line, "keyword ", 8) == 0 && line[8] != '\0')
+            status = AddScanPattern(rules, (const unsigned char *)line + 8, strlen(line + 8));
+        else if (strncmp(line, "pattern ", 8) == 0)
+        {
+            //Hex digits, two per byte, spaces between bytes are allowed
+            unsigned char bytes[sizeof(line) / 2];
+            size_t numBytes = 0;
+            unsigned int byte;
+            int consumed;
+
+            for (const char *cursor = line + 8; *cursor; cursor += consumed)
+            {
+                if (*cursor == ' ')
+                {
+                    consumed = 1;
+                    continue;
+                }
+
+                if (sscanf(cursor, "%2x%n", &byte, &consumed) != 1)
+                {
+                    numBytes = 0;
+                    break;
+                }
+
+                bytes[numBytes++] = byte;
+            }
+
+            status = numBytes ? AddScanPattern(rules, bytes, numBytes) : -1;
+        }
+        else if (sscanf(line, "max_non_ascii_ratio %lf", &rules->maxNonAsciiRatio) == 1)
+            ;
+        else if (sscanf(line, "shape %ld %ld %ld", &rules->shapeMaxLines, &rules->shapeMinWords, &rules->shapeMinChars) == 3)
+            ;
+        else
+            status = -1;
+
+        if (status == -1)
+            fprintf(stderr, "Error: Invalid rule on line %d of \"%s\"\n", lineNumber, rulesFile);
+    }
+
+    fclose(file);
+    return status == -1 ? -1 : BuildScanAutomaton(rules);
+}
+
+
+int AddScanPattern(ScanRules *rules, const unsigned char *pattern, size_t length)
+{
+    unsigned char **newPatterns = realloc(rules->patterns, (rules->numPatterns + 1) * sizeof(unsigned char *));
+    size_t *newLengths = realloc(rules->patternLengths, (rules->numPatterns + 1) * sizeof(size_t));
+
+    if (newPatterns)
+        rules->patterns = newPatterns;
+
+    if (newLengths)
+        rules->patternLengths = newLengths;
+
+    if (!newPatterns || !newLengths || !(rules->patterns[rules->numPatterns] = malloc(length)))
+    {
+        fprintf(stderr, "Error: Memory allocation failed for the rule set\n");
+        return -1;
+    }
+
+    memcpy(rules->patterns[rules->numPatterns], pattern, length);
+    rules->patternLengths[rules->numPatterns] = length;
+    rules->numPatterns++;
+    return 0;
+}
+
+
+int BuildScanAutomaton(ScanRules *rules)
+{
+    size_t maxStates = 1;
+
+    for (int i = 0; i < rules->numPatterns; i++)
+        maxStates += rules->patternLengths[i];
+
+    rules->transitions = malloc(maxStates * 256 * sizeof(int32_t));
+    rules->matchStates = calloc(maxStates, 1);
+    int32_t *failure = calloc(maxStates, sizeof(int32_t));
+    int32_t *queue = malloc(maxStates * sizeof(int32_t));
+
+    if (!rules->transitions || !rules->matchStates || !failure || !queue)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for the rule set\n");
+        free(failure);
+        free(queue);
+        return -1;
+    }
+
+    memset(rules->transitions, -1, maxStates * 256 * sizeof(int32_t));
+    rules->numStates = 1;
+
+    //Building the trie of all keywords and byte patterns
+    for (int i = 0; i < rules->numPatterns; i++)
+    {
+        int32_t state = 0;
+
+        for (size_t j = 0; j < rules->patternLengths[i]; j++)
+        {
+            int32_t *next = &rules->transitions[state * 256 + rules->patterns[i][j]];
+
+            if (*next == -1)
+                *next = rules->numStates++;
+
+            state = *next;
+        }
+
+        rules->matchStates[state] = 1;
+    }
+
+    //Breadth first pass turning the trie into a complete automaton: a missing transition follows the failure link,
+    //so the scan does exactly one table lookup per byte
+    size_t queueHead = 0, queueTail = 0;
+
+    for (int c = 0; c < 256; c++)
+    {
+        int32_t *next = &rules->transitions[c];
+
+        if (*next == -1)
+            *next = 0;
+        else
+        {
+            failure[*next] = 0;
+            queue[queueTail++] = *next;
+        }
+    }
+
+    while (queueHead < queueTail)
+    {
+        int32_t state = queue[queueHead++];
+
+        for (int c = 0; c < 256; c++)
+        {
+            int32_t *next = &rules->transitions[state * 256 + c];
+
+            if (*next == -1)
+                *next = rules->transitions[failure[state] * 256 + c];
+            else
+            {
+                failure[*next] = rules->transitions[failure[state] * 256 + c];
+                rules->matchStates[*next] |= rules->matchStates[failure[*next]];
+                queue[queueTail++] = *next;
+            }
+        }
+    }
+
+    //First bytes of the patterns, the scan skips blocks holding none of them while no match is in progress
+    rules->numFirstBytes = 0;
+
+    for (int c = 0; c < 256 && rules->numFirstBytes >= 0; c++)
+    {
+        if (rules->transitions[c] == 0)
+            continue;
+
+        if (rules->numFirstBytes == MAX_SCAN_FIRST_BYTES)
+            rules->numFirstBytes = -1;
+        else
+            rules->firstBytes[rules->numFirstBytes++] = c;
+    }
+
+    free(failure);
+    free(queue);
+    return 0;
+}
+
+
+int ScanFile(const char *entryPath, const struct stat *expected, const ScanRules *rules, double deadline)
+{
+    //The path may have been swapped for a symlink, a device or a fifo since it was stat'ed, only the pinned inode is touched
+    struct stat pinnedSt;
+    int pinFd = PinAnalyzedFile(entryPath, expected, &pinnedSt);
+
+    if (pinFd == -1)
+        return -1;
+
+    //The file is only readable for as long as it takes to open it
+    ChmodPinnedFile(pinFd, S_IRUSR);
+    int fd = OpenPinnedFile(pinFd, O_RDONLY | O_CLOEXEC | O_NONBLOCK); //A fifo must not block the analysis
+    ChmodPinnedFile(pinFd, pinnedSt.st_mode & 07777);
+    close(pinFd);
+
+    if (fd == -1)
+        return -1;
+
+    //A read stuck on a slow or hung filesystem is interrupted by the watchdog once the deadline passes
+    timer_t watchdog;
+    int watching = deadline > 0 ? StartScanWatchdog(deadline, &watchdog) : 0;
+
+    if (watching == -1)
+    {
+        close(fd);
+        return ANALYSIS_TIMED_OUT;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    unsigned char *buffer = malloc(SCAN_BUFFER_SIZE);
+
+    if (!buffer)
+    {
+        if (watching)
+            timer_delete(watchdog);
+
+        close(fd);
+        return -1;
+    }
+
+    ScanState state;
+    memset(&state, 0, sizeof(state));
+    state.previousWasSpace = 1;
+
+    ssize_t bytesRead;
+    double readStart = MonotonicSeconds();
+    int timedOut = 0;
+
+    //Streaming the file once, the automaton state and the word boundary carry over between chunks
+    while (!state.matched && !timedOut && (bytesRead = read(fd, buffer, SCAN_BUFFER_SIZE)) != 0)
+    {
+        //Interrupted: given up past the deadline, otherwise the read is simply retried
+        if (bytesRead == -1)
+        {
+            if (errno != EINTR)
+                break;
+
+            timedOut = deadline > 0 && MonotonicSeconds() >= deadline;
+            continue;
+        }
+
+        GovernorObserve(GOVERNOR_OP_READ, MonotonicSeconds() - readStart, bytesRead);
+        GovernorCharge(0, bytesRead);
+
+        ScanChunk(&state, rules, buffer, bytesRead);
+        AddStat(&runStats.bytesAnalyzed, bytesRead);
+
+        //A file too large or too slow to read within the timeout is given up
+        timedOut = deadline > 0 && MonotonicSeconds() >= deadline;
+        readStart = MonotonicSeconds();
+    }
+
+    if (watching)
+        timer_delete(watchdog);
+
+    free(buffer);
+    close(fd);
+
+    if (timedOut)
+        return ANALYSIS_TIMED_OUT;
+
+    if (bytesRead == -1)
+        return -1;
+
+    return ScanVerdict(&state, rules);
+}
+
+
+int PinAnalyzedFile(const char *entryPath, const struct stat *expected, struct stat *pinnedSt)
+{
+    //O_PATH needs no access rights, and O_NOFOLLOW pins the symlink itself if the path became one
+    int pinFd = open(entryPath, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+
+    if (pinFd == -1)
+        return -1;
+
+    //Only the regular file that was stat'ed before is handled, anything else at the path is left alone
+    if (fstat(pinFd, pinnedSt) == -1 || !S_ISREG(pinnedSt->st_mode) ||
+        (expected && (pinnedSt->st_dev != expected->st_dev || pinnedSt->st_ino != expected->st_ino)))
+    {
+        close(pinFd);
+        return -1;
+    }
+
+    return pinFd;
+}
+
+
+int ChmodPinnedFile(int pinFd, mode_t mode)
+{
+    //fchmod refuses O_PATH descriptors, the /proc link resolves to the pinned inode without looking at the path again
+    char procPath[32];
+    snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d", pinFd);
+    return chmod(procPath, mode);
+}
+
+
+int OpenPinnedFile(int pinFd, int flags)
+{
+    //Reopening through /proc opens the pinned inode with the access rights it has now
+    char procPath[32];
+    snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d", pinFd);
+    return open(procPath, flags);
+}
+
+
+void InstallScanWatchdog(void)
+{
+    //No SA_RESTART, so a read blocked when the watchdog fires returns EINTR
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = InterruptScan;
+    sigemptyset(&action.sa_mask);
+    sigaction(SCAN_WATCHDOG_SIGNAL, &action, NULL);
+}
+
+
+void InterruptScan(int signalNumber)
+{
+    //Only there to interrupt the read, the scanner checks its deadline itself
+    (void)signalNumber;
+}
+
+
+int StartScanWatchdog(double deadline, timer_t *timer)
+{
+    double remaining = deadline - MonotonicSeconds();
+
+    if (remaining <= 0)
+        return -1;
+
+    //The signal goes to the thread that scans, not to whichever thread of the process the kernel picks
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SCAN_WATCHDOG_SIGNAL;
+    event._sigev_un._tid = syscall(SYS_gettid);
+
+    if (timer_create(CLOCK_MONOTONIC, &event, timer) == -1)
+        return 0; //Without a watchdog the deadline is still checked between reads
+
+    struct itimerspec expiry = {{0, SCAN_WATCHDOG_INTERVAL_NS}, {(time_t)remaining, (long)((remaining - (time_t)remaining) * 1e9)}};
+
+    //A zero expiry would disarm the timer
+    if (expiry.it_value.tv_sec == 0 && expiry.it_value.tv_nsec == 0)
+        expiry.it_value.tv_nsec = 1;
+
+    timer_settime(*timer, 0, &expiry, NULL);
+    return 1;
+}
+
+
+void ScanChunk(ScanState *state, const ScanRules *rules, const unsigned char *data, size_t length)
+{
+    size_t i = 0;
+    state->chars += length;
+
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i controlRange = _mm_set1_epi8(4);
+
+    //16 bytes at a time: counting lines, words and non ASCII bytes with masks, and skipping blocks that cannot start a match
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+
+        //Whitespace is ' ' or a byte between '\t' and '\r'
+        __m128i fromTab = _mm_sub_epi8(block, tab);
+        __m128i isControl = _mm_cmpeq_epi8(_mm_min_epu8(fromTab, controlRange), fromTab);
+        unsigned int spaces = _mm_movemask_epi8(_mm_or_si128(isControl, _mm_cmpeq_epi8(block, space)));
+
+        state->nonAscii += __builtin_popcount(_mm_movemask_epi8(block));
+        state->lines += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
+
+        //A word starts at a non space byte that follows a space
+        unsigned int followsSpace = ((spaces << 1) | state->previousWasSpace) & 0xFFFF;
+        state->words += __builtin_popcount(~spaces & followsSpace & 0xFFFF);
+        state->previousWasSpace = (spaces >> 15) & 1;
+
+        size_t start = 0;
+
+        if (state->automatonState == 0 && rules->numFirstBytes >= 0)
+        {
+            unsigned int candidates = 0;
+
+            for (int j = 0; j < rules->numFirstBytes; j++)
+                candidates |= _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(rules->firstBytes[j])));
+
+            if (!candidates)
+                continue;
+
+            start = __builtin_ctz(candidates);
+        }
+
+        for (size_t j = start; j < 16; j++)
+        {
+            state->automatonState = rules->transitions[state->automatonState * 256 + data[i + j]];
+
+            if (rules->matchStates[state->automatonState])
+            {
+                state->matched = 1;
+                return;
+            }
+        }
+    }
+#endif
+
+    //Remaining bytes, or the whole chunk without SSE2
+    for (; i < length; i++)
+    {
+        unsigned char byte = data[i];
+        int isSpace = byte == ' ' || (byte >= '\t' && byte <= '\r');
+
+        state->nonAscii += byte >= 0x80;
+        state->lines += byte == '\n';
+        state->words += !isSpace && state->previousWasSpace;
+        state->previousWasSpace = isSpace;
+
+        state->automatonState = rules->transitions[state->automatonState * 256 + byte];
+
+        if (rules->matchStates[state->automatonState])
+        {
+            state->matched = 1;
+            return;
+        }
+    }
+}
+
+
+int ScanVerdict(const ScanState *state, const ScanRules *rules)
+{
+    //A keyword or byte pattern was found
+    if (state->matched)
+        return 1;
+
+    //Too many bytes outside of ASCII, a negative ratio turns the rule off
+    if (rules->maxNonAsciiRatio >= 0 && state->chars > 0 && (double)state->nonAscii / state->chars > rules->maxNonAsciiRatio)
+        return 1;
+
+    //Very few lines holding a lot of text, a negative line limit turns the rule off
+    if (rules->shapeMaxLines >= 0 && state->lines < rules->shapeMaxLines && state->words > rules->shapeMinWords && state->chars > rules->shapeMinChars)
+        return 1;
+
+    return 0;
+}
+
+
+int ComputeEntryDigest(int dirFd, const char *name, const struct stat *st, unsigned char *digest)
+{
+    //Only the content of regular files is hashed
+    if (hashAlgorithm == HASH_NONE || !S_ISREG(st->st_mode))
+        return 0;
+
+    //Files whose identity, size and timestamps did not change since the last run are not read again
+    if (hashCache && LookupHashCache(hashCache, st, digest))
+    {
+        atomic_fetch_add(&hashCache->numReused, 1);
+        return 1;
+    }
+
+    if (HashFile(dirFd, name, digest) == -1)
+        return 0;
+
+    if (hashCache)
+        atomic_fetch_add(&hashCache->numHashed, 1);
+
+    return 1;
+}
+
+
+int HashFile(int dirFd, const char *name, unsigned char *digest)
+{
+    //O_NOATIME keeps the hashing from dirtying every inode, it is only allowed to the owner of the file
+    int fd = openat(dirFd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NONBLOCK | O_NOATIME);
+
+    if (fd == -1 && errno == EPERM)
+        fd = openat(dirFd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NONBLOCK);
+
+    if (fd == -1)
+        return -1;
+
+    //Every file is read once from start to end, the kernel can read ahead aggressively
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    unsigned char buffer[HASH_READ_SIZE];
+    Xxh64State xxh64;
+    Sha256State sha256;
+    ssize_t bytesRead;
+
+    if (hashAlgorithm == HASH_SHA256)
+        Sha256Init(&sha256);
+    else
+        Xxh64Init(&xxh64);
+
+    long long bytesHashed = 0;
+    double readStart = MonotonicSeconds();
+
+    while ((bytesRead = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        //Every chunk is paid for after it is read, its read time counts towards the latency average
+        GovernorObserve(GOVERNOR_OP_READ, MonotonicSeconds() - readStart, bytesRead);
+        GovernorCharge(0, bytesRead);
+
+        if (hashAlgorithm == HASH_SHA256)
+            Sha256Update(&sha256, buffer, bytesRead);
+        else
+            Xxh64Update(&xxh64, buffer, bytesRead);
+
+        bytesHashed += bytesRead;
+        readStart = MonotonicSeconds();
+    }
+
+    AddStat(&runStats.filesHashed, 1);
+    AddStat(&runStats.bytesHashed, bytesHashed);
+
+    //The pages were only needed for the digest, dropping them keeps a full hash of the tree from evicting the page cache
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+
+    if (bytesRead == -1)
+        return -1;
+
+    if (hashAlgorithm == HASH_SHA256)
+        Sha256Final(&sha256, digest);
+    else
+        Xxh64Final(&xxh64, digest);
+
+    return 0;
+}
+
+
+int HashDigestLength(int algorithm)
+{
+    //0 for HASH_NONE and unknown hash functions
+    return algorithm == HASH_XXH64 ? 8 : algorithm == HASH_SHA256 ? 32 : 0;
+}
+
+
+const char *HashAlgorithmName(int algorithm)
+{
+    return algorithm == HASH_XXH64 ? "xxh64" : algorithm == HASH_SHA256 ? "sha256" : "none";
+}
+
+
+void FormatDigest(const unsigned char *digest, int length, char *text)
+{
+    const char hexDigits[] = "0123456789abcdef";
+
+    for (int i = 0; i < length; i++)
+    {
+        text[2 * i] = hexDigits[digest[i] >> 4];
+        text[2 * i + 1] = hexDigits[digest[i] & 0xf];
+    }
+
+    text[2 * length] = '\0';
+}
+
+
+int ParseDigest(const char *text, SnapshotEntry *entry)
+{
+    //The digest line reads name:hex, like the "Hash: xxh64:..." lines written to text snapshots
+    const char *separator = strchr(text, ':');
+
+    if (!separator)
+        return -1;
+
+    int algorithm = HASH_NONE;
+
+    if (separator - text == 5 && strncmp(text, "xxh64", 5) == 0)
+        algorithm = HASH_XXH64;
+    else if (separator - text == 6 && strncmp(text, "sha256", 6) == 0)
+        algorithm = HASH_SHA256;
+
+    int length = HashDigestLength(algorithm);
+    const char *hex = separator + 1;
+
+    if (!length || strlen(hex) != (size_t)(2 * length))
+        return -1;
+
+    for (int i = 0; i < 2 * length; i++)
+    {
+        char c = hex[i];
+        int value = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+
+        if (value == -1)
+            return -1;
+
+        if (i % 2 == 0)
+            entry->digest[i / 2] = value << 4;
+        else
+            entry->digest[i / 2] |= value;
+    }
+
+    entry->hashAlgorithm = algorithm;
+    return 0;
+}
+
+
+uint64_t RotateLeft64(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+
+uint64_t ReadLittleEndian64(const unsigned char *data)
+{
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return le64toh(value);
+}
+
+
+uint64_t Xxh64Round(uint64_t accumulator, uint64_t input)
+{
+    accumulator += input * XXH64_PRIME2;
+    return RotateLeft64(accumulator, 31) * XXH64_PRIME1;
+}
+
+
+uint64_t Xxh64MergeRound(uint64_t hash, uint64_t accumulator)
+{
+    hash ^= Xxh64Round(0, accumulator);
+    return hash * XXH64_PRIME1 + XXH64_PRIME4;
+}
+
+
+void Xxh64Init(Xxh64State *state)
+{
+    //Seed 0, the digests match the ones printed by xxhsum -H64
+    memset(state, 0, sizeof(*state));
+    state->accumulators[0] = XXH64_PRIME1 + XXH64_PRIME2;
+    state->accumulators[1] = XXH64_PRIME2;
+    state->accumulators[2] = 0;
+    state->accumulators[3] = -XXH64_PRIME1;
+}
+
+
+void Xxh64Update(Xxh64State *state, const unsigned char *data, size_t length)
+{
+    state->totalLength += length;
+
+    //Completing the stripe left over from the previous call
+    if (state->buffered)
+    {
+        size_t missing = 32 - state->buffered;
+
+        if (length < missing)
+        {
+            memcpy(state->buffer + state->buffered, data, length);
+            state->buffered += length;
+            return;
+        }
+
+        memcpy(state->buffer + state->buffered, data, missing);
+        data += missing;
+        length -= missing;
+
+        for (int i = 0; i < 4; i++)
+            state->accumulators[i] = Xxh64Round(state->accumulators[i], ReadLittleEndian64(state->buffer + 8 * i));
+
+        state->buffered = 0;
+    }
+
+    //Four independent lanes of 8 bytes per 32 byte stripe
+    uint64_t v1 = state->accumulators[0], v2 = state->accumulators[1], v3 = state->accumulators[2], v4 = state->accumulators[3];
+
+    for (; length >= 32; data += 32, length -= 32)
+    {
+        v1 = Xxh64Round(v1, ReadLittleEndian64(data));
+        v2 = Xxh64Round(v2, ReadLittleEndian64(data + 8));
+        v3 = Xxh64Round(v3, ReadLittleEndian64(data + 16));
+        v4 = Xxh64Round(v4, ReadLittleEndian64(data + 24));
+    }
+
+    state->accumulators[0] = v1;
+    state->accumulators[1] = v2;
+    state->accumulators[2] = v3;
+    state->accumulators[3] = v4;
+
+    memcpy(state->buffer, data, length);
+    state->buffered = length;
+}
+
+
+void Xxh64Final(Xxh64State *state, unsigned char *digest)
+{
+    uint64_t hash;
+    const uint64_t *v = state->accumulators;
+
+    if (state->totalLength >= 32)
+    {
+        hash = RotateLeft64(v[0], 1) + RotateLeft64(v[1], 7) + RotateLeft64(v[2], 12) + RotateLeft64(v[3], 18);
+
+        for (int i = 0; i < 4; i++)
+            hash = Xxh64MergeRound(hash, v[i]);
+    }
+    else
+        hash = XXH64_PRIME5;
+
+    hash += state->totalLength;
+
+    //Folding in the bytes that did not fill a stripe
+    const unsigned char *data = state->buffer;
+    size_t length = state->buffered;
+
+    for (; length >= 8; data += 8, length -= 8)
+    {
+        hash ^= Xxh64Round(0, ReadLittleEndian64(data));
+        hash = RotateLeft64(hash, 27) * XXH64_PRIME1 + XXH64_PRIME4;
+    }
+
+    if (length >= 4)
+    {
+        uint32_t word;
+        memcpy(&word, data, sizeof(word));
+        hash ^= (uint64_t)le32toh(word) * XXH64_PRIME1;
+        hash = RotateLeft64(hash, 23) * XXH64_PRIME2 + XXH64_PRIME3;
+        data += 4;
+        length -= 4;
+    }
+
+    for (; length > 0; data++, length--)
+    {
+        hash ^= *data * XXH64_PRIME5;
+        hash = RotateLeft64(hash, 11) * XXH64_PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH64_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH64_PRIME3;
+    hash ^= hash >> 32;
+
+    //Stored big endian, so the hex form reads like the canonical xxHash output
+    for (int i = 0; i < 8; i++)
+        digest[i] = hash >> (56 - 8 * i);
+}
+
+
+//Round constants of SHA-256
+const uint32_t SHA256_K[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+
+uint32_t RotateRight32(uint32_t value, int bits)
+{
+    return (value >> bits) | (value << (32 - bits));
+}
+
+
+void Sha256Init(Sha256State *state)
+{
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+    memset(state, 0, sizeof(*state));
+    memcpy(state->h, initial, sizeof(initial));
+}
+
+
+void Sha256Update(Sha256State *state, const unsigned char *data, size_t length)
+{
+    state->totalLength += length;
+
+    //Completing the block left over from the previous call
+    if (state->buffered)
+    {
+        size_t missing = 64 - state->buffered;
+
+        if (length < missing)
+        {
+            memcpy(state->buffer + state->buffered, data, length);
+            state->buffered += length;
+            return;
+        }
 
-void ExploreDirectories(const char *path, int snapshotFd, char *isolatedPath);
+        memcpy(state->buffer + state->buffered, data, missing);
+        Sha256Transform(state, state->buffer);
+        data += missing;
+        length -= missing;
+        state->buffered = 0;
+    }
 
-void CreateSnapshot(char *path, char *outputDir, char *isolatedDir);
+    for (; length >= 64; data += 64, length -= 64)
+        Sha256Transform(state, data);
 
-void PreviousSnapshotCompare(const char *outpuPpath, const char *snapshotFileName);
+    memcpy(state->buffer, data, length);
+    state->buffered = length;
+}
 
-int CompareSnapshots(const char *outputDir, const char *currentSnapshotFile);
 
-void CheckPermissionsAndAnalyze(const char *entryPath, struct stat fileStats, char *isolatedDir, int snapshotFd);
+void Sha256Final(Sha256State *state, unsigned char *digest)
+{
+    uint64_t bitLength = state->totalLength * 8;
+    unsigned char padding[128] = {0x80};
 
-int AnalyzeFile(const char *entryPath, int pipeFd);
+    //Padding to 56 bytes past a block boundary, then the message length in bits, big endian
+    size_t paddingLength = state->buffered < 56 ? 56 - state->buffered : 120 - state->buffered;
 
-void HandleAnalysisResult(int pipeFd[2], const char *entryPath, char *isolatedDir, pid_t pid);
+    for (int i = 0; i < 8; i++)
+        padding[paddingLength + i] = bitLength >> (56 - 8 * i);
 
-int main(int argc, char *argv[]) 
-{
-    write(STDOUT_FILENO, "\n", 1); // Write a newline character to stdout for formatting
+    Sha256Update(state, padding, paddingLength + 8);
 
-    // Check if there are sufficient arguments provided
-    if (argc < 6) 
+    for (int i = 0; i < 8; i++)
     {
-        // Print an error message to stderr and exit with failure status
-        write(STDERR_FILENO, "error: Insufficient arguments! Exiting.\n", strlen("error: Insufficient arguments! Exiting.\n"));
-        exit(EXIT_FAILURE);
+        digest[4 * i] = state->h[i] >> 24;
+        digest[4 * i + 1] = state->h[i] >> 16;
+        digest[4 * i + 2] = state->h[i] >> 8;
+        digest[4 * i + 3] = state->h[i];
     }
+}
 
-     // Initialize variables to store output path and isolated path
-    char *outputPath = NULL;
-    char *isolatedPath = NULL;
 
-    // Parse command-line arguments to extract output and isolated paths
-    for (int i = 1; i < argc; i++) 
-    {
-        if (strcmp(argv[i], "-o") == 0) 
-        {
-            // Set the output path from the next argument
-            outputPath = argv[i + 1];
-            i++; // Skip the next argument since it's the value for the option
-        } 
-        else if (strcmp(argv[i], "-s") == 0) 
-        {
-            // Set the isolated path from the next argument
-            isolatedPath = argv[i + 1];
-            i++; // Skip the next argument since it's the value for the option
-        }
-    }
+void Sha256Transform(Sha256State *state, const unsigned char *block)
+{
+    uint32_t w[64];
 
-    // Check if both output path and isolated path are provided
-    if (outputPath == NULL || isolatedPath == NULL) 
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+
+    for (int i = 16; i < 64; i++)
     {
-        // Print an error message to stderr and exit with failure status
-        write(STDERR_FILENO, "error: Invalid arguments! Exiting.\n", strlen("error: Invalid arguments! Exiting.\n"));
-        exit(EXIT_FAILURE);
+        uint32_t s0 = RotateRight32(w[i - 15], 7) ^ RotateRight32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = RotateRight32(w[i - 2], 17) ^ RotateRight32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
     }
 
-    pid_t pid;
+    uint32_t a = state->h[0], b = state->h[1], c = state->h[2], d = state->h[3];
+    uint32_t e = state->h[4], f = state->h[5], g = state->h[6], h = state->h[7];
 
-    // Forking for each directory provided as argument
-    for (int i = 1; i < argc; i++) 
+    for (int i = 0; i < 64; i++)
     {
-        if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "-s") == 0) 
-        {
-            i++; // Skip the next argument 
-        } 
-        else 
-        {
-            // Get the path of the directory to process
-            char *path = argv[i];
-            pid = fork(); // Fork a new process
-            numProcesses++; // Increment the count of processes
+        uint32_t t1 = h + (RotateRight32(e, 6) ^ RotateRight32(e, 11) ^ RotateRight32(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+        uint32_t t2 = (RotateRight32(a, 2) ^ RotateRight32(a, 13) ^ RotateRight32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
 
-            if (pid == 0) 
-            {
-                // Child process: perform snapshot creation and exit with success
-                CreateSnapshot(path, outputPath, isolatedPath);
-                fprintf(stdout, "Child Process %d terminated (PID: %d) - %d corrupted files found in \"%s\"\n", numProcesses, getpid(), numCorruptedFiles, monitoredDirName);
-                return EXIT_SUCCESS;
-            } 
-            else if (pid < 0) 
-            {
-                // Fork failed: print an error message and exit with failure
-                write(STDERR_FILENO, "Error: Fork failed!\n", strlen("Error: Fork failed!\n"));
-                return EXIT_FAILURE;
-            }
-        }
-    }
-
-    // Waiting for all child processes to finish
-    for (int i = 1; i < argc; i++) 
-    {
-        if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "-s") == 0) 
-        {
-            i++; // Skip the next argument
-        } 
-        else 
-        {
-            wait(NULL); // Parent process: wait for a child process to terminate
-        }
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
     }
 
-    write(STDOUT_FILENO, "\n", 1); // Write a newline character to stdout for formatting
-    return EXIT_SUCCESS;  // Exit the main function with success status
+    state->h[0] += a;
+    state->h[1] += b;
+    state->h[2] += c;
+    state->h[3] += d;
+    state->h[4] += e;
+    state->h[5] += f;
+    state->h[6] += g;
+    state->h[7] += h;
 }
 
 
-void ExploreDirectories(const char *path, int snapshotFd, char *isolatedPath) 
+int OpenStatCache(StatCache *cache, const char *path, const char *magic, uint32_t version, uint64_t tag, size_t payloadSize)
 {
-    DIR *dir = opendir(path);
-    struct dirent *dirEntry;
+    memset(cache, 0, sizeof(*cache));
+    snprintf(cache->path, sizeof(cache->path), "%s", path);
+    snprintf(cache->tempPath, sizeof(cache->tempPath), "%s.tmp", path);
+    cache->magic = magic;
+    cache->version = version;
+    cache->tag = tag;
+    cache->payloadSize = payloadSize;
+    cache->recordSize = (sizeof(StatCacheRecord) + payloadSize + 7) & ~(size_t)7;
 
-    char *entryPath = NULL; //Stores the name and path of every directory entry
-    char *fileInfo = NULL; //Stores the information of every directory entry
+    //Loading the previous cache, a missing, damaged or differently tagged one only means every file is read again
+    int fd = open(cache->path, O_RDONLY | O_CLOEXEC);
+    StatCacheHeader header;
+    struct stat st;
 
-    //Checks if the directory opening was sufccesful, if not, it printsan error messagew and exists the function
-    if (!dir) 
+    if (fd != -1 && fstat(fd, &st) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(header.magic, magic, sizeof(header.magic)) == 0 && header.version == version && header.tag == tag &&
+        header.recordSize == cache->recordSize && header.numRecords < UINT32_MAX &&
+        (uint64_t)st.st_size == sizeof(header) + header.numRecords * cache->recordSize)
     {
-        fprintf(stderr, "Error: Failed to open directory \"%s\"\n", monitoredDirName);
-        return;
-    }
+        size_t numSlots = 16;
+        size_t length = header.numRecords * cache->recordSize;
 
-    //Enters a loop that reads each entry (file or subdirectory) within the opened directory.
-    while ((dirEntry = readdir(dir)) != NULL) 
-    {
-        //does not print the entries "." & ".."  in the snapshot file
-        if (strcmp(dirEntry->d_name, ".") == 0 || strcmp(dirEntry->d_name, "..") == 0)
-            continue;
+        while (numSlots < header.numRecords * 2)
+            numSlots *= 2;
 
-        //Allocates memory for the full path of the current directory entry (dirEntry). The +2 accounts for the potential separator ('/') and null terminator.
-        entryPath = realloc(entryPath, strlen(path) + strlen(dirEntry->d_name) + 2);
-        
-        //If the memory alication fails, the loop will break and will not monitorise further
-        if (!entryPath) 
+        cache->records = malloc(length + 1);
+        cache->slots = calloc(numSlots, sizeof(uint32_t));
+
+        if (cache->records && cache->slots && pread(fd, cache->records, length, sizeof(header)) == (ssize_t)length)
         {
-            fprintf(stderr, "Error: Memory allocation failed for path \"%s\"\n", path);
-            free(entryPath);
-            break;
-        }
+            cache->numRecords = header.numRecords;
+            cache->slotMask = numSlots - 1;
 
-        sprintf(entryPath, "%s/%s", path, dirEntry->d_name); //Constructs the path for every entry
+            //Linear probing on the inode, the table is at most half full
+            for (size_t i = 0; i < cache->numRecords; i++)
+            {
+                const StatCacheRecord *record = (const StatCacheRecord *)(cache->records + i * cache->recordSize);
+                size_t slot = (record->ino * XXH64_PRIME1 ^ record->dev) & cache->slotMask;
 
-        struct stat st;
+                while (cache->slots[slot])
+                    slot = (slot + 1) & cache->slotMask;
 
-        //We get information with lstat and print the error message in case of failing
-        if (lstat(entryPath, &st) == -1) 
-        {
-            fprintf(stderr, "Error: Failed to get information for \"%s\"\n", dirEntry->d_name);
-            free(entryPath);
-            break;
+                cache->slots[slot] = i + 1;
+            }
         }
-        else 
-          CheckPermissionsAndAnalyze(entryPath, st, isolatedPath, snapshotFd);
-
-        //Gets the size of each line used for reallocaating memory 
-        size_t dataLength = snprintf(NULL, 0, "Path: %s\nSize: %ld bytes\nPermissions: %c%c%c %c%c%c %c%c%c\nHard Links: %ld\n", entryPath, st.st_size, (st.st_mode & S_IRUSR) ? 'r' : '-', (st.st_mode & S_IWUSR) ? 'w' : '-', (st.st_mode & S_IXUSR) ? 'x' : '-', (st.st_mode & S_IRGRP) ? 'r' : '-', (st.st_mode & S_IWGRP) ? 'w' : '-', (st.st_mode & S_IXGRP) ? 'x' : '-', (st.st_mode & S_IROTH) ? 'r' : '-', (st.st_mode & S_IWOTH) ? 'w' : '-', (st.st_mode & S_IXOTH) ? 'x' : '-', st.st_nlink);
-
-        //Reallocating memory for fileInfo then write in it
-        fileInfo = realloc(fileInfo, dataLength + 1);
-        
-        //Verify if memory allocation works, if not, print error message
-        if (!fileInfo) 
+        else
         {
-            fprintf(stderr, "Error: Memory allocation failed for entry \"%s\"\n", dirEntry->d_name);
-            free(fileInfo);
-            break;
+            free(cache->records);
+            free(cache->slots);
+            cache->records = NULL;
+            cache->slots = NULL;
         }
+    }
 
-        sprintf(fileInfo, "Path: %s\nSize: %ld bytes\nPermissions: %c%c%c %c%c%c %c%c%c\nHard Links: %ld\n", entryPath, st.st_size, (st.st_mode & S_IRUSR) ? 'r' : '-', (st.st_mode & S_IWUSR) ? 'w' : '-', (st.st_mode & S_IXUSR) ? 'x' : '-', (st.st_mode & S_IRGRP) ? 'r' : '-', (st.st_mode & S_IWGRP) ? 'w' : '-', (st.st_mode & S_IXGRP) ? 'x' : '-', (st.st_mode & S_IROTH) ? 'r' : '-', (st.st_mode & S_IWOTH) ? 'w' : '-', (st.st_mode & S_IXOTH) ? 'x' : '-', st.st_nlink);
+    if (fd != -1)
+        close(fd);
 
-        //Writing to the snapshot file the fileInfo and new line
-        write(snapshotFd, fileInfo, strlen(fileInfo));
-        write(snapshotFd, "\n", 1);
+    //The records of this run go to a new file, the header is completed once their number is known
+    int outputFd = open(cache->tempPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
 
-        //If an entry is a directory, call the function again recursively with a new path
-        if (S_ISDIR(st.st_mode)) 
+    if (outputFd == -1 || InitBufferedOutput(&cache->output, outputFd) == -1)
+    {
+        if (outputFd != -1)
         {
-            ExploreDirectories(entryPath, snapshotFd, isolatedPath);
+            close(outputFd);
+            unlink(cache->tempPath);
         }
+
+        free(cache->records);
+        free(cache->slots);
+        return -1;
     }
 
-    free(entryPath);
-    free(fileInfo);
-    closedir(dir);
+    memset(&header, 0, sizeof(header));
+    BufferedWrite(&cache->output, &header, sizeof(header));
+    return 0;
 }
 
 
-void CreateSnapshot(char *path, char *outputDir, char *isolatedDir) 
+const unsigned char *LookupStatCache(const StatCache *cache, const struct stat *st)
 {
-    char *dirName = basename((char *)path);  //From libgen library, gets the name of the input directory
-    monitoredDirName = dirName; //Storing the name in a global variable
+    if (!cache->numRecords)
+        return NULL;
 
-    //Checks if the directory given as argument for monitoring exist. If the path is incorrect the error message will be printed to stderr and it will be skipped.
-    DIR *dirCheck = opendir(path);
-    if (!dirCheck) 
-    {
-        fprintf(stderr, "Error: Directory \"%s\" does not exist.\n", dirName);
-        return;
-    }
-    closedir(dirCheck);
+    size_t slot = ((uint64_t)st->st_ino * XXH64_PRIME1 ^ (uint64_t)st->st_dev) & cache->slotMask;
 
-    //Checking if the output directory given as argument exists. If it does not exists, then the directory will be created.
-    dirCheck=opendir(outputDir);
-    if (!dirCheck) 
+    for (; cache->slots[slot]; slot = (slot + 1) & cache->slotMask)
     {
-        mkdir(outputDir, 0777);
-    }
-    closedir(dirCheck);
+        const StatCacheRecord *record = (const StatCacheRecord *)(cache->records + (cache->slots[slot] - 1) * cache->recordSize);
 
-    //Checking if the isolated directory given as argument exists. If it does not exists, then the directory will be created.
-    dirCheck=opendir(isolatedDir);
-    if (!dirCheck) 
-    {
-        mkdir(isolatedDir, 0777);
-    }
-    closedir(dirCheck);
+        if (record->ino != (uint64_t)st->st_ino || record->dev != (uint64_t)st->st_dev)
+            continue;
 
-    char snapshotFilePath[PATH_MAX];  //Buffer for storing the name of the snapshot file
-    time_t now = time(NULL);
-    struct tm *timestamp = localtime(&now);
-    char timestampStr[32];
-    time(&now); 
+        //Any write changes mtime and ctime, a rewrite restoring the mtime or a chmod still moves the ctime
+        if (record->size != (uint64_t)st->st_size || record->mtimeSec != st->st_mtim.tv_sec || record->mtimeNsec != (uint32_t)st->st_mtim.tv_nsec ||
+            record->ctimeSec != st->st_ctim.tv_sec || record->ctimeNsec != (uint32_t)st->st_ctim.tv_nsec)
+            return NULL;
 
-    strftime(timestampStr, sizeof(timestampStr), "%Y.%m.%d_%H:%M:%S", timestamp);
+        return (const unsigned char *)(record + 1);
+    }
 
-    //Constructing the snapshot file name
-    snprintf(snapshotFilePath, sizeof(snapshotFilePath), "%s/%s_Snapshot_%s.txt", outputDir, dirName, timestampStr);
+    return NULL;
+}
 
-    int snapshotFd = open(snapshotFilePath, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-    
-    if (snapshotFd == -1) 
-    {
-        fprintf(stderr, "Error: Failed to open snapshot file \"%s\"\n", snapshotFilePath);
-        return;
-    }
 
-    clock_t startTime = clock(); //Getting the cpu time used for ExploreDirectories function
-    ExploreDirectories(path, snapshotFd, isolatedDir);
-    clock_t endTime = clock();
+void AddStatCacheRecord(StatCache *cache, const struct stat *st, const void *payload)
+{
+    unsigned char buffer[sizeof(StatCacheRecord) + HASH_MAX_DIGEST_SIZE + 8];
+    StatCacheRecord *record = (StatCacheRecord *)buffer;
 
-    double duration = (double)(endTime - startTime) / CLOCKS_PER_SEC;
+    memset(buffer, 0, cache->recordSize);
+    record->dev = st->st_dev;
+    record->ino = st->st_ino;
+    record->size = st->st_size;
+    record->mtimeSec = st->st_mtim.tv_sec;
+    record->mtimeNsec = st->st_mtim.tv_nsec;
+    record->ctimeSec = st->st_ctim.tv_sec;
+    record->ctimeNsec = st->st_ctim.tv_nsec;
 
-    fprintf(stdout, "Snapshot created successfully for \"%s\" in %.2f seconds.\n", dirName, duration);
+    if (cache->payloadSize)
+        memcpy(record + 1, payload, cache->payloadSize);
 
-    close(snapshotFd);
-    PreviousSnapshotCompare(outputDir, snapshotFilePath);
+    BufferedWrite(&cache->output, buffer, cache->recordSize);
+    cache->numWritten++;
 }
 
 
-void PreviousSnapshotCompare(const char *outpuPath, const char *snapshotFileName)
+void CloseStatCache(StatCache *cache)
 {
-    DIR *d=opendir(outpuPath);
-    struct dirent *dirEntry;
-
-    //Checks if the directory opening was successful. If opening fails, it prints an error message to stderr and returns from the function.                                                                                
-    if(!d)
-    {
-        fprintf(stderr, "Error: Failed to open the output directory  \"%s\"\n", monitoredDirName);
-        return;
-    }
+    FlushBufferedOutput(&cache->output);
 
-    //Initializes variables used to track snapshot numbers and file names.
-    int prevSnapshotNr=0;
-    int currentSnapshotNo=1;
-    char prevSnapshotFileName[FILENAME_MAX];
+    StatCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, cache->magic, sizeof(header.magic));
+    header.version = cache->version;
+    header.recordSize = cache->recordSize;
+    header.tag = cache->tag;
+    header.numRecords = cache->numWritten;
 
-    //Iterates through each directory entry
-    while((dirEntry = readdir(d)) != NULL)
-    {
-        // Check if the directory entry corresponds to a monitored directory and a snapshot file
-        if(!(strstr(dirEntry->d_name, monitoredDirName) == dirEntry->d_name && strstr(dirEntry->d_name, "_Snapshot_") != NULL)) 
-          continue;
-
-        // Constructing the name of the previous snapshot file by copying and concatenating strings.
-        if(prevSnapshotNr < currentSnapshotNo)
-        {
-            strcpy(prevSnapshotFileName, outpuPath);    
-            strcat(prevSnapshotFileName, "/");            
-            strcat(prevSnapshotFileName, dirEntry->d_name);
-        }
-        prevSnapshotNr++;   
-    }
-    
-    //Checks if a valid previous snapshot file was found.If fewer than 2 snapshot files are found, it means no previous snapshot exists, and it prints a message before returning.
-    if(prevSnapshotNr < 2)
-    {
-        fprintf(stdout, "No snapshots were previously created for  \"%s\"\n", monitoredDirName);
-        return;
-    }
-        
-    //Calls the CompareSnapshots function to compare the current snapshot with the previous snapshot 
-    int IsDifferent=CompareSnapshots(prevSnapshotFileName, snapshotFileName);
+    //The new cache only replaces the old one once it is complete
+    if (!cache->output.failed && pwrite(cache->output.fd, &header, sizeof(header), 0) == sizeof(header))
+        rename(cache->tempPath, cache->path);
+    else
+        unlink(cache->tempPath);
 
-    //Depending on the comparison result, it prints a message indicating whether differences were found between snapshots.
-    if(!IsDifferent) //If no differences, it deletes the previous snapshot file.
-    {   
-        fprintf(stdout, "No differences found between the current and the previous snapshot for  \"%s\"\n", monitoredDirName);
-        unlink(prevSnapshotFileName); 
-    }
-    else //If differences exist, it overrides the previous snapshot by renaming the current snapshot file.
-    {
-        fprintf(stdout, "Difference found between the current and the previous snapshot => Overriding the previous snapshot for  \"%s\"\n", monitoredDirName);
-        unlink(prevSnapshotFileName);  
-        rename(snapshotFileName, prevSnapshotFileName);  
-    } 
-    
-    closedir(d);
+    close(cache->output.fd);
+    FreeBufferedOutput(&cache->output);
+    free(cache->records);
+    free(cache->slots);
 }
 
 
-int CompareSnapshots(const char *prevSnapshotFile, const char *currentSnapshotFile) 
+HashCache *OpenHashCache(const char *outputDir, const char *dirName)
 {
-    int snapshotFdCurrent=open(currentSnapshotFile, O_RDONLY, S_IRUSR); // Open the current snapshot file for reading
-    
-    // Print error message if failed to open current snapshot file
-    if(snapshotFdCurrent == -1)
-    {
-        fprintf(stderr, "Error: Failed to open the current snapshot file for  \"%s\"\n", monitoredDirName);
-        return -1;
-    }
+    HashCache *cache = calloc(1, sizeof(HashCache));
+    char path[PATH_MAX];
 
-    int snapshotFdPrev=open(prevSnapshotFile, O_RDONLY, S_IRUSR); // Open the previous snapshot file for reading
+    if (!cache)
+        return NULL;
 
-    // Print error message if failed to open previous snapshot file                                                      
-    if(snapshotFdPrev == -1)
+    //Digests taken with another hash function are of no use, the function is the tag of the cache
+    snprintf(path, sizeof(path), "%s/%s_HashCache.bin", outputDir, dirName);
+
+    if (OpenStatCache(&cache->table, path, HASH_CACHE_MAGIC, HASH_CACHE_VERSION, hashAlgorithm, HashDigestLength(hashAlgorithm)) == -1)
     {
-        fprintf(stderr, "Error: Failed to open the previous snapshot file for  \"%s\"\n", monitoredDirName);
-        return -1;
+        free(cache);
+        return NULL;
     }
 
-    //Initializes variables
-    char currentLine[MAX_LINE]; //store lines read from snapshot files
-    char prevLine[MAX_LINE]; //store lines read from snapshot files
+    cache->runStart = time(NULL);
+    atomic_init(&cache->numHashed, 0);
+    atomic_init(&cache->numReused, 0);
+    return cache;
+}
+
 
-    int IsDifferent=0; //track whether differences are found between snapshot files
-    
-    ssize_t currentRead, prevRead; //store the number of bytes read from each file
+int LookupHashCache(const HashCache *cache, const struct stat *st, unsigned char *digest)
+{
+    const unsigned char *payload = LookupStatCache(&cache->table, st);
 
-    do
-    { 
-        //Reads lines from both snapshot files until the end of either file is reached
-        currentRead=read(snapshotFdCurrent, currentLine, sizeof(currentLine)-1);
-        prevRead=read(snapshotFdPrev, prevLine, sizeof(prevLine)-1);
+    if (!payload)
+        return 0;
 
-        currentLine[currentRead]='\0';
-        prevLine[prevRead]='\0';
+    memcpy(digest, payload, cache->table.payloadSize);
+    return 1;
+}
 
-        //Checks if the number of bytes read are different.Compares the content of the read lines using strcmp
-        if((currentRead!=prevRead) || strcmp(currentLine, prevLine)!=0)
-        {
-            IsDifferent=1; //If differences are found (line lengths differ or content is different), sets IsDifferent to 1 and breaks out of the loop.
-            break;
-        }
-    }
-    while(currentRead > 0 && prevRead > 0); //Reading and comparing untill end of files
 
-    //Closes the file descriptors of both snapshot files after reading and comparison are completed
-    close(snapshotFdCurrent);
-    close(snapshotFdPrev);
+void AddHashCacheRecord(HashCache *cache, const struct stat *st, const unsigned char *digest)
+{
+    //A file changed within the same second as the run could change again without its timestamps moving
+    if (st->st_mtim.tv_sec >= cache->runStart - 1 || st->st_ctim.tv_sec >= cache->runStart - 1)
+        return;
 
-    return IsDifferent; //Returns IsDifferent (0 if no differences were found, 1 if differences were found) to the calling function (PreviousSnapshotCompare).
+    AddStatCacheRecord(&cache->table, st, digest);
 }
 
 
-void CheckPermissionsAndAnalyze(const char *entryPath, struct stat filePermission, char *isolatedDir, int snapshotFd) 
+void CloseHashCache(HashCache *cache)
 {
-    pid_t pid;
-    int pipe_fd[2];
+    CloseStatCache(&cache->table);
+    free(cache);
+}
 
-    // Create a pipe for inter-process communication
-    if (pipe(pipe_fd) == -1) 
-    {
-        // If pipe creation fails, print an error message and return
-        write(STDERR_FILENO, "Error: Pipe creation failed!\n", strlen("Error: Pipe creation failed!\n"));
-        return;
-    }
 
-    // Check if file has no access rights (read, write, execute)
-    if (!(filePermission.st_mode & S_IXUSR) && !(filePermission.st_mode & S_IRUSR) && !(filePermission.st_mode & S_IWUSR) &&
-        !(filePermission.st_mode & S_IRGRP) && !(filePermission.st_mode & S_IWGRP) && !(filePermission.st_mode & S_IXGRP) &&
-        !(filePermission.st_mode & S_IROTH) && !(filePermission.st_mode & S_IWOTH) && !(filePermission.st_mode & S_IXOTH)) 
+uint64_t ComputeRulesVersion(const ScanRules *rules)
+{
+    Xxh64State state;
+    unsigned char digest[8];
+    Xxh64Init(&state);
+
+    //The script is fingerprinted by its content, editing it invalidates every cached verdict
+    if (rules->useScript)
     {
-         // Print message indicating no access rights and perform syntactic analysis
-        fprintf(stdout, "No access rights for \"%s\" in \"%s\" => Performing Syntactic Analysis.\n", basename((char *)entryPath), monitoredDirName);
+        int fd = open(analysisScript, O_RDONLY | O_CLOEXEC);
+        unsigned char buffer[4096];
+        ssize_t bytesRead = 0;
 
-        int fileStatus;
-        pid = fork(); // Create a new process (child process)
-        numSubProcesses++; // Create a new process (child process)
+        while (fd != -1 && (bytesRead = read(fd, buffer, sizeof(buffer))) > 0)
+            Xxh64Update(&state, buffer, bytesRead);
 
-        if (pid == 0) 
-        {
-            // Child process: close unnecessary file descriptors and execute file analysis
-            close(snapshotFd); // Close the file descriptor associated with the snapshot
-            close(pipe_fd[0]); // Close the read end of the pipe
+        if (fd != -1)
+            close(fd);
 
-            fileStatus = AnalyzeFile(entryPath, pipe_fd[1]); // Execute file analysis and write results to pipe
+        Xxh64Update(&state, (const unsigned char *)"script", 6);
+    }
+    else
+    {
+        //Every pattern with its length, then the limits in text form so the fingerprint does not depend on the float layout
+        char limits[128];
 
-            close(pipe_fd[1]); // Close the write end of the pipe
-            exit(fileStatus); // Exit the child process with the file analysis status
-        } 
-        else if (pid < 0) 
-        {
-            // Fork failed: print an error message and return
-            write(STDERR_FILENO, "Error: Fork failed for child process!\n", strlen("Error: Fork failed for child process!\n"));
-            return;
-        } 
-        else 
+        for (int i = 0; i < rules->numPatterns; i++)
         {
-            // Parent process: handle analysis result from the child process
-            HandleAnalysisResult(pipe_fd, entryPath, isolatedDir, pid);
+            uint64_t length = rules->patternLengths[i];
+            Xxh64Update(&state, (const unsigned char *)&length, sizeof(length));
+            Xxh64Update(&state, rules->patterns[i], rules->patternLengths[i]);
         }
 
-        // Print termination message for the subprocess
-        fprintf(stdout, "Subprocess %d.%d (PID: %d) terminated with exit code %d for \"%s\" in \"%s\"\n", numProcesses, numSubProcesses, getpid(), pid, basename((char *)entryPath), monitoredDirName);
-        write(STDOUT_FILENO, "\n", 1);  // Write a newline to stdout
+        int length = snprintf(limits, sizeof(limits), "%.17g %ld %ld %ld", rules->maxNonAsciiRatio, rules->shapeMaxLines, rules->shapeMinWords, rules->shapeMinChars);
+        Xxh64Update(&state, (const unsigned char *)limits, length);
     }
+
+    Xxh64Final(&state, digest);
+
+    uint64_t version = 0;
+
+    for (int i = 0; i < 8; i++)
+        version = version << 8 | digest[i];
+
+    return version;
 }
 
 
-int AnalyzeFile(const char *entryPath, int pipeFd) 
+VerdictCache *OpenVerdictCache(const char *outputDir, const char *dirName)
 {
-    int giveAccess = chmod(entryPath, S_IRUSR); // Grant read permission to the file using chmod
+    VerdictCache *cache = calloc(1, sizeof(VerdictCache));
+    char path[PATH_MAX];
 
-    // Create a command string to execute a shell script for analyzing file for malicious content
-    char scriptCommand[100];
-    snprintf(scriptCommand, sizeof(scriptCommand), "./verify_for_malicious.sh \"%s\"", entryPath);
+    if (!cache)
+        return NULL;
 
-    int fileStatus = system(scriptCommand); // Execute the shell script command and capture its exit status
-    write(pipeFd, &fileStatus, sizeof(fileStatus)); // Write the exit status of the shell script to the pipe for communication with the parent process
-    close(pipeFd); // Close the write end of the pipe
+    //The fingerprint of the rules is the tag, a cache written with other rules or by another version is ignored as a whole
+    snprintf(path, sizeof(path), "%s/%s_VerdictCache.bin", outputDir, dirName);
 
-    giveAccess = chmod(entryPath, 0); // Revoke read permission from the file
-    close(giveAccess); // Close the file descriptor associated with the permission change
+    if (OpenStatCache(&cache->table, path, VERDICT_CACHE_MAGIC, VERDICT_CACHE_VERSION, scanRules.version, 0) == -1)
+    {
+        free(cache);
+        return NULL;
+    }
 
-    return fileStatus; // Return the exit status of the shell script (indicating analysis result)
+    cache->runStart = time(NULL);
+    return cache;
 }
 
-void HandleAnalysisResult(int pipeFd[2], const char *entryPath, char *isolatedDir, pid_t pid) 
+
+int LookupVerdictCache(const VerdictCache *cache, const struct stat *st)
 {
-    close(pipeFd[1]); // Close the write end of the pipe (not needed for reading)
+    return LookupStatCache(&cache->table, st) != NULL;
+}
 
-    // Read the analysis result (fileStatus) from the pipe
-    int fileStatus;
-    read(pipeFd[0], &fileStatus, sizeof(fileStatus));
-    close(pipeFd[0]); // Close the read end of the pipe after reading
 
-    // Check the analysis result 
-    if (fileStatus != 0) 
-    {
-        // Prepare isolated directory path for moving the corrupted/malicious file
-        if (isolatedDir[strlen(isolatedDir) - 1] != '/')
-            strcat(isolatedDir, "/");
+void AddVerdictCacheRecord(VerdictCache *cache, const struct stat *st)
+{
+    //On file systems with whole second timestamps a write later in the second of the mtime would keep it.
+    //The ctime is no help there, the analysis itself moved it to the current second.
+    if (st->st_mtim.tv_nsec == 0 && st->st_mtim.tv_sec >= cache->runStart - 1)
+        return;
 
-        strcat(isolatedDir, basename((char *)entryPath));
-        rename(entryPath, isolatedDir); // Move the corrupted/malicious file to the isolated directory
+    AddStatCacheRecord(&cache->table, st, NULL);
+}
 
-        numCorruptedFiles++; // Increment the count of corrupted/malicious files
-        
-        // Print a message indicating the file is malicious or corrupted and has been moved
-        fprintf(stdout, "\"%s\" in \"%s\" is malicious or corrupted => Moved to isolated directory.\n", basename((char *)entryPath), monitoredDirName);
-    } 
-    else 
-    {
-        // Print a message indicating the file is safe
-        fprintf(stdout, "\"%s\" in \"%s\" is safe.\n", basename((char *)entryPath), monitoredDirName);
-    }
+
+void CloseVerdictCache(VerdictCache *cache)
+{
+    CloseStatCache(&cache->table);
+    free(cache);
 }